@@ -1,17 +1,410 @@
 #include "cowfs.hpp"
+#include "cowfs_metadata.hpp"
+#include "cowfs_checksum.hpp"
+#include "cowfs_zero.hpp"
 #include <fstream>
 #include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <new>
+#include <string>
 #include <stdexcept>
 #include <chrono>
-#include <iomanip>
-#include <sstream>
+#include <ctime>
 #include <iostream>
 #include <algorithm>  // Para std::find_if
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 namespace cowfs {
 
-COWFileSystem::COWFileSystem(const std::string& disk_path, size_t disk_size)
-    : disk_path(disk_path), disk_size(disk_size), free_blocks_list(nullptr) {
+namespace {
+
+// Contenido de un hueco
+alignas(64) const uint8_t ZERO_BLOCK[BLOCK_SIZE] = {};
+
+// Lee una lista de nodos como "0-3,6" (formato de /sys/devices/system/node/online)
+bool read_online_nodes(unsigned long* mask, size_t mask_bits) {
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string list;
+    if (!std::getline(online, list)) {
+        return false;
+    }
+    size_t pos = 0;
+    bool any = false;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        std::string range = list.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        size_t dash = range.find('-');
+        unsigned long first = std::strtoul(range.c_str(), nullptr, 10);
+        unsigned long last = dash == std::string::npos ? first
+                                                       : std::strtoul(range.c_str() + dash + 1, nullptr, 10);
+        for (unsigned long node = first; node <= last && node < mask_bits; node++) {
+            mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+            any = true;
+        }
+        if (end == std::string::npos) {
+            break;
+        }
+        pos = end + 1;
+    }
+    return any;
+}
+
+// mbind(2) sin depender de libnuma. Debe aplicarse antes del primer acceso a
+// las paginas, que es cuando el kernel las asigna a un nodo
+bool apply_numa_policy(void* addr, size_t length, const ArenaOptions& options) {
+#if defined(__linux__) && defined(SYS_mbind)
+    constexpr int MPOL_BIND_MODE = 2;
+    constexpr int MPOL_INTERLEAVE_MODE = 3;
+    constexpr size_t MASK_BITS = 1024;
+    unsigned long mask[MASK_BITS / (8 * sizeof(unsigned long))] = {};
+
+    int mode = 0;
+    if (options.numa_policy == NumaPolicy::INTERLEAVE) {
+        if (!read_online_nodes(mask, MASK_BITS)) {
+            return false;
+        }
+        mode = MPOL_INTERLEAVE_MODE;
+    } else {
+        if (options.numa_node < 0 || static_cast<size_t>(options.numa_node) >= MASK_BITS) {
+            return false;
+        }
+        mask[options.numa_node / (8 * sizeof(unsigned long))] |=
+            1UL << (options.numa_node % (8 * sizeof(unsigned long)));
+        mode = MPOL_BIND_MODE;
+    }
+    return syscall(SYS_mbind, addr, length, mode, mask, MASK_BITS, 0) == 0;
+#else
+    (void)addr;
+    (void)length;
+    (void)options;
+    return false;
+#endif
+}
+
+} // namespace
+
+BlockStore::~BlockStore() {
+    release();
+}
+
+void BlockStore::release() {
+    cache.reset();
+    arena_region.release();
+    if (backing_fd >= 0) {
+        ::close(backing_fd);
+    }
+    payload = nullptr;
+    count = 0;
+    committed_bytes = 0;
+    backing_fd = -1;
+}
+
+void BlockStore::resize(size_t block_count, const ArenaOptions& requested,
+                        const std::string& backing_path) {
+    release();
+    options = requested;
+
+    // El espacio de direcciones se reserva alineado a 2 MiB para que el
+    // kernel pueda usar paginas grandes desde el primer bloque. Sin maximo
+    // explicito la reserva es proporcional al disco: reservar de mas no
+    // ocupa memoria, pero cuenta contra `ulimit -v`
+    const size_t bytes = block_count * BLOCK_SIZE;
+    size_t limit = requested.max_bytes > 0 ? std::max(bytes, requested.max_bytes)
+                                           : std::max(bytes * ARENA_RESERVE_FACTOR, ARENA_MIN_RESERVE);
+    limit = (limit + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (!arena_region.reserve(limit, HUGE_PAGE_SIZE) ||
+        !ref_count.reserve(limit / BLOCK_SIZE) || !checksum.reserve(limit / BLOCK_SIZE) ||
+        !flags.reserve(limit / BLOCK_SIZE) || !head_owner.reserve(limit / BLOCK_SIZE) ||
+        !ref_count.resize(block_count) || !checksum.resize(block_count) || !flags.resize(block_count) ||
+        !head_owner.resize(block_count)) {
+        throw std::bad_alloc();
+    }
+    payload = arena_region.data();
+
+    if (requested.cache_bytes > 0 && !backing_path.empty()) {
+        backing_fd = ::open(backing_path.c_str(), O_RDWR | O_CREAT, 0644);
+        options.huge_pages = HugePageMode::NONE;
+        options.numa_policy = NumaPolicy::DEFAULT;
+        if (backing_fd >= 0 && commit_arena(bytes)) {
+            size_t capacity = std::max<size_t>(1, requested.cache_bytes / BLOCK_SIZE);
+            cache.reset(new BlockCache(block_count, limit / BLOCK_SIZE, capacity, CACHE_SHARDS,
+                                       [this](size_t block, bool dirty) { evict(block, dirty); }));
+            count = block_count;
+            return;
+        }
+        if (backing_fd >= 0) {
+            ::close(backing_fd);
+            backing_fd = -1;
+        }
+        std::cerr << "BlockStore: No se pudo mapear " << backing_path
+                  << ", la arena queda en memoria" << std::endl;
+        options.huge_pages = requested.huge_pages;
+        options.numa_policy = requested.numa_policy;
+    }
+    options.cache_bytes = 0;
+
+    if (!commit_arena(bytes)) {
+        throw std::bad_alloc();
+    }
+    count = block_count;
+}
+
+bool BlockStore::commit_arena(size_t bytes) {
+    // Con paginas grandes explicitas se compromete de 2 MiB en 2 MiB
+    size_t unit = options.huge_pages == HugePageMode::EXPLICIT ? HUGE_PAGE_SIZE : BLOCK_SIZE;
+    bytes = (bytes + unit - 1) / unit * unit;
+    if (bytes <= committed_bytes) {
+        arena_region.decommit(bytes, committed_bytes - bytes);
+        if (backed()) {
+            ftruncate(backing_fd, static_cast<off_t>(bytes));
+        }
+        committed_bytes = bytes;
+        return true;
+    }
+
+    uint8_t* start = payload + committed_bytes;
+    size_t length = bytes - committed_bytes;
+    if (backing_fd >= 0) {
+        // El archivo crece sin ocupar disco: las zonas nuevas son huecos
+        if (ftruncate(backing_fd, static_cast<off_t>(bytes)) != 0 ||
+            mmap(start, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, backing_fd,
+                 static_cast<off_t>(committed_bytes)) == MAP_FAILED) {
+            return false;
+        }
+        // Sin lectura anticipada del kernel: traeria bloques que la cache
+        // no cuenta. La anticipacion la decide COWFileSystem por descriptor
+        madvise(start, length, MADV_RANDOM);
+        committed_bytes = bytes;
+        return true;
+    }
+
+    // Las paginas anonimas valen cero y no se tocan aqui, asi que no hace
+    // falta memset y la politica NUMA se aplica antes del primer acceso
+    bool mapped = false;
+    if (options.huge_pages == HugePageMode::EXPLICIT) {
+        mapped = mmap(start, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED, -1, 0) != MAP_FAILED;
+        if (!mapped) {
+            std::cerr << "BlockStore: MAP_HUGETLB no disponible, se usan paginas grandes transparentes" << std::endl;
+            options.huge_pages = HugePageMode::TRANSPARENT;
+            arena_region.decommit(committed_bytes, length);
+        }
+    }
+    if (!mapped && !arena_region.protect(committed_bytes, length)) {
+        return false;
+    }
+    if (options.huge_pages == HugePageMode::TRANSPARENT) {
+#ifdef MADV_HUGEPAGE
+        if (madvise(start, length, MADV_HUGEPAGE) != 0) {
+            options.huge_pages = HugePageMode::NONE;
+        }
+#else
+        options.huge_pages = HugePageMode::NONE;
+#endif
+    }
+    if (options.numa_policy != NumaPolicy::DEFAULT && !apply_numa_policy(start, length, options)) {
+        std::cerr << "BlockStore: No se pudo aplicar la politica NUMA, se usa la del proceso" << std::endl;
+        options.numa_policy = NumaPolicy::DEFAULT;
+    }
+    committed_bytes = bytes;
+    return true;
+}
+
+bool BlockStore::grow(size_t block_count, bool may_move) {
+    if (block_count < count ||
+        (block_count * BLOCK_SIZE > arena_region.capacity() && !reserve_more(block_count, may_move))) {
+        return false;
+    }
+    if (!ref_count.resize(block_count) || !checksum.resize(block_count) ||
+        !flags.resize(block_count) || !head_owner.resize(block_count) ||
+        (cache && !cache->resize(block_count)) || !commit_arena(block_count * BLOCK_SIZE)) {
+        ref_count.resize(count);
+        checksum.resize(count);
+        flags.resize(count);
+        head_owner.resize(count);
+        if (cache) {
+            cache->resize(count);
+        }
+        return false;
+    }
+    count = block_count;
+    return true;
+}
+
+bool BlockStore::reserve_more(size_t block_count, bool may_move) {
+    if (options.max_bytes > 0) {
+        return false;  // Reserva fija pedida con ArenaOptions::max_bytes
+    }
+    size_t limit = block_count * BLOCK_SIZE * ARENA_RESERVE_FACTOR;
+    limit = (limit + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (!arena_region.extend(limit)) {
+        if (!may_move) {
+            std::cerr << "BlockStore: La arena tendria que moverse y hay punteros a sus bloques" << std::endl;
+            return false;
+        }
+        if (!move_arena(limit)) {
+            return false;
+        }
+    }
+    // Los arreglos se copian como mucho una vez por ampliacion y solo sus
+    // paginas escritas
+    size_t max_blocks = arena_region.capacity() / BLOCK_SIZE;
+    return ref_count.reserve_more(max_blocks) && checksum.reserve_more(max_blocks) &&
+           flags.reserve_more(max_blocks) && head_owner.reserve_more(max_blocks) &&
+           (!cache || cache->reserve_more(max_blocks));
+}
+
+bool BlockStore::move_arena(size_t limit) {
+    ReservedRegion previous;
+    if (!previous.reserve(limit, HUGE_PAGE_SIZE)) {
+        return false;
+    }
+    arena_region.swap(previous);
+    uint8_t* old_payload = payload;
+    size_t old_committed = committed_bytes;
+    payload = arena_region.data();
+    committed_bytes = 0;
+    // Con archivo de respaldo basta con mapearlo en el sitio nuevo: las
+    // paginas sucias del mapeo anterior siguen en la cache del kernel
+    if (old_committed > 0 && !commit_arena(old_committed)) {
+        arena_region.swap(previous);
+        payload = old_payload;
+        committed_bytes = old_committed;
+        return false;
+    }
+    if (!backed()) {
+        // En memoria solo se copian los bloques en uso; los libres no se leen
+        // hasta volver a escribirlos
+        for (size_t start = 0; start < count; ) {
+            if (!is_used(start)) {
+                start++;
+                continue;
+            }
+            size_t end = start + 1;
+            while (end < count && is_used(end)) {
+                end++;
+            }
+            std::memcpy(payload + start * BLOCK_SIZE, old_payload + start * BLOCK_SIZE,
+                        (end - start) * BLOCK_SIZE);
+            start = end;
+        }
+    }
+    std::cout << "BlockStore: Arena movida para reservar " << limit << " bytes" << std::endl;
+    return true;
+}
+
+void BlockStore::shrink(size_t block_count) {
+    if (block_count >= count) {
+        return;
+    }
+    if (cache) {
+        cache->resize(block_count);
+    }
+    commit_arena(block_count * BLOCK_SIZE);
+    ref_count.resize(block_count);
+    checksum.resize(block_count);
+    flags.resize(block_count);
+    head_owner.resize(block_count);
+    count = block_count;
+}
+
+void BlockStore::evict(size_t index, bool dirty) {
+    // Se llama con el lock del shard tomado, asi que no espera al disco: un
+    // bloque modificado solo se encola para escritura (MS_ASYNC) y sus
+    // paginas siguen sucias en la cache del kernel hasta que se escriban. La
+    // durabilidad la da flush() en los puntos de guardado
+    uint8_t* block = data(index);
+    if (dirty) {
+        msync(block, BLOCK_SIZE, MS_ASYNC);
+    }
+    madvise(block, BLOCK_SIZE, MADV_DONTNEED);
+    // Las paginas limpias salen ya de la cache del kernel; las sucias se
+    // quedan hasta que termine su escritura
+    posix_fadvise(backing_fd, static_cast<off_t>(index * BLOCK_SIZE), BLOCK_SIZE, POSIX_FADV_DONTNEED);
+}
+
+void BlockStore::discard(size_t start, size_t n) {
+    if (!backed()) {
+        // Devolver las paginas las deja en cero sin escribirlas; con
+        // MAP_HUGETLB no se puede soltar menos de una pagina grande
+        if (madvise(data(start), n * BLOCK_SIZE, MADV_DONTNEED) != 0) {
+            std::memset(data(start), 0, n * BLOCK_SIZE);
+        }
+        return;
+    }
+    // Los bloques libres no se leen hasta volver a escribirlos: se sacan de la
+    // cache sin escribirlos y se libera su espacio en el archivo
+    for (size_t i = start; i < start + n; i++) {
+        cache->forget(i);
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    fallocate(backing_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              static_cast<off_t>(start * BLOCK_SIZE), static_cast<off_t>(n * BLOCK_SIZE));
+#endif
+    madvise(data(start), n * BLOCK_SIZE, MADV_DONTNEED);
+}
+
+bool BlockStore::import_blocks(std::istream& in, size_t start, size_t n) {
+    const size_t bytes = n * BLOCK_SIZE;
+    if (!backed()) {
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(data(start)), bytes));
+    }
+    // Al archivo de respaldo se copia por tramos con pwrite para no hacer
+    // residentes los bloques a traves del mapeo
+    static constexpr size_t CHUNK_BYTES = 1 << 20;
+    std::vector<char> chunk(std::min(CHUNK_BYTES, bytes));
+    for (size_t done = 0; done < bytes; ) {
+        size_t len = std::min(chunk.size(), bytes - done);
+        if (!in.read(chunk.data(), len) ||
+            pwrite(backing_fd, chunk.data(), len, static_cast<off_t>(start * BLOCK_SIZE + done)) !=
+                static_cast<ssize_t>(len)) {
+            return false;
+        }
+        done += len;
+    }
+    return true;
+}
+
+void BlockStore::finish_import() {
+    if (backed()) {
+        fdatasync(backing_fd);
+        posix_fadvise(backing_fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+bool BlockStore::flush() {
+    if (!backed()) {
+        return true;
+    }
+    if (msync(payload, committed_bytes, MS_SYNC) != 0) {
+        return false;
+    }
+    cache->mark_clean();
+    return true;
+}
+
+BlockCacheStats BlockStore::cache_stats() const {
+    if (!cache) {
+        return BlockCacheStats{0, 0, 0, 0, 0, 0};
+    }
+    return cache->stats();
+}
+
+COWFileSystem::COWFileSystem(const std::string& disk_path, size_t disk_size, const ArenaOptions& arena)
+    : disk_path(disk_path), disk_size(disk_size), free_blocks_list(nullptr),
+      used_block_count(0), shared_block_count(0), total_block_refs(0), sharing_epoch(0),
+      open_views(0),
+      global_retention{0, 0, 0, 0, 0}, change_generation(0), tracking_start(0),
+      snapshots_generation(0), pruning_job(0), prune_cursor(0), prune_now(0),
+      prune_pass_count(0), defrag_job(0), defrag_inode(nullptr), defrag_version(0),
+      defrag_pos(0), defrag_dest(0), block_slots_valid(false), block_slots_generation(0),
+      block_slots_pinned(0), pinned_changes(0), scrub_job(0), scrub_cursor(0), scrub_stats{0, 0, 0},
+      write_parallelism(std::max(1u, std::thread::hardware_concurrency())) {
     std::cout << "Initializing file system with size: " << disk_size << " bytes" << std::endl;
     
     total_blocks = disk_size / BLOCK_SIZE;
@@ -20,7 +413,9 @@ COWFileSystem::COWFileSystem(const std::string& disk_path, size_t disk_size)
     // Resize containers
     file_descriptors.resize(MAX_FILES);
     inodes.resize(MAX_FILES);
-    blocks.resize(total_blocks);
+    space_cache.resize(MAX_FILES);
+    defrag_done.resize(MAX_FILES);
+    blocks.resize(total_blocks, arena, disk_path + ".blocks");
 
     // Initialize all data structures
     init_file_system();
@@ -38,61 +433,312 @@ COWFileSystem::COWFileSystem(const std::string& disk_path, size_t disk_size)
 }
 
 COWFileSystem::~COWFileSystem() {
+    stop_background_pruning();
+    stop_background_scrubbing();
+    stop_background_defrag();
+
     // Limpiar la lista de bloques libres
     while (free_blocks_list) {
         FreeBlockInfo* temp = free_blocks_list;
         free_blocks_list = free_blocks_list->next;
-        delete temp;
+        free_info_pool.destroy(temp);
     }
 
     // Save current state to disk
-    std::ofstream disk(disk_path, std::ios::binary);
-    if (disk.is_open()) {
-        // Write inodes
-        disk.write(reinterpret_cast<char*>(inodes.data()), inodes.size() * sizeof(Inode));
-        // Write blocks
-        disk.write(reinterpret_cast<char*>(blocks.data()), blocks.size() * sizeof(Block));
+    save_disk_image();
+}
+
+// Cabecera de la imagen en disco:
+// [DiskHeader][datos de los bloques][checksums][metadatos binarios]
+// Con DISK_EXTERNAL_ARENA los datos no van en la imagen: estan en el archivo
+// de respaldo `disk_path + ".blocks"` (ver ArenaOptions::cache_bytes).
+// Solo se escriben los datos y checksums de los bloques en uso; los de los
+// libres quedan como huecos del archivo y no ocupan disco
+struct DiskHeader {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t metadata_size;
+    uint64_t flags;
+};
+
+static const char DISK_MAGIC[8] = {'C', 'O', 'W', 'F', 'S', 'I', 'M', 'G'};
+constexpr uint32_t DISK_FORMAT_VERSION = 4;
+constexpr uint64_t DISK_EXTERNAL_ARENA = 1;
+
+namespace {
+
+// Posiciones de cada seccion de la imagen
+struct DiskLayout {
+    std::streamoff data;
+    std::streamoff checksums;
+    std::streamoff metadata;
+};
+
+DiskLayout disk_layout(const DiskHeader& header) {
+    DiskLayout layout;
+    layout.data = sizeof(DiskHeader);
+    layout.checksums = layout.data;
+    if (!(header.flags & DISK_EXTERNAL_ARENA)) {
+        layout.checksums += static_cast<std::streamoff>(header.total_blocks * BLOCK_SIZE);
+    }
+    layout.metadata = layout.checksums + static_cast<std::streamoff>(header.total_blocks * sizeof(uint32_t));
+    return layout;
+}
+
+// Llama a fn(inicio, n) por cada tramo maximo de bloques en uso
+template <typename F>
+bool for_each_used_run(const BlockStore& blocks, F fn) {
+    size_t start = 0;
+    while (start < blocks.size()) {
+        if (!blocks.is_used(start)) {
+            start++;
+            continue;
+        }
+        size_t end = start + 1;
+        while (end < blocks.size() && blocks.is_used(end)) {
+            end++;
+        }
+        if (!fn(start, end - start)) {
+            return false;
+        }
+        start = end;
     }
+    return true;
 }
 
-bool COWFileSystem::initialize_disk() {
-    std::ifstream disk(disk_path, std::ios::binary);
-    if (disk.is_open()) {
-        // Load existing state
-        disk.read(reinterpret_cast<char*>(inodes.data()), inodes.size() * sizeof(Inode));
-        disk.read(reinterpret_cast<char*>(blocks.data()), blocks.size() * sizeof(Block));
+} // namespace
+
+bool COWFileSystem::save_disk_image() {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    std::ofstream disk(disk_path, std::ios::binary | std::ios::trunc);
+    if (!disk.is_open()) {
+        return false;
+    }
+
+    // Los metadatos se codifican en el formato binario de MetadataManager
+    std::vector<char> metadata;
+    MetadataManager::encode_metadata_binary(*this, [&metadata](const char* data, size_t size) {
+        metadata.insert(metadata.end(), data, data + size);
         return true;
-    } else {
-        // Create new disk file
-        std::ofstream new_disk(disk_path, std::ios::binary);
-        if (!new_disk.is_open()) {
+    });
+
+    // Con archivo de respaldo basta con escribir los bloques modificados
+    bool external = blocks.backed();
+    if (external && !blocks.flush()) {
+        return false;
+    }
+
+    DiskHeader header;
+    std::memcpy(header.magic, DISK_MAGIC, sizeof(DISK_MAGIC));
+    header.format_version = DISK_FORMAT_VERSION;
+    header.block_size = static_cast<uint32_t>(BLOCK_SIZE);
+    header.total_blocks = blocks.size();
+    header.metadata_size = metadata.size();
+    header.flags = external ? DISK_EXTERNAL_ARENA : 0;
+    DiskLayout layout = disk_layout(header);
+
+    disk.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    // Contadores y banderas se recalculan al cargar a partir de los mapas de
+    // bloques. Saltar con seekp deja los bloques libres como huecos
+    for_each_used_run(blocks, [&](size_t start, size_t n) {
+        if (!external) {
+            disk.seekp(layout.data + static_cast<std::streamoff>(start * BLOCK_SIZE));
+            disk.write(reinterpret_cast<const char*>(blocks.data(start)), n * BLOCK_SIZE);
+        }
+        disk.seekp(layout.checksums + static_cast<std::streamoff>(start * sizeof(uint32_t)));
+        disk.write(reinterpret_cast<const char*>(blocks.checksum.data() + start), n * sizeof(uint32_t));
+        return static_cast<bool>(disk);
+    });
+    disk.seekp(layout.metadata);
+    disk.write(metadata.data(), metadata.size());
+    return static_cast<bool>(disk);
+}
+
+bool COWFileSystem::load_disk_image(std::ifstream& disk) {
+    DiskHeader header;
+    if (!disk.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, DISK_MAGIC, sizeof(DISK_MAGIC)) != 0 ||
+        header.format_version != DISK_FORMAT_VERSION || header.block_size != BLOCK_SIZE) {
+        return false;
+    }
+    DiskLayout layout = disk_layout(header);
+
+    // Una imagen de otro tamano se adopta; la arena amplia su reserva si hace falta
+    const size_t requested_blocks = total_blocks;
+    if (header.total_blocks != blocks.size()) {
+        if (!set_block_count(header.total_blocks)) {
             return false;
         }
-        
-        // Initialize all inodes as unused
-        for (auto& inode : inodes) {
-            inode.is_used = false;
-            inode.filename[0] = '\0';  // Explicitly clear filename
-            inode.first_block = 0;
-            inode.size = 0;
-            inode.version_count = 0;
+        std::cout << "Disk image has " << header.total_blocks << " blocks, resizing" << std::endl;
+    }
+    auto fail = [this, requested_blocks]() {
+        set_block_count(requested_blocks);
+        return false;
+    };
+
+    // Primero los metadatos: los mapas de bloques dicen que tramos leer
+    std::vector<uint8_t> metadata(header.metadata_size);
+    if (!disk.seekg(layout.metadata) ||
+        !disk.read(reinterpret_cast<char*>(metadata.data()), metadata.size())) {
+        return fail();
+    }
+
+    MetadataImage image;
+    if (!MetadataManager::decode_metadata_binary(metadata.data(), metadata.size(), image) ||
+        image.files.size() > inodes.size()) {
+        return fail();
+    }
+
+    for (const auto& file : image.files) {
+        Inode* inode = allocate_inode(file.name);
+        inode->size = file.size;
+        inode->version_count = file.version_count;
+        inode->has_retention = file.has_retention;
+        inode->retention = file.retention;
+        inode->version_history = file.versions;
+        inode->block_table = file.block_table;
+        inode->version_index.assign(file.version_count + 1, 0);
+        rebuild_version_index(*inode);
+        inode->first_block = file.versions.empty() ? 0 : file.versions.back().block_index;
+        inode->modified_generation = image.generation;
+        inode->rewritten_generation = image.generation;
+        for (auto& version : inode->version_history) {
+            version.generation = image.generation;
+        }
+    }
+    snapshots = std::move(image.snapshots);
+
+    // Lo cargado se considera limpio en la generacion guardada
+    change_generation = image.generation;
+    tracking_start = image.generation;
+    snapshots_generation = image.generation;
+    removed_files.clear();
+    modified_inodes.clear();
+
+    rebuild_block_state();
+
+    // Los datos pueden venir de la imagen o del archivo de respaldo, y
+    // cargarse en memoria o en el archivo de respaldo de esta instancia
+    bool external = (header.flags & DISK_EXTERNAL_ARENA) != 0;
+    std::ifstream backing;
+    if (external && !blocks.backed()) {
+        backing.open(disk_path + ".blocks", std::ios::binary);
+        if (!backing.is_open()) {
+            std::cerr << "Missing block file for disk image: " << disk_path << ".blocks" << std::endl;
+            return fail();
+        }
+    }
+    bool loaded = for_each_used_run(blocks, [&](size_t start, size_t n) {
+        if (!disk.seekg(layout.checksums + static_cast<std::streamoff>(start * sizeof(uint32_t))) ||
+            !disk.read(reinterpret_cast<char*>(blocks.checksum.data() + start), n * sizeof(uint32_t))) {
+            return false;
+        }
+        if (!external) {
+            return disk.seekg(layout.data + static_cast<std::streamoff>(start * BLOCK_SIZE)) &&
+                   blocks.import_blocks(disk, start, n);
+        }
+        if (backing.is_open()) {
+            return backing.seekg(static_cast<std::streamoff>(start * BLOCK_SIZE)) &&
+                   blocks.import_blocks(backing, start, n);
+        }
+        return true;
+    });
+    blocks.finish_import();
+    if (!loaded) {
+        if (external && backing.is_open()) {
+            std::cerr << "Missing block file for disk image: " << disk_path << ".blocks" << std::endl;
         }
+        return fail();
+    }
+    return true;
+}
 
-        // Initialize all blocks as unused
-        for (auto& block : blocks) {
-            block.is_used = false;
-            block.next_block = 0;
-            std::memset(block.data, 0, BLOCK_SIZE);
+void COWFileSystem::rebuild_block_state() {
+    // Recalcular los contadores a partir de los mapas de bloques: es la fuente
+    // de verdad, y asi una imagen guardada con descriptores fijados no pierde bloques
+    // Los datos leidos del disco se vuelven a verificar en la primera lectura
+    blocks.ref_count.zero();
+    blocks.flags.zero();
+    for (const auto& inode : inodes) {
+        if (inode.is_used) {
+            for (size_t block_index : inode.block_table) {
+                if (block_index < blocks.size()) {
+                    blocks.ref_count[block_index]++;
+                }
+            }
         }
+    }
+    for (const auto& snap : snapshots) {
+        increment_block_refs(snap.block_table.data(), snap.block_table.size());
+    }
 
-        // Write the initialized state to disk
-        new_disk.write(reinterpret_cast<char*>(inodes.data()), inodes.size() * sizeof(Inode));
-        new_disk.write(reinterpret_cast<char*>(blocks.data()), blocks.size() * sizeof(Block));
-        return true;
+    while (free_blocks_list) {
+        FreeBlockInfo* temp = free_blocks_list;
+        free_blocks_list = free_blocks_list->next;
+        free_info_pool.destroy(temp);
+    }
+    size_t start = 0;
+    while (start < blocks.size()) {
+        if (blocks.ref_count[start] > 0) {
+            blocks.set_flag(start, BLOCK_USED);
+            start++;
+            continue;
+        }
+        size_t count = 0;
+        while (start + count < blocks.size() && blocks.ref_count[start + count] == 0) {
+            count++;
+        }
+        add_to_free_list(start, count);
+        start += count;
+    }
+    recount_blocks();
+    rebuild_head_owners();
+}
+
+void COWFileSystem::recount_blocks() {
+    used_block_count = 0;
+    shared_block_count = 0;
+    total_block_refs = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (blocks.is_used(i)) {
+            used_block_count++;
+        }
+        if (blocks.ref_count[i] > 1) {
+            shared_block_count++;
+        }
+        total_block_refs += blocks.ref_count[i];
+    }
+    sharing_epoch++;
+}
+
+bool COWFileSystem::initialize_disk() {
+    std::ifstream disk(disk_path, std::ios::binary);
+    if (disk.is_open()) {
+        // Load existing state
+        if (load_disk_image(disk)) {
+            std::cout << "Loaded existing disk image from " << disk_path << std::endl;
+            return true;
+        }
+        // Imagen de otro tamano o formato: se descarta y se empieza de cero
+        std::cerr << "Ignoring incompatible disk image: " << disk_path << std::endl;
+        disk.close();
+        init_file_system();
+        while (free_blocks_list) {
+            FreeBlockInfo* temp = free_blocks_list;
+            free_blocks_list = free_blocks_list->next;
+            free_info_pool.destroy(temp);
+        }
+        add_to_free_list(0, total_blocks);
     }
+
+    // Create new disk file with the initialized state
+    return save_disk_image();
 }
 
 fd_t COWFileSystem::create(const std::string& filename) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
     if (filename.length() >= MAX_FILENAME_LENGTH) {
         std::cerr << "Error: Filename too long" << std::endl;
         return -1;
@@ -104,29 +750,12 @@ fd_t COWFileSystem::create(const std::string& filename) {
         return -1;
     }
 
-    // Find free inode
-    Inode* inode = nullptr;
-    for (auto& i : inodes) {
-        if (!i.is_used) {
-            inode = &i;
-            break;
-        }
-    }
+    Inode* inode = allocate_inode(filename);
     if (!inode) {
         std::cerr << "Error: No free inodes available" << std::endl;
         return -1;
     }
 
-    // Initialize inode
-    std::memset(inode, 0, sizeof(Inode));
-    std::strncpy(inode->filename, filename.c_str(), MAX_FILENAME_LENGTH - 1);
-    inode->filename[MAX_FILENAME_LENGTH - 1] = '\0';
-    inode->first_block = 0;
-    inode->size = 0;
-    inode->version_count = 0;  // Start at 0, first write will make it 1
-    inode->is_used = true;
-    inode->version_history.clear();
-
     // Allocate file descriptor
     fd_t fd = allocate_file_descriptor();
     if (fd < 0) {
@@ -139,12 +768,16 @@ fd_t COWFileSystem::create(const std::string& filename) {
     file_descriptors[fd].mode = FileMode::WRITE;
     file_descriptors[fd].current_position = 0;
     file_descriptors[fd].is_valid = true;
+    file_descriptors[fd].pinned_version = 0;
+    file_descriptors[fd].verify_checksums = true;
+    reset_readahead(file_descriptors[fd]);
 
     std::cout << "Successfully created file with fd: " << fd << std::endl;
     return fd;
 }
 
 fd_t COWFileSystem::open(const std::string& filename, FileMode mode) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
     // Mostrar informacion de depuracion para ayudar a diagnosticar
     std::cout << "Attempting to open file '" << filename << "'" << std::endl;
     
@@ -164,6 +797,9 @@ fd_t COWFileSystem::open(const std::string& filename, FileMode mode) {
     file_descriptors[fd].inode = inode;
     file_descriptors[fd].mode = mode;
     file_descriptors[fd].is_valid = true;
+    file_descriptors[fd].pinned_version = 0;
+    file_descriptors[fd].verify_checksums = true;
+    reset_readahead(file_descriptors[fd]);
 
     // Para modo lectura, siempre empezamos al principio
     // Para modo escritura, podriamos empezar al final o al principio segun necesidades
@@ -183,6 +819,7 @@ fd_t COWFileSystem::open(const std::string& filename, FileMode mode) {
 }
 
 ssize_t COWFileSystem::read(fd_t fd, void* buffer, size_t size) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
     if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
         !file_descriptors[fd].is_valid) {
         std::cerr << "Invalid file descriptor in read" << std::endl;
@@ -195,78 +832,67 @@ ssize_t COWFileSystem::read(fd_t fd, void* buffer, size_t size) {
         return -1;
     }
 
-    // Verificamos si el archivo esta vacio SOLO por su tamano, no por first_block
-    // ya que first_block puede ser 0 (un indice valido)
-    if (fd_entry.inode->size == 0) {
+    // Resolver el mapa de bloques de la version que ve este descriptor
+    const size_t* map = nullptr;
+    size_t map_count = 0;
+    size_t file_size = 0;
+    get_fd_blocks(fd_entry, map, map_count, file_size);
+
+    if (file_size == 0) {
         std::cout << "read: Archivo vacio (tamano 0)" << std::endl;
         return 0;
     }
-    
-    // Verificar que el primer bloque sea valido (puede ser el bloque con indice 0)
-    if (fd_entry.inode->first_block >= blocks.size() || 
-        !blocks[fd_entry.inode->first_block].is_used) {
-        std::cerr << "read: Primer bloque invalido o no usado: " 
-                  << fd_entry.inode->first_block << std::endl;
-        return -1;
-    }
 
     // Calcular cuantos bytes leer basados en la posicion actual y el tamano del archivo
-    size_t bytes_to_read = std::min(size, fd_entry.inode->size - fd_entry.current_position);
+    size_t bytes_to_read = 0;
+    if (fd_entry.current_position < file_size) {
+        bytes_to_read = std::min(size, file_size - fd_entry.current_position);
+    }
     if (bytes_to_read == 0) {
         std::cout << "read: Fin de archivo alcanzado (posicion actual: " 
-                  << fd_entry.current_position << ", tamano: " << fd_entry.inode->size 
+                  << fd_entry.current_position << ", tamano: " << file_size 
                   << ")" << std::endl;
         return 0;  // EOF
     }
     
     std::cout << "read: Leyendo " << bytes_to_read << " bytes desde la posicion " 
               << fd_entry.current_position << std::endl;
-    std::cout << "read: Primer bloque: " << fd_entry.inode->first_block << std::endl;
+    update_readahead(fd_entry, map, map_count, fd_entry.current_position, bytes_to_read);
 
-    // Leer datos, navegando por la cadena de bloques
+    // Leer datos, indexando directamente el mapa de bloques de la version
     size_t bytes_read = 0;
-    size_t current_block = fd_entry.inode->first_block;
+    size_t map_pos = fd_entry.current_position / BLOCK_SIZE;
     size_t block_offset = fd_entry.current_position % BLOCK_SIZE;
-    size_t blocks_skipped = fd_entry.current_position / BLOCK_SIZE;
-    
-    // Saltar bloques hasta llegar a la posicion actual
-    for (size_t i = 0; i < blocks_skipped && current_block < blocks.size(); i++) {
-        size_t next_block = blocks[current_block].next_block;
-        // Si el siguiente bloque es 0 y no estamos en el ultimo bloque que necesitamos, 
-        // consideramos esto como el fin de la cadena
-        if (next_block >= blocks.size() && i < blocks_skipped - 1) {
-            std::cerr << "read: Fin prematuro de la cadena de bloques al navegar" << std::endl;
-            return -1;
-        }
-        current_block = next_block;
-    }
-    
-    // Verificar si alcanzamos el final de la cadena de bloques
-    if (current_block >= blocks.size() && bytes_to_read > 0) {
-        std::cerr << "read: Error al saltar bloques para alcanzar la posicion actual" << std::endl;
-        return -1;
-    }
-    
-    // Leer datos
-    while (bytes_read < bytes_to_read && current_block < blocks.size()) {
-        // Verificar que el bloque este marcado como usado
-        if (!blocks[current_block].is_used) {
-            std::cerr << "Error: Attempted to read from unused block" << std::endl;
+
+    while (bytes_read < bytes_to_read) {
+        if (map_pos >= map_count) {
+            std::cerr << "read: Mapa de bloques mas corto que el tamano del archivo" << std::endl;
             return -1;
         }
-        
+
+        size_t current_block = map[map_pos];
         size_t chunk_size = std::min(bytes_to_read - bytes_read, BLOCK_SIZE - block_offset);
-        
-        std::cout << "read: Leyendo " << chunk_size << " bytes del bloque " 
-                  << current_block << " con offset " << block_offset << std::endl;
-        
-        std::memcpy(static_cast<uint8_t*>(buffer) + bytes_read,
-                   blocks[current_block].data + block_offset,
-                   chunk_size);
+        if (current_block == HOLE_BLOCK) {
+            // Un hueco se lee como ceros sin tocar la arena
+            std::memset(static_cast<uint8_t*>(buffer) + bytes_read, 0, chunk_size);
+        } else {
+            // Verificar que el bloque este marcado como usado
+            if (current_block >= blocks.size() || !blocks.is_used(current_block)) {
+                std::cerr << "Error: Attempted to read from unused block" << std::endl;
+                return -1;
+            }
+            blocks.touch(current_block);
+            if (fd_entry.verify_checksums && !verify_block(current_block)) {
+                return -1;
+            }
+            std::memcpy(static_cast<uint8_t*>(buffer) + bytes_read,
+                       blocks.data(current_block) + block_offset,
+                       chunk_size);
+        }
         
         bytes_read += chunk_size;
         block_offset = 0; // Despues del primer bloque, siempre empezamos desde el inicio
-        current_block = blocks[current_block].next_block;
+        map_pos++;
     }
 
     // Actualizar la posicion actual
@@ -278,141 +904,438 @@ ssize_t COWFileSystem::read(fd_t fd, void* buffer, size_t size) {
     return bytes_read;
 }
 
-std::string get_current_timestamp() {
-    auto now = std::chrono::system_clock::now();
-    auto now_c = std::chrono::system_clock::to_time_t(now);
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&now_c), "%Y-%m-%d %H:%M:%S");
-    return ss.str();
-}
+ssize_t COWFileSystem::read_view(fd_t fd, size_t offset, size_t length, ReadView& view) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    release_view(view);
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[fd].is_valid || !file_descriptors[fd].inode) {
+        std::cerr << "Invalid file descriptor in read_view" << std::endl;
+        return -1;
+    }
 
-bool COWFileSystem::find_delta(const void* old_data, const void* new_data,
-                             size_t old_size, size_t new_size,
-                             size_t& delta_start, size_t& delta_size) {
-    const uint8_t* old_bytes = static_cast<const uint8_t*>(old_data);
-    const uint8_t* new_bytes = static_cast<const uint8_t*>(new_data);
-    
-    // Si los datos son identicos, no hay delta
-    if (old_size == new_size && std::memcmp(old_data, new_data, old_size) == 0) {
-        delta_start = 0;
-        delta_size = 0;
-        return true;
+    auto& fd_entry = file_descriptors[fd];
+    const size_t* map = nullptr;
+    size_t map_count = 0;
+    size_t file_size = 0;
+    get_fd_blocks(fd_entry, map, map_count, file_size);
+    if (offset >= file_size || length == 0) {
+        return 0;
     }
-    
-    // Encontrar donde comienzan las diferencias
-    delta_start = 0;
-    while (delta_start < old_size && delta_start < new_size &&
-           old_bytes[delta_start] == new_bytes[delta_start]) {
-        delta_start++;
+    length = std::min(length, file_size - offset);
+    update_readahead(fd_entry, map, map_count, offset, length);
+
+    size_t first = offset / BLOCK_SIZE;
+    size_t last = (offset + length - 1) / BLOCK_SIZE;
+    if (last >= map_count) {
+        std::cerr << "read_view: Mapa de bloques mas corto que el tamano del archivo" << std::endl;
+        return -1;
     }
-    
-    // Si el nuevo contenido es mas corto y no hay diferencias hasta aqui
-    if (delta_start == new_size && new_size < old_size) {
-        delta_size = 0;
-        return true;
+    for (size_t i = first; i <= last; i++) {
+        if (map[i] == HOLE_BLOCK) {
+            continue;
+        }
+        if (!blocks.is_used(map[i]) || (fd_entry.verify_checksums && !verify_block(map[i]))) {
+            return -1;
+        }
     }
-    
-    // Si el nuevo contenido es mas largo pero igual hasta el final del viejo
-    if (delta_start == old_size && new_size > old_size) {
-        delta_size = new_size - old_size;
-        return true;
+
+    view.blocks.assign(map + first, map + last + 1);
+    increment_block_refs(view.blocks.data(), view.blocks.size());
+    size_t position = offset;
+    for (size_t block_index : view.blocks) {
+        size_t block_offset = position % BLOCK_SIZE;
+        size_t chunk = std::min(BLOCK_SIZE - block_offset, offset + length - position);
+        view.slices.push_back(BlockSlice{block_bytes(block_index) + block_offset, chunk});
+        position += chunk;
     }
-    
-    // Encontrar donde terminan las diferencias desde el final
-    size_t common_suffix = 0;
-    while (common_suffix < (old_size - delta_start) && 
-           common_suffix < (new_size - delta_start) &&
-           old_bytes[old_size - 1 - common_suffix] == new_bytes[new_size - 1 - common_suffix]) {
-        common_suffix++;
+    view.size = length;
+    open_views++;
+    return static_cast<ssize_t>(length);
+}
+
+void COWFileSystem::release_view(ReadView& view) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (!view.blocks.empty()) {
+        decrement_block_refs(view.blocks.data(), view.blocks.size());
+        open_views--;
     }
-    
-    // Calcular el tamano del delta
-    delta_size = (new_size - delta_start) - common_suffix;
-    
-    // Validacion final
-    if (delta_start + delta_size > new_size) {
-        delta_size = new_size - delta_start;
+    view.blocks.clear();
+    view.slices.clear();
+    view.size = 0;
+}
+
+size_t format_timestamp(int64_t timestamp, char* out, size_t capacity) {
+    std::time_t t = static_cast<std::time_t>(timestamp);
+    std::tm tm_buf;
+    localtime_r(&t, &tm_buf);
+    return std::strftime(out, capacity, "%Y-%m-%d %H:%M:%S", &tm_buf);
+}
+
+std::string format_timestamp(int64_t timestamp) {
+    char text[32];
+    size_t len = format_timestamp(timestamp, text, sizeof(text));
+    return std::string(text, len);
+}
+
+int64_t get_current_time_seconds() {
+    return static_cast<int64_t>(
+        std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
+}
+
+namespace {
+
+// Recorre el contenido de una escritura repartido en varios iovec como si
+// fuera un buffer contiguo. Los accesos a posiciones cercanas a la anterior
+// solo avanzan o retroceden unos segmentos.
+class GatherCursor {
+public:
+    GatherCursor(const struct iovec* iov, size_t count) : iov(iov), count(count), index(0), start(0) {}
+
+    // Puntero a `offset` y bytes contiguos disponibles desde ahi
+    const uint8_t* at(size_t offset, size_t& available) {
+        seek(offset);
+        available = start + iov[index].iov_len - offset;
+        return static_cast<const uint8_t*>(iov[index].iov_base) + (offset - start);
+    }
+
+    // Puntero a `end` (exclusivo) y bytes contiguos disponibles antes de el
+    const uint8_t* ending_at(size_t end, size_t& available) {
+        seek(end - 1);
+        available = end - start;
+        return static_cast<const uint8_t*>(iov[index].iov_base) + available;
+    }
+
+    void copy(size_t offset, uint8_t* out, size_t length) {
+        while (length > 0) {
+            size_t available = 0;
+            const uint8_t* data = at(offset, available);
+            size_t chunk = std::min(available, length);
+            std::memcpy(out, data, chunk);
+            out += chunk;
+            offset += chunk;
+            length -= chunk;
+        }
     }
-    
-    return true;
+
+private:
+    void seek(size_t offset) {
+        while (index > 0 && offset < start) {
+            index--;
+            start -= iov[index].iov_len;
+        }
+        while (index < count && offset >= start + iov[index].iov_len) {
+            start += iov[index].iov_len;
+            index++;
+        }
+    }
+
+    const struct iovec* iov;
+    size_t count;
+    size_t index;   // Segmento actual
+    size_t start;   // Posicion del segmento actual dentro del contenido
+};
+
+// Un bloque se comparte con la version anterior si todo su rango cae en el
+// prefijo comun, o en el sufijo comun cuando el tamano no cambio (si cambio,
+// el sufijo esta desplazado y no coincide con los bloques viejos)
+bool shares_old_block(size_t i, size_t size, size_t delta_start, size_t delta_size,
+                      size_t old_count, size_t old_size) {
+    size_t block_start = i * BLOCK_SIZE;
+    size_t bytes = std::min(size - block_start, BLOCK_SIZE);
+    bool in_prefix = block_start + bytes <= delta_start;
+    bool in_suffix = (old_size == size) && block_start >= delta_start + delta_size;
+    return i < old_count && (in_prefix || in_suffix);
+}
+
+// Las escrituras a partir de este tamano se reparten entre hilos, en tramos
+// de PARALLEL_CHUNK_BYTES (multiplo de BLOCK_SIZE)
+constexpr size_t PARALLEL_MIN_BYTES = 4 << 20;
+constexpr size_t PARALLEL_CHUNK_BYTES = 1 << 20;
+
+// Ejecuta range(lo, hi) sobre tramos que cubren [0, total)
+template <typename Range>
+void for_each_range(Scheduler* pool, size_t total, Range range) {
+    if (!pool || total < PARALLEL_MIN_BYTES) {
+        range(0, total);
+        return;
+    }
+    size_t chunks = (total + PARALLEL_CHUNK_BYTES - 1) / PARALLEL_CHUNK_BYTES;
+    pool->parallel_for(chunks, [&](size_t c) {
+        size_t lo = c * PARALLEL_CHUNK_BYTES;
+        range(lo, std::min(total, lo + PARALLEL_CHUNK_BYTES));
+    });
+}
+
+// Primera posicion de [from, to) donde scan(lo, hi) se detiene antes de hi.
+// En paralelo cada tramo busca por su cuenta, y los tramos que empiezan
+// despues de una parada ya encontrada no se recorren
+template <typename Scan>
+size_t first_stop(Scheduler* pool, size_t from, size_t to, Scan scan) {
+    if (!pool || to - from < PARALLEL_MIN_BYTES) {
+        return scan(from, to);
+    }
+    std::atomic<size_t> stop(to);
+    size_t chunks = (to - from + PARALLEL_CHUNK_BYTES - 1) / PARALLEL_CHUNK_BYTES;
+    pool->parallel_for(chunks, [&](size_t c) {
+        size_t lo = from + c * PARALLEL_CHUNK_BYTES;
+        size_t hi = std::min(to, lo + PARALLEL_CHUNK_BYTES);
+        if (lo >= stop.load(std::memory_order_relaxed)) {
+            return;
+        }
+        size_t found = scan(lo, hi);
+        size_t current = stop.load(std::memory_order_relaxed);
+        while (found < hi && found < current &&
+               !stop.compare_exchange_weak(current, found, std::memory_order_relaxed)) {
+        }
+    });
+    return stop.load(std::memory_order_relaxed);
+}
+
+} // namespace
+
+size_t COWFileSystem::scan_prefix(const size_t* old_map, const struct iovec* iov, size_t iovcnt,
+                                  size_t from, size_t to) {
+    // Primera posicion de [from, to) donde difieren el contenido anterior y
+    // el nuevo, o `to` si coinciden. Se compara bloque a bloque sobre la arena
+    // y segmento a segmento sobre los datos nuevos
+    GatherCursor source(iov, iovcnt);
+    size_t pos = from;
+    while (pos < to) {
+        const uint8_t* old_block = block_bytes(old_map[pos / BLOCK_SIZE]);
+        size_t offset = pos % BLOCK_SIZE;
+        size_t available = 0;
+        const uint8_t* new_ptr = source.at(pos, available);
+        size_t chunk = std::min({BLOCK_SIZE - offset, to - pos, available});
+        if (std::memcmp(old_block + offset, new_ptr, chunk) == 0) {
+            pos += chunk;
+            continue;
+        }
+        while (old_block[offset] == *new_ptr) {
+            offset++;
+            new_ptr++;
+            pos++;
+        }
+        break;
+    }
+    return pos;
+}
+
+size_t COWFileSystem::scan_suffix(const size_t* old_map, size_t old_size,
+                                  const struct iovec* iov, size_t iovcnt, size_t new_size,
+                                  size_t from, size_t to) {
+    // Igual que scan_prefix pero desde el final: la posicion se mide como
+    // bytes desde el final de cada contenido
+    GatherCursor source(iov, iovcnt);
+    size_t common_suffix = from;
+    while (common_suffix < to) {
+        size_t old_end = old_size - common_suffix;
+        size_t block_end = old_end - (old_end - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        size_t available = 0;
+        const uint8_t* new_end = source.ending_at(new_size - common_suffix, available);
+        size_t chunk = std::min({block_end, to - common_suffix, available});
+        const uint8_t* old_ptr = block_bytes(old_map[(old_end - 1) / BLOCK_SIZE]) + block_end - chunk;
+        const uint8_t* new_ptr = new_end - chunk;
+        if (std::memcmp(old_ptr, new_ptr, chunk) == 0) {
+            common_suffix += chunk;
+            continue;
+        }
+        while (old_ptr[chunk - 1] == new_ptr[chunk - 1]) {
+            chunk--;
+            common_suffix++;
+        }
+        break;
+    }
+    return common_suffix;
 }
 
-bool COWFileSystem::write_delta_blocks(const void* buffer, size_t size,
-                                     size_t delta_start, size_t& first_block) {
-    if (size == 0 || delta_start >= size) {
-        first_block = 0;
+bool COWFileSystem::find_delta(const size_t* old_map, size_t old_size,
+                             const struct iovec* iov, size_t iovcnt, size_t new_size,
+                             size_t& delta_start, size_t& delta_size) {
+    Scheduler* pool = write_workers();
+
+    // Encontrar donde comienzan las diferencias
+    size_t common = std::min(old_size, new_size);
+    delta_start = first_stop(pool, 0, common, [&](size_t lo, size_t hi) {
+        return scan_prefix(old_map, iov, iovcnt, lo, hi);
+    });
+
+    // Si los datos son identicos, no hay delta
+    if (delta_start == old_size && old_size == new_size) {
+        delta_start = 0;
+        delta_size = 0;
         return true;
     }
     
-    // Calcular cuantos bloques necesitamos
-    size_t actual_size = std::min(size - delta_start, size);
-    size_t blocks_needed = (actual_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    
-    std::cout << "write_delta_blocks: Necesitamos " << blocks_needed 
-              << " bloques para escribir " << actual_size << " bytes" << std::endl;
+    // Si el nuevo contenido es mas corto y no hay diferencias hasta aqui
+    if (delta_start == new_size && new_size < old_size) {
+        delta_size = 0;
+        return true;
+    }
     
-    first_block = 0;
-    size_t current_block = 0;
-    size_t prev_block = 0;
+    // Si el nuevo contenido es mas largo pero igual hasta el final del viejo
+    if (delta_start == old_size && new_size > old_size) {
+        delta_size = new_size - old_size;
+        return true;
+    }
     
-    const uint8_t* data = static_cast<const uint8_t*>(buffer) + delta_start;
-    size_t remaining = actual_size;
+    // Encontrar donde terminan las diferencias desde el final
+    size_t common_suffix = first_stop(pool, 0, common - delta_start, [&](size_t lo, size_t hi) {
+        return scan_suffix(old_map, old_size, iov, iovcnt, new_size, lo, hi);
+    });
     
-    for (size_t i = 0; i < blocks_needed; i++) {
-        if (!allocate_block(current_block)) {
-            std::cerr << "write_delta_blocks: No se pudo asignar el bloque " << i+1 
-                      << " de " << blocks_needed << std::endl;
-            
-            // Liberar los bloques que ya asignamos si fallamos
-            if (first_block != 0) {
-                size_t block_to_free = first_block;
-                while (block_to_free != 0 && block_to_free < blocks.size()) {
-                    size_t next = blocks[block_to_free].next_block;
-                    free_block(block_to_free);
-                    block_to_free = next;
-                }
+    // Calcular el tamano del delta
+    delta_size = (new_size - delta_start) - common_suffix;
+    return true;
+}
+
+size_t COWFileSystem::count_new_blocks(const struct iovec* iov, size_t iovcnt, size_t size,
+                                       size_t delta_start, size_t delta_size,
+                                       size_t old_count, size_t old_size) {
+    // Los bloques que no se comparten se comprueban sobre los buffers del
+    // llamador; los que son todo ceros quedan como huecos, sin asignarlos ni
+    // copiarlos. La mayoria de los bloques con datos se descarta en los
+    // primeros bytes
+    size_t blocks_needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    hole_scratch.assign(blocks_needed, 0);
+    for_each_range(write_workers(), blocks_needed * BLOCK_SIZE, [&](size_t lo, size_t hi) {
+        GatherCursor source(iov, iovcnt);
+        for (size_t i = lo / BLOCK_SIZE; i < hi / BLOCK_SIZE; i++) {
+            if (shares_old_block(i, size, delta_start, delta_size, old_count, old_size)) {
+                continue;
             }
-            
-            first_block = 0;
-            return false;
-        }
-        
-        // Si es el primer bloque, guardamos su indice
-        if (i == 0) {
-            first_block = current_block;
-        } else {
-            // Enlazar con el bloque anterior
-            blocks[prev_block].next_block = current_block;
+            size_t pos = i * BLOCK_SIZE;
+            size_t end = std::min(size, pos + BLOCK_SIZE);
+            bool zero = true;
+            while (zero && pos < end) {
+                size_t available = 0;
+                const uint8_t* data = source.at(pos, available);
+                size_t chunk = std::min(available, end - pos);
+                zero = is_all_zero(data, chunk);
+                pos += chunk;
+            }
+            hole_scratch[i] = zero ? 1 : 0;
         }
-        
-        // Calcular cuantos bytes escribir en este bloque
-        size_t bytes_to_write = std::min(remaining, BLOCK_SIZE);
-        
-        // Copiar los datos al bloque
-        std::memcpy(blocks[current_block].data, data, bytes_to_write);
-        
-        // Inicializar el resto del bloque con ceros si es necesario
-        if (bytes_to_write < BLOCK_SIZE) {
-            std::memset(blocks[current_block].data + bytes_to_write, 0, BLOCK_SIZE - bytes_to_write);
+    });
+
+    size_t new_blocks = 0;
+    for (size_t i = 0; i < blocks_needed; i++) {
+        if (!hole_scratch[i] && !shares_old_block(i, size, delta_start, delta_size, old_count, old_size)) {
+            new_blocks++;
         }
-        
-        data += bytes_to_write;
-        remaining -= bytes_to_write;
-        prev_block = current_block;
+    }
+    return new_blocks;
+}
+
+bool COWFileSystem::write_delta_blocks(const struct iovec* iov, size_t iovcnt, size_t size,
+                                     size_t delta_start, size_t delta_size,
+                                     const size_t* old_map, size_t old_count, size_t old_size,
+                                     std::vector<size_t>& new_map,
+                                     const size_t* reserved,
+                                     const uint8_t* holes) {
+    new_map.clear();
+    if (size == 0) {
+        return true;
     }
     
-    // Asegurar que el ultimo bloque tenga next_block = 0
-    if (prev_block < blocks.size()) {
-        blocks[prev_block].next_block = 0;
+    // Calcular cuantos bloques necesitamos y cuales se comparten
+    size_t blocks_needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    new_map.resize(blocks_needed);
+    // Las transacciones ya clasificaron los bloques al planificar y traen
+    // `holes` junto con `reserved`; no se vuelven a buscar ceros
+    size_t new_blocks = 0;
+    if (!holes) {
+        new_blocks = count_new_blocks(iov, iovcnt, size, delta_start, delta_size, old_count, old_size);
+        holes = hole_scratch.data();
+    }
+
+    // Reservar todos los bloques nuevos de una vez, salvo que ya vengan
+    // reservados (transacciones)
+    if (!reserved) {
+        if (!allocate_blocks(new_blocks, reserve_scratch)) {
+            std::cerr << "write_delta_blocks: No se pudieron asignar " << new_blocks
+                      << " bloques" << std::endl;
+            new_map.clear();
+            return false;
+        }
+        reserved = reserve_scratch.data();
+    }
+    size_t next_reserved = 0;
+    size_t hole_count = 0;
+    for (size_t i = 0; i < blocks_needed; i++) {
+        if (shares_old_block(i, size, delta_start, delta_size, old_count, old_size)) {
+            new_map[i] = old_map[i];
+        } else if (holes[i]) {
+            new_map[i] = HOLE_BLOCK;
+            hole_count++;
+        } else {
+            new_map[i] = reserved[next_reserved++];
+        }
     }
+
+    // Copiar los datos directamente desde los buffers del llamador, rellenar
+    // con ceros el final del ultimo bloque y sellarlos. Los tramos son
+    // independientes, asi que en escrituras grandes se reparten entre hilos
+    for_each_range(write_workers(), blocks_needed * BLOCK_SIZE, [&](size_t lo, size_t hi) {
+        GatherCursor source(iov, iovcnt);
+        for (size_t i = lo / BLOCK_SIZE; i < hi / BLOCK_SIZE; i++) {
+            if (shares_old_block(i, size, delta_start, delta_size, old_count, old_size) ||
+                holes[i]) {
+                continue;
+            }
+            size_t current_block = new_map[i];
+            size_t block_start = i * BLOCK_SIZE;
+            size_t bytes_to_write = std::min(size - block_start, BLOCK_SIZE);
+            blocks.touch(current_block, true);
+            source.copy(block_start, blocks.data(current_block), bytes_to_write);
+            if (bytes_to_write < BLOCK_SIZE) {
+                std::memset(blocks.data(current_block) + bytes_to_write, 0, BLOCK_SIZE - bytes_to_write);
+            }
+            seal_block(current_block);
+        }
+    });
     
-    std::cout << "write_delta_blocks: Escritura exitosa en " << blocks_needed 
-              << " bloques, primer bloque: " << first_block << std::endl;
+    new_blocks = next_reserved;
+    std::cout << "write_delta_blocks: " << new_blocks << " bloques nuevos, " << hole_count << " huecos y "
+              << (blocks_needed - new_blocks - hole_count) << " compartidos con la version anterior" << std::endl;
     
     return true;
 }
 
 ssize_t COWFileSystem::write(fd_t fd, const void* buffer, size_t size) {
+    // Un buffer nulo se trata como una escritura vacia
+    struct iovec segment;
+    segment.iov_base = const_cast<void*>(buffer);
+    segment.iov_len = buffer ? size : 0;
+    return writev(fd, &segment, 1);
+}
+
+ssize_t COWFileSystem::readv(fd_t fd, const struct iovec* iov, int iovcnt) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (iovcnt < 0 || (iovcnt > 0 && !iov)) {
+        std::cerr << "Invalid iovec array in readv" << std::endl;
+        return -1;
+    }
+    // Cada segmento continua donde termino el anterior; una lectura corta
+    // indica el fin del archivo
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        ssize_t n = read(fd, iov[i].iov_base, iov[i].iov_len);
+        if (n < 0) {
+            return total > 0 ? total : -1;
+        }
+        total += n;
+        if (static_cast<size_t>(n) < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+ssize_t COWFileSystem::writev(fd_t fd, const struct iovec* iov, int iovcnt) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
     std::cout << "Starting write operation for fd: " << fd << std::endl;
     
     if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
@@ -432,17 +1355,36 @@ ssize_t COWFileSystem::write(fd_t fd, const void* buffer, size_t size) {
         return -1;
     }
     
-    // Si el buffer esta vacio o el tamano es cero, no hacer nada
-    if (!buffer || size == 0) {
+    if (iovcnt < 0 || (iovcnt > 0 && !iov)) {
+        std::cerr << "Invalid iovec array in write" << std::endl;
+        return -1;
+    }
+    
+    // El contenido nuevo es la concatenacion de todos los segmentos
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0 && !iov[i].iov_base) {
+            std::cerr << "Null buffer in iovec segment " << i << std::endl;
+            return -1;
+        }
+        if (iov[i].iov_len > static_cast<size_t>(SSIZE_MAX) - size) {
+            std::cerr << "Total iovec length overflows ssize_t" << std::endl;
+            return -1;
+        }
+        size += iov[i].iov_len;
+    }
+    
+    // Si el tamano es cero, no hacer nada
+    if (size == 0) {
         return 0;
     }
     
     // Obtener informacion del archivo actual
     size_t old_size = fd_entry.inode->size;
-    size_t old_first_block = fd_entry.inode->first_block;
     
-    // Para almacenar la informacion de los nuevos bloques
-    size_t new_first_block = 0;
+    // Para almacenar la informacion de los nuevos bloques. Los buffers de
+    // trabajo se reutilizan entre escrituras y solo crecen
+    std::vector<size_t>& new_map = map_scratch;
     size_t delta_start = 0;
     size_t delta_size = 0;
     
@@ -454,30 +1396,22 @@ ssize_t COWFileSystem::write(fd_t fd, const void* buffer, size_t size) {
         delta_start = 0;
         delta_size = size;
     } else {
-        // Leer el contenido actual para detectar cambios
-        std::vector<uint8_t> old_content(old_size);
-        
+        // Comparar directamente contra los bloques de la version actual, que
+        // son inmutables; no se copia el contenido anterior
         if (old_size > 0) {
-            // Guardar la posicion actual
-            size_t saved_position = fd_entry.current_position;
-            
-            // Posicionar al inicio del archivo
-            fd_entry.current_position = 0;
-            
-            // Leer el contenido actual
-            ssize_t bytes_read = read(fd, old_content.data(), old_size);
-            
-            // Restaurar la posicion
-            fd_entry.current_position = saved_position;
-            
-            // Verificar si la lectura tuvo exito
-            if (bytes_read != static_cast<ssize_t>(old_size)) {
+            const VersionInfo& current = fd_entry.inode->version_history.back();
+            const size_t* current_map = fd_entry.inode->block_table.data() + current.map_offset;
+            if (current.block_count * BLOCK_SIZE < old_size) {
+                std::cerr << "Error reading current content for delta detection" << std::endl;
+                return -1;
+            }
+            if (fd_entry.verify_checksums && !verify_blocks(current_map, current.block_count)) {
                 std::cerr << "Error reading current content for delta detection" << std::endl;
                 return -1;
             }
             
             // Detectar cambios entre versiones
-            if (!find_delta(old_content.data(), buffer, old_size, size, delta_start, delta_size)) {
+            if (!find_delta(current_map, old_size, iov, static_cast<size_t>(iovcnt), size, delta_start, delta_size)) {
                 std::cerr << "Error detecting delta between versions" << std::endl;
                 return -1;
             }
@@ -488,8 +1422,9 @@ ssize_t COWFileSystem::write(fd_t fd, const void* buffer, size_t size) {
         }
     }
     
-    // Si no hay cambios, no crear una nueva version
-    if (delta_size == 0) {
+    // Si no hay cambios, no crear una nueva version. Un contenido mas corto que
+    // es prefijo del anterior tiene delta 0 pero si cambia el archivo
+    if (delta_size == 0 && size == old_size) {
         std::cout << "No changes detected, not creating a new version" << std::endl;
         
         // Pero si actualizamos la posicion del cursor
@@ -498,30 +1433,20 @@ ssize_t COWFileSystem::write(fd_t fd, const void* buffer, size_t size) {
         return size;
     }
     
-    // Crear una nueva cadena de bloques para la nueva version
-    if (!write_delta_blocks(buffer, size, delta_start, new_first_block)) {
+    // Construir el mapa de bloques de la nueva version, compartiendo los
+    // bloques que no cambiaron con la version actual
+    const VersionInfo* head = fd_entry.inode->version_history.empty() ?
+        nullptr : &fd_entry.inode->version_history.back();
+    const size_t* old_map = head ? fd_entry.inode->block_table.data() + head->map_offset : nullptr;
+    size_t old_count = head ? head->block_count : 0;
+    if (!write_delta_blocks(iov, static_cast<size_t>(iovcnt), size, delta_start, delta_size,
+                            old_map, old_count, old_size, new_map)) {
         std::cerr << "Could not allocate blocks for new version" << std::endl;
         return -1;
     }
     
-    // Crear informacion de la nueva version
-    VersionInfo new_version;
-    new_version.version_number = fd_entry.inode->version_count + 1;
-    new_version.timestamp = get_current_timestamp();
-    new_version.size = size;
-    new_version.block_index = new_first_block;
-    new_version.delta_start = delta_start;
-    new_version.delta_size = delta_size;
-    new_version.prev_version = (fd_entry.inode->version_count > 0) ? fd_entry.inode->version_count : 0;
-    
-    // Incrementar la referencia a los nuevos bloques
-    increment_block_refs(new_first_block);
-    
-    // Actualizar el inodo con la nueva informacion
-    fd_entry.inode->version_history.push_back(new_version);
-    fd_entry.inode->first_block = new_first_block;
-    fd_entry.inode->size = size;
-    fd_entry.inode->version_count++;
+    // Publicar la nueva version en el inodo
+    publish_version(*fd_entry.inode, new_map.data(), new_map.size(), size, delta_start, delta_size);
     
     // Actualizar la posicion del cursor
     fd_entry.current_position = size;
@@ -536,243 +1461,1751 @@ ssize_t COWFileSystem::write(fd_t fd, const void* buffer, size_t size) {
     return size;
 }
 
-int COWFileSystem::close(fd_t fd) {
-    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
-        !file_descriptors[fd].is_valid) {
-        return -1;
+bool COWFileSystem::copy_file(const std::string& src, const std::string& dst) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (src == dst || dst.length() >= MAX_FILENAME_LENGTH) {
+        std::cerr << "copy_file: Invalid destination: " << dst << std::endl;
+        return false;
     }
 
-    file_descriptors[fd].is_valid = false;
-    return 0;
+    Inode* src_inode = find_inode(src);
+    if (!src_inode) {
+        std::cerr << "File not found: " << src << std::endl;
+        return false;
+    }
+
+    Inode* dst_inode = find_inode(dst);
+    if (!dst_inode) {
+        dst_inode = allocate_inode(dst);
+        if (!dst_inode) {
+            std::cerr << "Error: No free inodes available" << std::endl;
+            return false;
+        }
+    }
+
+    if (src_inode->version_history.empty()) {
+        return true;  // Origen vacio: el destino queda creado y vacio
+    }
+
+    // El destino apunta a los mismos bloques que la version actual del origen
+    const VersionInfo& head = src_inode->version_history.back();
+    const size_t* map = src_inode->block_table.data() + head.map_offset;
+    publish_version(*dst_inode, map, head.block_count, head.size, 0, head.size);
+
+    std::cout << "copy_file: '" << src << "' -> '" << dst << "' compartiendo " 
+              << head.block_count << " bloques" << std::endl;
+    return true;
 }
 
-// Helper functions implementation
-Inode* COWFileSystem::find_inode(const std::string& filename) {
-    for (size_t i = 0; i < inodes.size(); i++) {
-        if (inodes[i].is_used) {
-            // Debug output to check what's happening
-            std::cout << "Checking inode " << i << ": " 
-                     << "used=" << inodes[i].is_used 
-                     << ", filename='" << inodes[i].filename << "'" << std::endl;
-            
-            if (std::strcmp(inodes[i].filename, filename.c_str()) == 0) {
-                return &inodes[i];
+ssize_t COWFileSystem::copy_range(fd_t src_fd, size_t src_offset, fd_t dst_fd, size_t dst_offset,
+                                  size_t length) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (src_fd < 0 || src_fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[src_fd].is_valid || !file_descriptors[src_fd].inode ||
+        dst_fd < 0 || dst_fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[dst_fd].is_valid || !file_descriptors[dst_fd].inode) {
+        std::cerr << "Invalid file descriptor in copy_range" << std::endl;
+        return -1;
+    }
+    auto& dst_entry = file_descriptors[dst_fd];
+    if (dst_entry.mode != FileMode::WRITE || dst_entry.pinned_version != 0) {
+        std::cerr << "File not opened for writing" << std::endl;
+        return -1;
+    }
+
+    // Copiar los indices de ambos mapas: publicar la version puede reubicar
+    // block_table si origen y destino son el mismo archivo
+    const size_t* map = nullptr;
+    size_t count = 0;
+    size_t src_size = 0;
+    get_fd_blocks(file_descriptors[src_fd], map, count, src_size);
+    if (src_offset >= src_size || length == 0) {
+        return 0;
+    }
+    length = std::min(length, src_size - src_offset);
+    std::vector<size_t> src_map(map, map + count);
+
+    size_t dst_size = 0;
+    get_fd_blocks(dst_entry, map, count, dst_size);
+    std::vector<size_t> dst_map(map, map + count);
+
+    const size_t copy_end = dst_offset + length;
+    const size_t new_size = std::max(dst_size, copy_end);
+    const size_t blocks_needed = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // Con la misma alineacion, el bloque i del destino corresponde exactamente a un bloque del origen
+    const bool aligned = (dst_offset % BLOCK_SIZE) == (src_offset % BLOCK_SIZE);
+
+    // Los bloques que se copian al componer bordes deben estar integros,
+    // salvo que el descriptor se abriera sin verificacion (como en read())
+    if (file_descriptors[src_fd].verify_checksums) {
+        for (size_t i = src_offset / BLOCK_SIZE; i <= (src_offset + length - 1) / BLOCK_SIZE; i++) {
+            if (!verify_block(src_map[i])) {
+                return -1;
+            }
+        }
+    }
+    if (dst_entry.verify_checksums) {
+        for (size_t i : {dst_offset / BLOCK_SIZE, copy_end / BLOCK_SIZE}) {
+            if (i < dst_map.size() && !verify_block(dst_map[i])) {
+                return -1;
             }
         }
     }
-    return nullptr;
-}
 
-fd_t COWFileSystem::allocate_file_descriptor() {
-    for (size_t i = 0; i < file_descriptors.size(); ++i) {
-        if (!file_descriptors[i].is_valid) {
-            return static_cast<fd_t>(i);
+    std::vector<size_t> new_map;
+    new_map.reserve(blocks_needed);
+    size_t shared = 0;
+
+    for (size_t i = 0; i < blocks_needed; i++) {
+        size_t block_start = i * BLOCK_SIZE;
+        size_t block_end = std::min(block_start + BLOCK_SIZE, new_size);
+
+        if (aligned && block_start >= dst_offset && block_end <= copy_end) {
+            new_map.push_back(src_map[(block_start - dst_offset + src_offset) / BLOCK_SIZE]);
+            shared++;
+            continue;
+        }
+        if ((block_end <= dst_offset || block_start >= copy_end) &&
+            block_end <= dst_size && i < dst_map.size()) {
+            new_map.push_back(dst_map[i]);
+            shared++;
+            continue;
+        }
+
+        // Bloque de borde: componerlo con datos del destino, del origen y ceros
+        size_t current_block = 0;
+        if (!allocate_block(current_block)) {
+            std::cerr << "copy_range: No se pudo asignar un bloque" << std::endl;
+            for (size_t j = 0; j < new_map.size(); j++) {
+                if (new_map[j] != HOLE_BLOCK && blocks.ref_count[new_map[j]] == 0) {
+                    free_block(new_map[j]);
+                }
+            }
+            return -1;
         }
+        blocks.touch(current_block, true);
+        uint8_t* out = blocks.data(current_block);
+        std::memset(out, 0, BLOCK_SIZE);
+        if (i < dst_map.size() && block_start < dst_size) {
+            std::memcpy(out, block_bytes(dst_map[i]), std::min(BLOCK_SIZE, dst_size - block_start));
+        }
+        size_t from = std::max(block_start, dst_offset);
+        size_t to = std::min(block_end, copy_end);
+        while (from < to) {
+            size_t src_pos = from - dst_offset + src_offset;
+            size_t src_block_offset = src_pos % BLOCK_SIZE;
+            size_t chunk = std::min(to - from, BLOCK_SIZE - src_block_offset);
+            std::memcpy(out + (from - block_start),
+                        block_bytes(src_map[src_pos / BLOCK_SIZE]) + src_block_offset, chunk);
+            from += chunk;
+        }
+        if (is_all_zero(out, BLOCK_SIZE)) {
+            free_block(current_block);
+            new_map.push_back(HOLE_BLOCK);
+            continue;
+        }
+        seal_block(current_block);
+        new_map.push_back(current_block);
     }
-    return -1;
+
+    publish_version(*dst_entry.inode, new_map.data(), new_map.size(), new_size, dst_offset, length);
+
+    std::cout << "copy_range: " << length << " bytes copiados, " << shared << " bloques compartidos y " 
+              << (new_map.size() - shared) << " nuevos" << std::endl;
+    return static_cast<ssize_t>(length);
 }
 
-void COWFileSystem::free_file_descriptor(fd_t fd) {
-    if (fd >= 0 && fd < static_cast<fd_t>(file_descriptors.size())) {
-        file_descriptors[fd].is_valid = false;
+ssize_t COWFileSystem::punch_hole(fd_t fd, size_t offset, size_t length) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) ||
+        !file_descriptors[fd].is_valid || !file_descriptors[fd].inode) {
+        std::cerr << "Invalid file descriptor in punch_hole" << std::endl;
+        return -1;
+    }
+    auto& fd_entry = file_descriptors[fd];
+    if (fd_entry.mode != FileMode::WRITE || fd_entry.pinned_version != 0) {
+        std::cerr << "File not opened for writing" << std::endl;
+        return -1;
     }
-}
 
-bool COWFileSystem::allocate_block(size_t& block_index) {
-    // Buscar el mejor bloque libre que se ajuste
-    FreeBlockInfo* best_block = find_best_fit(1);
-    
-    if (!best_block) {
-        std::cerr << "allocate_block: No hay bloques libres disponibles" << std::endl;
-        std::cerr << "Memoria total: " << disk_size << " bytes" << std::endl;
-        std::cerr << "Memoria usada: " << get_total_memory_usage() << " bytes" << std::endl;
-        return false;
+    const size_t* map = nullptr;
+    size_t count = 0;
+    size_t size = 0;
+    get_fd_blocks(fd_entry, map, count, size);
+    if (offset >= size || length == 0) {
+        return 0;
     }
-    
-    // Si llegamos aqui, encontramos un bloque libre
-    std::cout << "allocate_block: Asignando bloque " << best_block->start_block << std::endl;
-    
-    block_index = best_block->start_block;
-    
-    // Actualizar la lista de bloques libres
-    if (best_block->block_count > 1) {
-        best_block->start_block++;
-        best_block->block_count--;
-    } else {
-        // Este es el ultimo bloque de este grupo libre
-        if (best_block == free_blocks_list) {
-            free_blocks_list = best_block->next;
-        } else {
-            FreeBlockInfo* current = free_blocks_list;
-            while (current != nullptr && current->next != best_block) {
-                current = current->next;
-            }
-            if (current != nullptr) {
-                current->next = best_block->next;
+    length = std::min(length, size - offset);
+    const size_t end = offset + length;
+    if ((end - 1) / BLOCK_SIZE >= count) {
+        std::cerr << "punch_hole: Mapa de bloques mas corto que el tamano del archivo" << std::endl;
+        return -1;
+    }
+
+    std::vector<size_t>& new_map = map_scratch;
+    new_map.assign(map, map + count);
+    size_t holes = 0;
+    size_t rewritten = 0;
+    for (size_t i = offset / BLOCK_SIZE; i <= (end - 1) / BLOCK_SIZE; i++) {
+        if (new_map[i] == HOLE_BLOCK) {
+            continue;
+        }
+        // Las lecturas se recortan a `size`, asi que la cola del ultimo
+        // bloque no se ve aunque guarde datos de un tamano anterior: cubrir
+        // hasta el final del archivo equivale a cubrir el bloque entero
+        size_t block_start = i * BLOCK_SIZE;
+        size_t from = std::max(offset, block_start) - block_start;
+        size_t to = (end >= size ? BLOCK_SIZE : std::min(end - block_start, BLOCK_SIZE));
+        if (from == 0 && to == BLOCK_SIZE) {
+            new_map[i] = HOLE_BLOCK;
+            holes++;
+            continue;
+        }
+
+        // Bloque de borde: una copia con el tramo a cero, salvo que quede
+        // toda a cero
+        if (fd_entry.verify_checksums && !verify_block(map[i])) {
+            return -1;
+        }
+        size_t current_block = 0;
+        if (!allocate_block(current_block)) {
+            std::cerr << "punch_hole: No se pudo asignar un bloque" << std::endl;
+            for (size_t j = offset / BLOCK_SIZE; j < i; j++) {
+                if (new_map[j] != map[j] && new_map[j] != HOLE_BLOCK) {
+                    free_block(new_map[j]);
+                }
             }
+            return -1;
+        }
+        blocks.touch(current_block, true);
+        uint8_t* out = blocks.data(current_block);
+        std::memcpy(out, block_bytes(map[i]), BLOCK_SIZE);
+        std::memset(out + from, 0, to - from);
+        if (is_all_zero(out, BLOCK_SIZE)) {
+            free_block(current_block);
+            new_map[i] = HOLE_BLOCK;
+            holes++;
+            continue;
         }
-        delete best_block;
+        seal_block(current_block);
+        new_map[i] = current_block;
+        rewritten++;
     }
-    
-    // Inicializar el bloque
-    blocks[block_index].is_used = true;
-    blocks[block_index].next_block = 0;
-    blocks[block_index].ref_count = 0; // Se incrementara en increment_block_refs
-    
-    return true;
-}
 
-void COWFileSystem::free_block(size_t block_index) {
-    if (block_index < blocks.size()) {
-        blocks[block_index].is_used = false;
-        blocks[block_index].next_block = 0;
+    if (holes == 0 && rewritten == 0) {
+        std::cout << "punch_hole: El rango ya era un hueco, no se crea version" << std::endl;
+        return static_cast<ssize_t>(length);
     }
+    publish_version(*fd_entry.inode, new_map.data(), new_map.size(), size, offset, length);
+
+    std::cout << "punch_hole: " << length << " bytes a cero, " << holes << " bloques pasan a hueco y "
+              << rewritten << " reescritos" << std::endl;
+    return static_cast<ssize_t>(length);
 }
 
-bool COWFileSystem::copy_block(size_t source_block, size_t& dest_block) {
-    if (!allocate_block(dest_block)) {
-        return false;
+int COWFileSystem::close(fd_t fd) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[fd].is_valid) {
+        return -1;
+    }
+
+    // Soltar las referencias de un descriptor fijado a una version
+    auto& fd_entry = file_descriptors[fd];
+    if (!fd_entry.pinned_blocks.empty()) {
+        decrement_block_refs(fd_entry.pinned_blocks.data(), fd_entry.pinned_blocks.size());
+        fd_entry.pinned_blocks.clear();
+        pinned_changes++;
+    }
+    fd_entry.pinned_version = 0;
+    fd_entry.pinned_size = 0;
+    fd_entry.is_valid = false;
+    return 0;
+}
+
+Transaction COWFileSystem::begin_transaction() {
+    return Transaction(this);
+}
+
+Transaction::Transaction(Transaction&& other) noexcept
+    : fs(other.fs), ops(std::move(other.ops)), data(std::move(other.data)) {
+    other.fs = nullptr;
+}
+
+Transaction& Transaction::operator=(Transaction&& other) noexcept {
+    if (this != &other) {
+        fs = other.fs;
+        ops = std::move(other.ops);
+        data = std::move(other.data);
+        other.fs = nullptr;
+    }
+    return *this;
+}
+
+void Transaction::stage(fd_t fd, const std::string& filename, const void* buffer, size_t size) {
+    Op op;
+    op.fd = fd;
+    op.filename = filename;
+    op.offset = data.size();
+    op.size = size;
+    const uint8_t* bytes = static_cast<const uint8_t*>(buffer);
+    data.insert(data.end(), bytes, bytes + size);
+    ops.push_back(std::move(op));
+}
+
+bool Transaction::create(const std::string& filename, const void* buffer, size_t size) {
+    if (!fs || (size > 0 && !buffer)) {
+        return false;
+    }
+    stage(-1, filename, buffer, size);
+    return true;
+}
+
+bool Transaction::write(fd_t fd, const void* buffer, size_t size) {
+    if (!fs || fd < 0) {
+        return false;
+    }
+    // Igual que write(), un buffer nulo es una escritura vacia
+    if (!buffer || size == 0) {
+        return true;
+    }
+    stage(fd, std::string(), buffer, size);
+    return true;
+}
+
+bool Transaction::commit() {
+    if (!fs) {
+        return false;
+    }
+    bool committed = fs->commit_transaction(*this);
+    abort();
+    return committed;
+}
+
+void Transaction::abort() {
+    ops.clear();
+    data.clear();
+}
+
+bool COWFileSystem::commit_transaction(Transaction& txn) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (txn.ops.empty()) {
+        return true;
+    }
+    std::cout << "Committing transaction with " << txn.ops.size() << " operations" << std::endl;
+
+    // Un destino por archivo afectado. Si un archivo se escribe varias veces,
+    // vale la ultima escritura
+    struct Target {
+        Inode* inode;                    // nullptr para archivos que se crean
+        const Transaction::Op* op;
+        bool verify;
+        size_t delta_start;
+        size_t delta_size;
+        size_t new_blocks;
+        std::vector<uint8_t> holes;      // Clasificacion de count_new_blocks, para publicar
+    };
+    std::vector<Target> targets;
+    targets.reserve(txn.ops.size());
+    size_t creates = 0;
+
+    // Validar todas las operaciones antes de modificar nada
+    for (const Transaction::Op& op : txn.ops) {
+        if (op.fd < 0) {
+            if (op.filename.empty() || op.filename.length() >= MAX_FILENAME_LENGTH) {
+                std::cerr << "Transaction: invalid filename '" << op.filename << "'" << std::endl;
+                return false;
+            }
+            if (find_inode(op.filename) != nullptr) {
+                std::cerr << "Transaction: file already exists: " << op.filename << std::endl;
+                return false;
+            }
+            for (const Target& t : targets) {
+                if (!t.inode && t.op->filename == op.filename) {
+                    std::cerr << "Transaction: file created twice: " << op.filename << std::endl;
+                    return false;
+                }
+            }
+            targets.push_back(Target{nullptr, &op, false, 0, op.size, 0, {}});
+            creates++;
+            continue;
+        }
+
+        if (op.fd >= static_cast<fd_t>(file_descriptors.size()) ||
+            !file_descriptors[op.fd].is_valid) {
+            std::cerr << "Transaction: invalid file descriptor " << op.fd << std::endl;
+            return false;
+        }
+        const FileDescriptor& fd_entry = file_descriptors[op.fd];
+        if (fd_entry.mode != FileMode::WRITE || !fd_entry.inode) {
+            std::cerr << "Transaction: fd " << op.fd << " not opened for writing" << std::endl;
+            return false;
+        }
+        auto previous = std::find_if(targets.begin(), targets.end(),
+                                     [&](const Target& t) { return t.inode == fd_entry.inode; });
+        if (previous != targets.end()) {
+            previous->op = &op;
+            previous->verify = fd_entry.verify_checksums;
+        } else {
+            targets.push_back(Target{fd_entry.inode, &op, fd_entry.verify_checksums, 0, 0, 0, {}});
+        }
+    }
+
+    size_t free_inodes = 0;
+    for (const auto& inode : inodes) {
+        if (!inode.is_used) {
+            free_inodes++;
+        }
+    }
+    if (free_inodes < creates) {
+        std::cerr << "Transaction: not enough free inodes" << std::endl;
+        return false;
+    }
+
+    // Calcular el delta de cada archivo contra su version actual y cuantos
+    // bloques nuevos necesita
+    size_t total_new_blocks = 0;
+    for (Target& t : targets) {
+        const Transaction::Op& op = *t.op;
+        size_t size = op.size;
+        size_t old_size = t.inode ? t.inode->size : 0;
+        size_t old_count = 0;
+        struct iovec segment;
+        segment.iov_base = txn.data.data() + op.offset;
+        segment.iov_len = size;
+        t.delta_start = 0;
+        t.delta_size = size;
+        if (t.inode && t.inode->version_count > 0 && old_size > 0) {
+            const VersionInfo& current = t.inode->version_history.back();
+            const size_t* current_map = t.inode->block_table.data() + current.map_offset;
+            old_count = current.block_count;
+            if (t.verify && !verify_blocks(current_map, current.block_count)) {
+                std::cerr << "Transaction: error reading current content of "
+                          << t.inode->filename << std::endl;
+                return false;
+            }
+            if (!find_delta(current_map, old_size, &segment, 1, size, t.delta_start, t.delta_size)) {
+                std::cerr << "Transaction: error detecting delta for " << t.inode->filename << std::endl;
+                return false;
+            }
+        }
+        t.new_blocks = count_new_blocks(&segment, 1, size, t.delta_start, t.delta_size, old_count, old_size);
+        t.holes.swap(hole_scratch);
+        total_new_blocks += t.new_blocks;
+    }
+
+    // Reservar los bloques de todo el lote de una vez
+    std::vector<size_t> reserved;
+    if (!allocate_blocks(total_new_blocks, reserved)) {
+        std::cerr << "Transaction: could not allocate " << total_new_blocks << " blocks" << std::endl;
+        return false;
+    }
+
+    // A partir de aqui nada puede fallar: crear los archivos y publicar las
+    // versiones sin soltar el lock
+    std::vector<size_t>& new_map = map_scratch;
+    size_t next_reserved = 0;
+    size_t versions = 0;
+    for (Target& t : targets) {
+        const Transaction::Op& op = *t.op;
+        if (!t.inode) {
+            t.inode = allocate_inode(op.filename);
+            if (op.size == 0) {
+                continue;
+            }
+        } else if (t.delta_size == 0 && op.size == t.inode->size) {
+            continue;  // Sin cambios
+        }
+
+        const VersionInfo* head = t.inode->version_history.empty() ?
+            nullptr : &t.inode->version_history.back();
+        const size_t* old_map = head ? t.inode->block_table.data() + head->map_offset : nullptr;
+        size_t old_count = head ? head->block_count : 0;
+        struct iovec segment;
+        segment.iov_base = txn.data.data() + op.offset;
+        segment.iov_len = op.size;
+        write_delta_blocks(&segment, 1, op.size, t.delta_start, t.delta_size,
+                           old_map, old_count, t.inode->size, new_map,
+                           reserved.data() + next_reserved, t.holes.data());
+        next_reserved += t.new_blocks;
+        publish_version(*t.inode, new_map.data(), new_map.size(), op.size, t.delta_start, t.delta_size);
+        versions++;
+    }
+
+    // Como write(), cada descriptor escrito queda al final de lo que escribio
+    for (const Transaction::Op& op : txn.ops) {
+        if (op.fd >= 0) {
+            file_descriptors[op.fd].current_position = op.size;
+        }
+    }
+
+    std::cout << "Transaction committed: " << versions << " new versions, "
+              << creates << " files created, " << total_new_blocks << " blocks allocated" << std::endl;
+    return true;
+}
+
+// Helper functions implementation
+Inode* COWFileSystem::find_inode(const std::string& filename) {
+    for (size_t i = 0; i < inodes.size(); i++) {
+        if (inodes[i].is_used) {
+            // Debug output to check what's happening
+            std::cout << "Checking inode " << i << ": " 
+                     << "used=" << inodes[i].is_used 
+                     << ", filename='" << inodes[i].filename << "'" << std::endl;
+            
+            if (std::strcmp(inodes[i].filename, filename.c_str()) == 0) {
+                return &inodes[i];
+            }
+        }
+    }
+    return nullptr;
+}
+
+Inode* COWFileSystem::allocate_inode(const std::string& filename) {
+    // Find free inode
+    Inode* inode = nullptr;
+    for (auto& i : inodes) {
+        if (!i.is_used) {
+            inode = &i;
+            break;
+        }
+    }
+    if (!inode) {
+        return nullptr;
+    }
+
+    // Initialize inode
+    std::memset(inode->filename, 0, MAX_FILENAME_LENGTH);
+    std::strncpy(inode->filename, filename.c_str(), MAX_FILENAME_LENGTH - 1);
+    inode->filename[MAX_FILENAME_LENGTH - 1] = '\0';
+    inode->first_block = 0;
+    inode->size = 0;
+    inode->version_count = 0;  // Start at 0, first write will make it 1
+    inode->is_used = true;
+    inode->has_retention = false;
+    inode->version_history.clear();
+    inode->version_index.clear();
+    inode->block_table.clear();
+    // Un archivo nuevo cuenta como reescrito: los incrementos lo guardan completo
+    mark_modified(*inode, next_generation(), true);
+    return inode;
+}
+
+void COWFileSystem::release_inode(Inode& inode) {
+    // Los descriptores normales sobre el archivo dejan de ser validos; los
+    // fijados a una version conservan sus propias referencias a los bloques
+    for (auto& fd_entry : file_descriptors) {
+        if (fd_entry.is_valid && fd_entry.inode == &inode && fd_entry.pinned_version == 0) {
+            fd_entry.is_valid = false;
+        }
+    }
+    unlink_head(inode);
+    for (const auto& version : inode.version_history) {
+        release_version_blocks(inode, version);
+    }
+    inode.version_history.clear();
+    inode.version_index.clear();
+    inode.block_table.clear();
+    inode.first_block = 0;
+    inode.size = 0;
+    inode.version_count = 0;
+    inode.is_used = false;
+    removed_files.emplace_back(inode.filename, next_generation());
+}
+
+void COWFileSystem::publish_version(Inode& inode, const size_t* map, size_t count, size_t size,
+                                    size_t delta_start, size_t delta_size) {
+    // Crear informacion de la nueva version
+    VersionInfo new_version;
+    new_version.version_number = inode.version_count + 1;
+    new_version.timestamp = get_current_time_seconds();
+    new_version.size = size;
+    new_version.block_index = count > 0 ? map[0] : 0;
+    new_version.map_offset = inode.block_table.size();
+    new_version.block_count = count;
+    new_version.delta_start = delta_start;
+    new_version.delta_size = delta_size;
+    new_version.prev_version = inode.version_count;
+    new_version.generation = next_generation();
+    
+    // Incrementar la referencia a los bloques nuevos y compartidos
+    increment_block_refs(map, count);
+    
+    // Actualizar el inodo con la nueva informacion
+    unlink_head(inode);
+    inode.block_table.insert(inode.block_table.end(), map, map + count);
+    inode.version_history.push_back(new_version);
+    inode.version_index.resize(new_version.version_number + 1, 0);
+    inode.version_index[new_version.version_number] =
+        static_cast<uint32_t>(inode.version_history.size());
+    inode.first_block = new_version.block_index;
+    inode.size = size;
+    inode.version_count++;
+    link_head(inode);
+    mark_modified(inode, new_version.generation, false);
+}
+
+fd_t COWFileSystem::allocate_file_descriptor() {
+    for (size_t i = 0; i < file_descriptors.size(); ++i) {
+        if (!file_descriptors[i].is_valid) {
+            return static_cast<fd_t>(i);
+        }
+    }
+    return -1;
+}
+
+void COWFileSystem::free_file_descriptor(fd_t fd) {
+    if (fd >= 0 && fd < static_cast<fd_t>(file_descriptors.size())) {
+        file_descriptors[fd].is_valid = false;
+    }
+}
+
+bool COWFileSystem::allocate_block(size_t& block_index) {
+    // Buscar el mejor bloque libre que se ajuste
+    FreeBlockInfo* best_block = find_best_fit(1);
+    
+    if (!best_block) {
+        std::cerr << "allocate_block: No hay bloques libres disponibles" << std::endl;
+        std::cerr << "Memoria total: " << disk_size << " bytes" << std::endl;
+        std::cerr << "Memoria usada: " << get_total_memory_usage() << " bytes" << std::endl;
+        return false;
+    }
+    
+    // Si llegamos aqui, encontramos un bloque libre
+    std::cout << "allocate_block: Asignando bloque " << best_block->start_block << std::endl;
+    
+    block_index = best_block->start_block;
+    
+    // Actualizar la lista de bloques libres
+    if (best_block->block_count > 1) {
+        best_block->start_block++;
+        best_block->block_count--;
+    } else {
+        // Este es el ultimo bloque de este grupo libre
+        if (best_block == free_blocks_list) {
+            free_blocks_list = best_block->next;
+        } else {
+            FreeBlockInfo* current = free_blocks_list;
+            while (current != nullptr && current->next != best_block) {
+                current = current->next;
+            }
+            if (current != nullptr) {
+                current->next = best_block->next;
+            }
+        }
+        free_info_pool.destroy(best_block);
+    }
+    
+    // Inicializar el bloque
+    blocks.flags[block_index] = BLOCK_USED;
+    blocks.ref_count[block_index] = 0; // Se incrementara en increment_block_refs
+    used_block_count++;
+    
+    return true;
+}
+
+bool COWFileSystem::allocate_blocks(size_t count, std::vector<size_t>& out) {
+    out.clear();
+    if (count == 0) {
+        return true;
+    }
+
+    size_t available = 0;
+    for (FreeBlockInfo* current = free_blocks_list; current; current = current->next) {
+        available += current->block_count;
+    }
+    if (available < count) {
+        std::cerr << "allocate_blocks: Se necesitan " << count << " bloques y hay "
+                  << available << " libres" << std::endl;
+        return false;
+    }
+    out.reserve(count);
+
+    // Preferir un unico hueco donde quepa todo el lote para que quede contiguo;
+    // si no lo hay, consumir los huecos en orden desde el principio
+    FreeBlockInfo* fit = find_best_fit(count);
+    FreeBlockInfo* prev = nullptr;
+    FreeBlockInfo* current = free_blocks_list;
+    while (fit && current != fit) {
+        prev = current;
+        current = current->next;
+    }
+    while (out.size() < count) {
+        size_t take = std::min(current->block_count, count - out.size());
+        for (size_t k = 0; k < take; k++) {
+            size_t block_index = current->start_block + k;
+            blocks.flags[block_index] = BLOCK_USED;
+            blocks.ref_count[block_index] = 0; // Se incrementara en increment_block_refs
+            out.push_back(block_index);
+        }
+        current->start_block += take;
+        current->block_count -= take;
+
+        FreeBlockInfo* next = current->next;
+        if (current->block_count == 0) {
+            if (prev) {
+                prev->next = next;
+            } else {
+                free_blocks_list = next;
+            }
+            free_info_pool.destroy(current);
+        } else {
+            prev = current;
+        }
+        current = next;
+    }
+    used_block_count += count;
+
+    std::cout << "allocate_blocks: Asignados " << count << " bloques desde el bloque "
+              << out.front() << std::endl;
+    return true;
+}
+
+void COWFileSystem::free_block(size_t block_index) {
+    if (block_index < blocks.size() && blocks.is_used(block_index)) {
+        blocks.flags[block_index] = 0;
+        blocks.ref_count[block_index] = 0;
+        used_block_count--;
+        // Con archivo de respaldo el bloque sale de la cache sin escribirse
+        if (blocks.backed()) {
+            blocks.discard(block_index, 1);
+        }
+        // Devolver el bloque a la lista de libres para que pueda reutilizarse
+        add_to_free_list(block_index, 1);
+    }
+}
+
+bool COWFileSystem::copy_block(size_t source_block, size_t& dest_block) {
+    if (!allocate_block(dest_block)) {
+        return false;
+    }
+
+    if (source_block != 0) {
+        if (!verify_block(source_block)) {
+            free_block(dest_block);
+            return false;
+        }
+        blocks.touch(source_block);
+        blocks.touch(dest_block, true);
+        std::memcpy(blocks.data(dest_block), blocks.data(source_block), BLOCK_SIZE);
+    }
+    seal_block(dest_block);
+
+    return true;
+}
+
+const uint8_t* COWFileSystem::block_bytes(size_t block_index) {
+    if (block_index == HOLE_BLOCK) {
+        return ZERO_BLOCK;
+    }
+    blocks.touch(block_index);
+    return blocks.data(block_index);
+}
+
+void COWFileSystem::seal_block(size_t block_index) {
+    blocks.checksum[block_index] = crc32c(blocks.data(block_index), BLOCK_SIZE);
+    blocks.set_flag(block_index, BLOCK_VERIFIED);
+    blocks.clear_flag(block_index, BLOCK_CORRUPT);
+}
+
+bool COWFileSystem::verify_block(size_t block_index) {
+    if (block_index == HOLE_BLOCK) {
+        return true;
+    }
+    if (blocks.has_flag(block_index, BLOCK_VERIFIED)) {
+        return !blocks.has_flag(block_index, BLOCK_CORRUPT);
+    }
+    return scrub_block(block_index);
+}
+
+bool COWFileSystem::scrub_block(size_t block_index) {
+    blocks.touch(block_index);
+    return record_checksum(block_index,
+                           crc32c(blocks.data(block_index), BLOCK_SIZE) == blocks.checksum[block_index]);
+}
+
+bool COWFileSystem::verify_blocks(const size_t* map, size_t count) {
+    Scheduler* pool = write_workers();
+    if (!pool || count * BLOCK_SIZE < PARALLEL_MIN_BYTES) {
+        for (size_t i = 0; i < count; i++) {
+            if (!verify_block(map[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Los CRC se calculan en paralelo; el resultado se registra despues en
+    // orden para que las banderas y las estadisticas no se actualicen a la vez
+    verify_scratch.assign(count, 1);
+    for_each_range(pool, count * BLOCK_SIZE, [&](size_t lo, size_t hi) {
+        for (size_t i = lo / BLOCK_SIZE; i < hi / BLOCK_SIZE; i++) {
+            if (map[i] != HOLE_BLOCK && !blocks.has_flag(map[i], BLOCK_VERIFIED)) {
+                blocks.touch(map[i]);
+                verify_scratch[i] = crc32c(blocks.data(map[i]), BLOCK_SIZE) == blocks.checksum[map[i]];
+            }
+        }
+    });
+    bool all_valid = true;
+    for (size_t i = 0; i < count; i++) {
+        if (map[i] == HOLE_BLOCK) {
+            continue;
+        }
+        bool valid = blocks.has_flag(map[i], BLOCK_VERIFIED) ? !blocks.has_flag(map[i], BLOCK_CORRUPT)
+                                                             : record_checksum(map[i], verify_scratch[i] != 0);
+        all_valid = all_valid && valid;
+    }
+    return all_valid;
+}
+
+bool COWFileSystem::record_checksum(size_t block_index, bool matches) {
+    blocks.set_flag(block_index, BLOCK_VERIFIED);
+    if (matches) {
+        blocks.clear_flag(block_index, BLOCK_CORRUPT);
+        return true;
+    }
+    if (!blocks.has_flag(block_index, BLOCK_CORRUPT)) {
+        blocks.set_flag(block_index, BLOCK_CORRUPT);
+        scrub_stats.corrupt_blocks++;
+        std::cerr << "Error: Checksum mismatch in block " << block_index << std::endl;
+    }
+    return false;
+}
+
+void COWFileSystem::increment_block_refs(const size_t* map, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (map[i] < blocks.size()) {
+            if (++blocks.ref_count[map[i]] == 2) {
+                shared_block_count++;
+            }
+            total_block_refs++;
+            invalidate_block_owners(map[i]);
+        }
+    }
+}
+
+void COWFileSystem::decrement_block_refs(const size_t* map, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        size_t block_index = map[i];
+        if (block_index < blocks.size() && blocks.ref_count[block_index] > 0) {
+            blocks.ref_count[block_index]--;
+            total_block_refs--;
+            invalidate_block_owners(block_index);
+            if (blocks.ref_count[block_index] == 1) {
+                shared_block_count--;
+            } else if (blocks.ref_count[block_index] == 0) {
+                free_block(block_index);
+            }
+        }
+    }
+}
+
+void COWFileSystem::invalidate_block_owners(size_t block_index) {
+    // Cualquier cambio de referencias puede mover el bloque entre exclusivo,
+    // compartido con versiones anteriores y compartido con otros
+    uint32_t owner = blocks.head_owner[block_index];
+    if (owner == 0) {
+        return;
+    }
+    if (owner != MULTI_HEAD_OWNER) {
+        space_cache[owner - 1].valid = false;
+        return;
+    }
+    auto it = head_owner_sets.find(block_index);
+    if (it != head_owner_sets.end()) {
+        for (uint32_t index : it->second) {
+            space_cache[index].valid = false;
+        }
+    }
+}
+
+void COWFileSystem::link_head(const Inode& inode) {
+    if (inode.version_history.empty()) {
+        return;
+    }
+    const uint32_t index = static_cast<uint32_t>(&inode - inodes.data());
+    const VersionInfo& head = inode.version_history.back();
+    const size_t* map = inode.block_table.data() + head.map_offset;
+    for (size_t i = 0; i < head.block_count; i++) {
+        size_t block_index = map[i];
+        if (block_index >= blocks.size()) {
+            continue;
+        }
+        uint32_t& owner = blocks.head_owner[block_index];
+        if (owner == 0 || owner == index + 1) {
+            owner = index + 1;
+            continue;
+        }
+        auto& set = head_owner_sets[block_index];
+        if (owner != MULTI_HEAD_OWNER) {
+            set.assign(1, owner - 1);
+            owner = MULTI_HEAD_OWNER;
+        }
+        if (std::find(set.begin(), set.end(), index) == set.end()) {
+            set.push_back(index);
+        }
+    }
+    space_cache[index].valid = false;
+}
+
+void COWFileSystem::unlink_head(const Inode& inode) {
+    if (inode.version_history.empty()) {
+        return;
+    }
+    const uint32_t index = static_cast<uint32_t>(&inode - inodes.data());
+    const VersionInfo& head = inode.version_history.back();
+    const size_t* map = inode.block_table.data() + head.map_offset;
+    for (size_t i = 0; i < head.block_count; i++) {
+        size_t block_index = map[i];
+        if (block_index >= blocks.size()) {
+            continue;
+        }
+        uint32_t& owner = blocks.head_owner[block_index];
+        if (owner == index + 1) {
+            owner = 0;
+            continue;
+        }
+        if (owner != MULTI_HEAD_OWNER) {
+            continue;
+        }
+        auto it = head_owner_sets.find(block_index);
+        if (it == head_owner_sets.end()) {
+            continue;
+        }
+        auto& set = it->second;
+        set.erase(std::remove(set.begin(), set.end(), index), set.end());
+        if (set.size() <= 1) {
+            owner = set.empty() ? 0 : set.front() + 1;
+            head_owner_sets.erase(it);
+        }
+    }
+    space_cache[index].valid = false;
+}
+
+void COWFileSystem::rebuild_head_owners() {
+    blocks.head_owner.zero();
+    head_owner_sets.clear();
+    for (const auto& inode : inodes) {
+        if (inode.is_used) {
+            link_head(inode);
+        }
+    }
+}
+
+void COWFileSystem::release_version_blocks(Inode& inode, const VersionInfo& version) {
+    if (version.map_offset + version.block_count <= inode.block_table.size()) {
+        decrement_block_refs(inode.block_table.data() + version.map_offset, version.block_count);
+    }
+}
+
+const VersionInfo* COWFileSystem::find_version(const Inode& inode, size_t version_number) const {
+    if (version_number >= inode.version_index.size() || inode.version_index[version_number] == 0) {
+        return nullptr;
+    }
+    return &inode.version_history[inode.version_index[version_number] - 1];
+}
+
+void COWFileSystem::rebuild_version_index(Inode& inode) {
+    std::fill(inode.version_index.begin(), inode.version_index.end(), 0);
+    for (size_t i = 0; i < inode.version_history.size(); i++) {
+        inode.version_index[inode.version_history[i].version_number] = static_cast<uint32_t>(i + 1);
+    }
+}
+
+void COWFileSystem::get_fd_blocks(const FileDescriptor& fd_entry, const size_t*& map,
+                                  size_t& count, size_t& size) const {
+    if (fd_entry.pinned_version != 0) {
+        map = fd_entry.pinned_blocks.data();
+        count = fd_entry.pinned_blocks.size();
+        size = fd_entry.pinned_size;
+        return;
+    }
+    const Inode* inode = fd_entry.inode;
+    if (!inode || inode->version_history.empty()) {
+        map = nullptr;
+        count = 0;
+        size = 0;
+        return;
+    }
+    const VersionInfo& head = inode->version_history.back();
+    map = inode->block_table.data() + head.map_offset;
+    count = head.block_count;
+    size = inode->size;
+}
+
+// Version management implementation
+std::vector<VersionInfo> COWFileSystem::get_version_history(fd_t fd) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[fd].is_valid) {
+        std::cerr << "get_version_history: Invalid file descriptor: " << fd << std::endl;
+        return std::vector<VersionInfo>();
+    }
+    
+    if (!file_descriptors[fd].inode) {
+        std::cerr << "get_version_history: No inode associated with file descriptor: " << fd << std::endl;
+        return std::vector<VersionInfo>();
+    }
+    
+    std::cout << "Retrieved version history for fd " << fd << ": " 
+              << file_descriptors[fd].inode->version_history.size() << " versions" << std::endl;
+    
+    return file_descriptors[fd].inode->version_history;
+}
+
+bool COWFileSystem::with_versions(fd_t fd, const std::function<void(const VersionSpan&)>& visitor) const {
+    // El lock solo se retiene durante el visitor: la vista no sale de aqui
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[fd].is_valid || !file_descriptors[fd].inode) {
+        return false;
+    }
+    const auto& history = file_descriptors[fd].inode->version_history;
+    visitor(VersionSpan(history.data(), history.size()));
+    return true;
+}
+
+bool COWFileSystem::get_version(fd_t fd, size_t version_number, VersionInfo& out) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[fd].is_valid || !file_descriptors[fd].inode) {
+        return false;
+    }
+    const VersionInfo* version = find_version(*file_descriptors[fd].inode, version_number);
+    if (!version) {
+        return false;
+    }
+    out = *version;
+    return true;
+}
+
+namespace {
+
+// Agrega [offset, end) a `changes`, fusionandolo con el ultimo tramo si se
+// tocan
+void add_range(std::vector<ByteRange>& changes, size_t offset, size_t end) {
+    if (offset >= end) {
+        return;
+    }
+    if (!changes.empty() && changes.back().offset + changes.back().length >= offset) {
+        ByteRange& last = changes.back();
+        last.length = std::max(last.offset + last.length, end) - last.offset;
+        return;
+    }
+    changes.push_back(ByteRange{offset, end - offset});
+}
+
+// Tramos que difieren entre dos mapas de bloques; los bloques se comparan por
+// identidad, sin leerlos
+void diff_block_maps(const size_t* from, size_t from_count, size_t from_size,
+                     const size_t* to, size_t to_count, size_t to_size,
+                     std::vector<ByteRange>& changes) {
+    const size_t common = std::min(from_size, to_size);
+    const size_t end = std::max(from_size, to_size);
+    const size_t common_blocks = (common + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (size_t i = 0; i < common_blocks; i++) {
+        size_t a = i < from_count ? from[i] : HOLE_BLOCK;
+        size_t b = i < to_count ? to[i] : HOLE_BLOCK;
+        if (a != b) {
+            add_range(changes, i * BLOCK_SIZE, std::min((i + 1) * BLOCK_SIZE, end));
+        }
+    }
+    add_range(changes, common, end);
+}
+
+} // namespace
+
+bool COWFileSystem::diff(fd_t fd, size_t from_version, size_t to_version,
+                         std::vector<ByteRange>& changes) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    changes.clear();
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) ||
+        !file_descriptors[fd].is_valid || !file_descriptors[fd].inode) {
+        std::cerr << "diff: Invalid file descriptor: " << fd << std::endl;
+        return false;
+    }
+    const Inode& inode = *file_descriptors[fd].inode;
+    const VersionInfo* from = from_version == 0 ? nullptr : find_version(inode, from_version);
+    const VersionInfo* to = to_version == 0 ? nullptr : find_version(inode, to_version);
+    if ((from_version != 0 && !from) || (to_version != 0 && !to)) {
+        std::cerr << "diff: Version " << (from_version != 0 && !from ? from_version : to_version)
+                  << " no existe" << std::endl;
+        return false;
+    }
+
+    diff_block_maps(from ? inode.block_table.data() + from->map_offset : nullptr,
+                    from ? from->block_count : 0, from ? from->size : 0,
+                    to ? inode.block_table.data() + to->map_offset : nullptr,
+                    to ? to->block_count : 0, to ? to->size : 0, changes);
+
+    size_t changed = 0;
+    for (const ByteRange& range : changes) {
+        changed += range.length;
+    }
+    std::cout << "diff: " << changes.size() << " tramos (" << changed << " bytes) entre las versiones "
+              << from_version << " y " << to_version << std::endl;
+    return true;
+}
+
+size_t COWFileSystem::get_version_count(fd_t fd) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[fd].is_valid) {
+        return 0;
+    }
+    if (file_descriptors[fd].pinned_version != 0) {
+        return file_descriptors[fd].pinned_version;
+    }
+    return file_descriptors[fd].inode->version_count;
+}
+
+bool COWFileSystem::rollback_to_version(fd_t fd, size_t version_number) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    std::cout << "Attempting rollback to version " << version_number << " for fd " << fd << std::endl;
+    
+    // Verificar que el descriptor de archivo sea valido
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[fd].is_valid) {
+        std::cerr << "Error: Invalid file descriptor for rollback" << std::endl;
+        return false;
+    }
+    
+    auto& fd_entry = file_descriptors[fd];
+    if (!fd_entry.inode) {
+        std::cerr << "Error: No inode associated with file descriptor for rollback" << std::endl;
+        return false;
+    }
+    if (fd_entry.pinned_version != 0) {
+        std::cerr << "Error: Cannot rollback through a descriptor pinned to a version" << std::endl;
+        return false;
+    }
+
+    // Verificar que la version solicitada exista
+    if (version_number == 0 || version_number > fd_entry.inode->version_count) {
+        std::cerr << "Error: Version " << version_number << " does not exist (max: " << fd_entry.inode->version_count << ")" << std::endl;
+        return false;
+    }
+
+    // Encontrar la version solicitada en el historial
+    Inode& inode = *fd_entry.inode;
+    const VersionInfo* target_version = find_version(inode, version_number);
+    if (!target_version) {
+        std::cerr << "Error: Could not find version " << version_number << " in history" << std::endl;
+        return false;
+    }
+    
+    std::cout << "Rolling back to version " << target_version->version_number 
+              << " with block index " << target_version->block_index 
+              << " and size " << target_version->size << std::endl;
+
+    // Las versiones posteriores ocupan el final del historial: liberar sus
+    // bloques y truncar en el sitio, sin reconstruir el vector
+    const size_t keep_count = inode.version_index[version_number];
+    unlink_head(inode);
+    for (size_t i = keep_count; i < inode.version_history.size(); i++) {
+        std::cout << "Decrementing references for blocks of version " 
+                  << inode.version_history[i].version_number << std::endl;
+        release_version_blocks(inode, inode.version_history[i]);
+    }
+
+    // Los mapas se agregan en orden, asi que los de versiones posteriores estan al final
+    const VersionInfo target = *target_version;
+    inode.version_history.resize(keep_count);
+    inode.version_index.resize(version_number + 1);
+    inode.block_table.resize(target.map_offset + target.block_count);
+    inode.first_block = target.block_index;
+    inode.size = target.size;
+    inode.version_count = version_number;  // Actualizamos el contador de versiones
+    link_head(inode);
+    mark_modified(inode, next_generation(), true);
+    
+    // Actualizar la posicion actual en el descriptor de archivo
+    // Para escritura, lo colocamos al final del archivo
+    // Para lectura, lo dejamos como esta o lo reseteamos segun politica
+    if (fd_entry.mode == FileMode::WRITE) {
+        fd_entry.current_position = target.size;
+    } else {
+        fd_entry.current_position = 0; // Reset para lectura
+    }
+    
+    std::cout << "Rollback completed successfully. New version count: " 
+              << fd_entry.inode->version_count << std::endl;
+    
+    return true;
+}
+
+fd_t COWFileSystem::open_pinned(Inode* inode, const VersionInfo& version) {
+    fd_t fd = allocate_file_descriptor();
+    if (fd < 0) {
+        std::cerr << "Failed to allocate file descriptor in open_version" << std::endl;
+        return -1;
+    }
+
+    // Copiar solo los indices del mapa y fijar sus bloques; los datos se leen
+    // directamente de los bloques compartidos
+    auto& fd_entry = file_descriptors[fd];
+    fd_entry.inode = inode;
+    fd_entry.mode = FileMode::READ;
+    fd_entry.current_position = 0;
+    fd_entry.is_valid = true;
+    fd_entry.pinned_version = version.version_number;
+    fd_entry.verify_checksums = true;
+    reset_readahead(fd_entry);
+    fd_entry.pinned_size = version.size;
+    fd_entry.pinned_blocks.assign(inode->block_table.begin() + version.map_offset,
+                                  inode->block_table.begin() + version.map_offset + version.block_count);
+    increment_block_refs(fd_entry.pinned_blocks.data(), fd_entry.pinned_blocks.size());
+    pinned_changes++;
+
+    std::cout << "Successfully opened version " << version.version_number 
+              << " of '" << inode->filename << "' with fd: " << fd << std::endl;
+    return fd;
+}
+
+fd_t COWFileSystem::open_version(const std::string& filename, size_t version_number) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    Inode* inode = find_inode(filename);
+    if (!inode) {
+        std::cerr << "File not found: " << filename << std::endl;
+        return -1;
+    }
+
+    const VersionInfo* version = find_version(*inode, version_number);
+    if (!version) {
+        std::cerr << "open_version: Version " << version_number << " not found for " 
+                  << filename << std::endl;
+        return -1;
+    }
+    return open_pinned(inode, *version);
+}
+
+fd_t COWFileSystem::open_version_at(const std::string& filename, int64_t timestamp) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    Inode* inode = find_inode(filename);
+    if (!inode) {
+        std::cerr << "File not found: " << filename << std::endl;
+        return -1;
+    }
+
+    // Las versiones se crean en orden temporal: buscar la primera posterior
+    // a `timestamp` y tomar la anterior
+    const auto& history = inode->version_history;
+    auto it = std::upper_bound(history.begin(), history.end(), timestamp,
+        [](int64_t t, const VersionInfo& v) { return t < v.timestamp; });
+    if (it == history.begin()) {
+        std::cerr << "open_version_at: No version of " << filename 
+                  << " exists at " << timestamp << std::endl;
+        return -1;
+    }
+    return open_pinned(inode, *(it - 1));
+}
+
+// Snapshots implementation
+Snapshot* COWFileSystem::find_snapshot(const std::string& name) {
+    for (auto& snap : snapshots) {
+        if (snap.name == name) {
+            return &snap;
+        }
+    }
+    return nullptr;
+}
+
+bool COWFileSystem::snapshot(const std::string& name) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (name.empty() || find_snapshot(name)) {
+        std::cerr << "snapshot: Invalid or duplicated snapshot name: " << name << std::endl;
+        return false;
+    }
+
+    // Capturar la version actual de cada archivo: solo se copian los indices
+    // de sus mapas de bloques y se incrementan sus referencias, sin copiar datos
+    Snapshot snap;
+    snap.name = name;
+    snap.timestamp = get_current_time_seconds();
+    for (const auto& inode : inodes) {
+        if (!inode.is_used) {
+            continue;
+        }
+        SnapshotEntry entry;
+        std::memcpy(entry.filename, inode.filename, MAX_FILENAME_LENGTH);
+        entry.version_number = inode.version_count;
+        entry.size = inode.size;
+        entry.map_offset = snap.block_table.size();
+        entry.block_count = 0;
+        if (!inode.version_history.empty()) {
+            const VersionInfo& head = inode.version_history.back();
+            entry.block_count = head.block_count;
+            snap.block_table.insert(snap.block_table.end(),
+                                    inode.block_table.begin() + head.map_offset,
+                                    inode.block_table.begin() + head.map_offset + head.block_count);
+        }
+        snap.entries.push_back(entry);
+    }
+    increment_block_refs(snap.block_table.data(), snap.block_table.size());
+    snapshots.push_back(std::move(snap));
+    snapshots_generation = next_generation();
+
+    std::cout << "snapshot: '" << name << "' creado con " << snapshots.back().entries.size() 
+              << " archivos y " << snapshots.back().block_table.size() << " bloques referenciados" << std::endl;
+    return true;
+}
+
+bool COWFileSystem::restore(const std::string& name) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    const Snapshot* snap = find_snapshot(name);
+    if (!snap) {
+        std::cerr << "restore: Snapshot not found: " << name << std::endl;
+        return false;
+    }
+
+    // Comprobar primero que hay inodos suficientes para los archivos que ya no existen
+    size_t missing = 0;
+    for (const auto& entry : snap->entries) {
+        if (!find_inode(entry.filename)) {
+            missing++;
+        }
+    }
+    size_t removable = 0;
+    size_t free_inodes = 0;
+    for (const auto& inode : inodes) {
+        if (!inode.is_used) {
+            free_inodes++;
+        } else if (!snap->find_entry(inode.filename)) {
+            removable++;
+        }
+    }
+    if (missing > free_inodes + removable) {
+        std::cerr << "restore: Not enough free inodes" << std::endl;
+        return false;
+    }
+
+    // Eliminar los archivos creados despues del snapshot
+    for (auto& inode : inodes) {
+        if (inode.is_used && !snap->find_entry(inode.filename)) {
+            release_inode(inode);
+        }
+    }
+
+    // Cada archivo del snapshot recibe una nueva version que comparte los
+    // bloques capturados, asi el historial posterior sigue disponible
+    for (const auto& entry : snap->entries) {
+        Inode* inode = find_inode(entry.filename);
+        if (!inode) {
+            inode = allocate_inode(entry.filename);
+        }
+        const size_t* map = snap->block_table.data() + entry.map_offset;
+        if (!inode->version_history.empty()) {
+            const VersionInfo& head = inode->version_history.back();
+            if (head.size == entry.size && head.block_count == entry.block_count &&
+                std::equal(map, map + entry.block_count,
+                           inode->block_table.begin() + head.map_offset)) {
+                continue;  // El archivo no cambio desde el snapshot
+            }
+        } else if (entry.block_count == 0) {
+            continue;
+        }
+        publish_version(*inode, map, entry.block_count, entry.size, 0, entry.size);
+    }
+
+    std::cout << "restore: Sistema de archivos restaurado al snapshot '" << name << "'" << std::endl;
+    return true;
+}
+
+bool COWFileSystem::clone(const std::string& name, const std::string& prefix) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    const Snapshot* snap = find_snapshot(name);
+    if (!snap) {
+        std::cerr << "clone: Snapshot not found: " << name << std::endl;
+        return false;
+    }
+
+    // Validar todos los nombres antes de crear nada
+    size_t free_inodes = 0;
+    for (const auto& inode : inodes) {
+        if (!inode.is_used) {
+            free_inodes++;
+        }
+    }
+    if (snap->entries.size() > free_inodes) {
+        std::cerr << "clone: Not enough free inodes" << std::endl;
+        return false;
+    }
+    for (const auto& entry : snap->entries) {
+        std::string target = prefix + entry.filename;
+        if (target.length() >= MAX_FILENAME_LENGTH || find_inode(target)) {
+            std::cerr << "clone: Cannot create " << target << std::endl;
+            return false;
+        }
+    }
+
+    for (const auto& entry : snap->entries) {
+        Inode* inode = allocate_inode(prefix + entry.filename);
+        if (entry.block_count > 0 || entry.size > 0) {
+            publish_version(*inode, snap->block_table.data() + entry.map_offset,
+                            entry.block_count, entry.size, 0, entry.size);
+        }
+    }
+
+    std::cout << "clone: " << snap->entries.size() << " archivos clonados desde '" << name 
+              << "' con prefijo '" << prefix << "'" << std::endl;
+    return true;
+}
+
+bool COWFileSystem::delete_snapshot(const std::string& name) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    for (auto it = snapshots.begin(); it != snapshots.end(); ++it) {
+        if (it->name == name) {
+            decrement_block_refs(it->block_table.data(), it->block_table.size());
+            snapshots.erase(it);
+            snapshots_generation = next_generation();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool COWFileSystem::list_snapshots(std::vector<std::string>& names) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    names.clear();
+    for (const auto& snap : snapshots) {
+        names.push_back(snap.name);
+    }
+    return true;
+}
+
+// Retention policies implementation
+void COWFileSystem::set_retention_policy(const RetentionPolicy& policy) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    global_retention = policy;
+}
+
+bool COWFileSystem::set_file_retention_policy(fd_t fd, const RetentionPolicy& policy) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[fd].is_valid || !file_descriptors[fd].inode) {
+        std::cerr << "set_file_retention_policy: Invalid file descriptor: " << fd << std::endl;
+        return false;
+    }
+    file_descriptors[fd].inode->retention = policy;
+    file_descriptors[fd].inode->has_retention = true;
+    mark_modified(*file_descriptors[fd].inode, next_generation(), false);
+    return true;
+}
+
+bool COWFileSystem::clear_file_retention_policy(fd_t fd) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
+        !file_descriptors[fd].is_valid || !file_descriptors[fd].inode) {
+        return false;
+    }
+    file_descriptors[fd].inode->has_retention = false;
+    mark_modified(*file_descriptors[fd].inode, next_generation(), false);
+    return true;
+}
+
+size_t COWFileSystem::prune_inode(Inode& inode, const RetentionPolicy& policy, int64_t now) {
+    auto& history = inode.version_history;
+    if (history.size() <= 1) {
+        return 0;
+    }
+    if (policy.keep_last == 0 && policy.max_age_seconds == 0 && 
+        policy.keep_hourly == 0 && policy.keep_daily == 0 && policy.keep_weekly == 0) {
+        return 0;  // Politica vacia: se conserva todo
+    }
+
+    std::vector<bool> keep(history.size(), false);
+    keep.back() = true;  // La version actual siempre se conserva
+
+    for (size_t i = 0; i < policy.keep_last && i < history.size(); i++) {
+        keep[history.size() - 1 - i] = true;
+    }
+
+    if (policy.max_age_seconds > 0) {
+        for (size_t i = 0; i < history.size(); i++) {
+            if (now - history[i].timestamp < static_cast<int64_t>(policy.max_age_seconds)) {
+                keep[i] = true;
+            }
+        }
+    }
+
+    // Adelgazamiento exponencial: de la mas reciente a la mas antigua se
+    // conserva la primera version de cada periodo hasta cubrir N periodos
+    auto thin = [&](size_t periods, int64_t period_seconds) {
+        if (periods == 0) {
+            return;
+        }
+        size_t taken = 0;
+        int64_t last_bucket = 0;
+        for (size_t i = history.size(); i-- > 0 && taken < periods;) {
+            int64_t bucket = history[i].timestamp / period_seconds;
+            if (taken == 0 || bucket != last_bucket) {
+                keep[i] = true;
+                last_bucket = bucket;
+                taken++;
+            }
+        }
+    };
+    thin(policy.keep_hourly, 3600);
+    thin(policy.keep_daily, 86400);
+    thin(policy.keep_weekly, 7 * 86400);
+
+    // Compactar el historial y la tabla de bloques en una sola pasada,
+    // liberando los bloques de las versiones descartadas
+    auto& table = inode.block_table;
+    size_t write_pos = 0;
+    size_t table_pos = 0;
+    for (size_t i = 0; i < history.size(); i++) {
+        if (!keep[i]) {
+            release_version_blocks(inode, history[i]);
+            continue;
+        }
+        VersionInfo& v = history[i];
+        if (table_pos != v.map_offset) {
+            std::copy(table.begin() + v.map_offset, table.begin() + v.map_offset + v.block_count,
+                      table.begin() + table_pos);
+            v.map_offset = table_pos;
+        }
+        table_pos += v.block_count;
+        if (write_pos != i) {
+            history[write_pos] = std::move(v);
+        }
+        write_pos++;
+    }
+    size_t pruned = history.size() - write_pos;
+    history.resize(write_pos);
+    table.resize(table_pos);
+    rebuild_version_index(inode);
+    if (pruned > 0) {
+        mark_modified(inode, next_generation(), true);
+    }
+    return pruned;
+}
+
+size_t COWFileSystem::prune_versions() {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    int64_t now = get_current_time_seconds();
+    size_t pruned = 0;
+    for (auto& inode : inodes) {
+        if (inode.is_used) {
+            pruned += prune_inode(inode, inode.has_retention ? inode.retention : global_retention, now);
+        }
+    }
+    if (pruned > 0) {
+        std::cout << "prune_versions: " << pruned << " versiones eliminadas" << std::endl;
     }
+    return pruned;
+}
 
-    if (source_block != 0) {
-        std::memcpy(blocks[dest_block].data, blocks[source_block].data, BLOCK_SIZE);
-        blocks[dest_block].next_block = blocks[source_block].next_block;
-    }
+void COWFileSystem::start_background_pruning(std::chrono::milliseconds interval) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    stop_background_pruning();
 
-    return true;
+    // La pasada avanza de inodo en inodo y cede entre uno y otro, asi una
+    // politica que elimina muchas versiones no bloquea a los clientes
+    prune_cursor = inodes.size();
+    pruning_job = background().schedule("prune", interval, TaskBudget{std::chrono::milliseconds(2), 0, 0},
+                                        [this](TaskContext& ctx) { return prune_step(ctx); });
 }
 
-void COWFileSystem::increment_block_refs(size_t block_index) {
-    while (block_index != 0 && block_index < blocks.size()) {
-        blocks[block_index].ref_count++;
-        block_index = blocks[block_index].next_block;
+void COWFileSystem::stop_background_pruning() {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (pruning_job != 0) {
+        scheduler->cancel(pruning_job);
+        pruning_job = 0;
     }
 }
 
-void COWFileSystem::decrement_block_refs(size_t block_index) {
-    while (block_index != 0 && block_index < blocks.size()) {
-        if (blocks[block_index].ref_count > 0) {
-            blocks[block_index].ref_count--;
-            if (blocks[block_index].ref_count == 0) {
-                size_t next_block = blocks[block_index].next_block;
-                free_block(block_index);
-                block_index = next_block;
-            } else {
-                break; // Si aun hay referencias, no seguir
+TaskStatus COWFileSystem::prune_step(TaskContext& ctx) {
+    std::unique_lock<PriorityMutex> lock(fs_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return TaskStatus::BLOCKED;
+    }
+    if (prune_cursor >= inodes.size()) {
+        prune_cursor = 0;
+        prune_now = get_current_time_seconds();
+        prune_pass_count = 0;
+    }
+    while (prune_cursor < inodes.size()) {
+        Inode& inode = inodes[prune_cursor++];
+        if (inode.is_used) {
+            prune_pass_count += prune_inode(inode, inode.has_retention ? inode.retention : global_retention,
+                                            prune_now);
+            if (prune_cursor < inodes.size() && ctx.should_yield()) {
+                return TaskStatus::MORE;
             }
         }
-        block_index = blocks[block_index].next_block;
     }
+    if (prune_pass_count > 0) {
+        std::cout << "prune_versions: " << prune_pass_count << " versiones eliminadas" << std::endl;
+    }
+    return TaskStatus::IDLE;
 }
 
-// Version management implementation
-std::vector<VersionInfo> COWFileSystem::get_version_history(fd_t fd) const {
+bool COWFileSystem::set_checksum_verification(fd_t fd, bool enabled) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
     if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
         !file_descriptors[fd].is_valid) {
-        std::cerr << "get_version_history: Invalid file descriptor: " << fd << std::endl;
-        return std::vector<VersionInfo>();
-    }
-    
-    if (!file_descriptors[fd].inode) {
-        std::cerr << "get_version_history: No inode associated with file descriptor: " << fd << std::endl;
-        return std::vector<VersionInfo>();
+        return false;
     }
-    
-    std::cout << "Retrieved version history for fd " << fd << ": " 
-              << file_descriptors[fd].inode->version_history.size() << " versions" << std::endl;
-    
-    return file_descriptors[fd].inode->version_history;
+    file_descriptors[fd].verify_checksums = enabled;
+    return true;
 }
 
-size_t COWFileSystem::get_version_count(fd_t fd) const {
+bool COWFileSystem::set_readahead(fd_t fd, size_t max_blocks) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
     if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
         !file_descriptors[fd].is_valid) {
-        return 0;
+        return false;
     }
-    return file_descriptors[fd].inode->version_count;
+    file_descriptors[fd].readahead_max = max_blocks;
+    file_descriptors[fd].readahead_window = 0;
+    return true;
 }
 
-bool COWFileSystem::revert_to_version(fd_t fd, size_t version) {
-    return false;
+void COWFileSystem::reset_readahead(FileDescriptor& fd_entry) {
+    fd_entry.readahead_max = DEFAULT_READAHEAD_BLOCKS;
+    fd_entry.readahead_window = 0;
+    fd_entry.readahead_next = 0;
+    fd_entry.readahead_end = 0;
 }
 
-bool COWFileSystem::rollback_to_version(fd_t fd, size_t version_number) {
-    std::cout << "Attempting rollback to version " << version_number << " for fd " << fd << std::endl;
-    
-    // Verificar que el descriptor de archivo sea valido
-    if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
-        !file_descriptors[fd].is_valid) {
-        std::cerr << "Error: Invalid file descriptor for rollback" << std::endl;
-        return false;
+void COWFileSystem::update_readahead(FileDescriptor& fd_entry, const size_t* map, size_t map_count,
+                                     size_t offset, size_t length) {
+    // Ventana inicial tras detectar un acceso secuencial
+    static constexpr size_t READAHEAD_MIN_BLOCKS = 4;
+
+    size_t next_block = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    bool sequential = offset == fd_entry.readahead_next;
+    fd_entry.readahead_next = offset + length;
+    if (!sequential || fd_entry.readahead_max == 0) {
+        // Acceso aleatorio: cerrar la ventana hasta que vuelva a ser secuencial
+        fd_entry.readahead_window = 0;
+        fd_entry.readahead_end = next_block;
+        return;
+    }
+
+    // Como en la lectura anticipada de Linux, la siguiente ventana se pide
+    // cuando el lector entra en la segunda mitad de la anterior, para que
+    // llegue antes de que la necesite
+    if (fd_entry.readahead_window == 0) {
+        fd_entry.readahead_window = std::min(READAHEAD_MIN_BLOCKS, fd_entry.readahead_max);
+        fd_entry.readahead_end = std::max(fd_entry.readahead_end, next_block);
+    } else if (next_block + fd_entry.readahead_window / 2 < fd_entry.readahead_end) {
+        return;
+    } else {
+        fd_entry.readahead_window = std::min(fd_entry.readahead_window * 2, fd_entry.readahead_max);
     }
-    
-    auto& fd_entry = file_descriptors[fd];
-    if (!fd_entry.inode) {
-        std::cerr << "Error: No inode associated with file descriptor for rollback" << std::endl;
-        return false;
+
+    size_t start = std::max(fd_entry.readahead_end, next_block);
+    size_t end = std::min(start + fd_entry.readahead_window, map_count);
+    if (start < end) {
+        prefetch_blocks(map + start, end - start);
     }
+    fd_entry.readahead_end = std::max(start, end);
+}
 
-    // Verificar que la version solicitada exista
-    if (version_number == 0 || version_number > fd_entry.inode->version_count) {
-        std::cerr << "Error: Version " << version_number << " does not exist (max: " << fd_entry.inode->version_count << ")" << std::endl;
-        return false;
+void COWFileSystem::prefetch_blocks(const size_t* map, size_t count) {
+    // Agrupar los bloques contiguos en la arena para pedir cada tramo con un
+    // solo madvise. La peticion es asincrona: el kernel trae las paginas que
+    // no esten residentes sin bloquear la lectura actual
+    size_t i = 0;
+    while (i < count) {
+        if (map[i] == HOLE_BLOCK) {
+            i++;
+            continue;
+        }
+        size_t run = 1;
+        while (i + run < count && map[i + run] == map[i] + run) {
+            run++;
+        }
+        if (map[i] + run <= blocks.size()) {
+            for (size_t k = 0; k < run; k++) {
+                blocks.prefetch(map[i] + k);
+            }
+            madvise(blocks.data(map[i]), run * BLOCK_SIZE, MADV_WILLNEED);
+        }
+        i += run;
     }
+}
 
-    // Encontrar la version solicitada en el historial
-    const VersionInfo* target_version = nullptr;
-    for (const auto& v : fd_entry.inode->version_history) {
-        if (v.version_number == version_number) {
-            target_version = &v;
-            break;
+size_t COWFileSystem::scrub() {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    size_t corrupt = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (blocks.ref_count[i] == 0) {
+            continue;
+        }
+        if (!scrub_block(i)) {
+            corrupt++;
         }
+        scrub_stats.blocks_scrubbed++;
     }
-    
-    if (!target_version) {
-        std::cerr << "Error: Could not find version " << version_number << " in history" << std::endl;
-        return false;
+    scrub_stats.passes_completed++;
+    return corrupt;
+}
+
+void COWFileSystem::start_background_scrubbing(size_t blocks_per_second) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    stop_background_scrubbing();
+    if (blocks_per_second == 0) {
+        return;
     }
-    
-    std::cout << "Rolling back to version " << target_version->version_number 
-              << " with block index " << target_version->block_index 
-              << " and size " << target_version->size << std::endl;
 
-    // Guardar las versiones que vamos a mantener (hasta la version solicitada)
-    std::vector<VersionInfo> kept_versions;
-    for (const auto& v : fd_entry.inode->version_history) {
-        if (v.version_number <= version_number) {
-            kept_versions.push_back(v);
-        } else {
-            // Decrementar referencias para versiones que seran eliminadas
-            if (v.block_index < blocks.size()) {
-                std::cout << "Decrementing references for blocks of version " << v.version_number << std::endl;
-                decrement_block_refs(v.block_index);
-            }
-        }
+    // Cada ejecucion comprueba como mucho una tanda y el planificador espera
+    // lo necesario para no superar el ritmo pedido
+    const size_t batch = std::min<size_t>(64, blocks_per_second);
+    const auto pause = std::chrono::milliseconds(std::max<size_t>(1, batch * 1000 / blocks_per_second));
+    scrub_job = background().schedule("scrub", pause,
+                                      TaskBudget{std::chrono::milliseconds(2), batch, blocks_per_second},
+                                      [this](TaskContext& ctx) { return scrub_step(ctx); });
+}
+
+void COWFileSystem::stop_background_scrubbing() {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (scrub_job != 0) {
+        scheduler->cancel(scrub_job);
+        scrub_job = 0;
     }
-    
-    // Actualizar el inodo con la informacion de la version objetivo
-    fd_entry.inode->version_history = kept_versions;
-    fd_entry.inode->first_block = target_version->block_index;
-    fd_entry.inode->size = target_version->size;
-    fd_entry.inode->version_count = version_number;  // Actualizamos el contador de versiones
-    
-    // Actualizar la posicion actual en el descriptor de archivo
-    // Para escritura, lo colocamos al final del archivo
-    // Para lectura, lo dejamos como esta o lo reseteamos segun politica
-    if (fd_entry.mode == FileMode::WRITE) {
-        fd_entry.current_position = target_version->size;
-    } else {
-        fd_entry.current_position = 0; // Reset para lectura
+}
+
+TaskStatus COWFileSystem::scrub_step(TaskContext& ctx) {
+    std::unique_lock<PriorityMutex> lock(fs_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return TaskStatus::BLOCKED;
     }
-    
-    std::cout << "Rollback completed successfully. New version count: " 
-              << fd_entry.inode->version_count << std::endl;
-    
-    return true;
+    if (used_block_count == 0) {
+        return TaskStatus::IDLE;
+    }
+    size_t visited = 0;
+    while (!blocks.empty()) {
+        if (scrub_cursor >= blocks.size()) {
+            scrub_cursor = 0;
+            scrub_stats.passes_completed++;
+        }
+        if (blocks.ref_count[scrub_cursor] > 0) {
+            scrub_block(scrub_cursor);
+            scrub_stats.blocks_scrubbed++;
+            ctx.charge();
+        }
+        scrub_cursor++;
+        if (++visited == blocks.size() && ctx.charged() == 0) {
+            return TaskStatus::IDLE;  // No hay bloques en uso
+        }
+        if (ctx.should_yield()) {
+            return TaskStatus::MORE;
+        }
+    }
+    return TaskStatus::IDLE;
+}
+
+ScrubStats COWFileSystem::get_scrub_stats() const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    return scrub_stats;
 }
 
 // File system operations implementation
 bool COWFileSystem::list_files(std::vector<std::string>& files) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
     files.clear();
     for (const auto& inode : inodes) {
         if (inode.is_used) {
@@ -782,69 +3215,358 @@ bool COWFileSystem::list_files(std::vector<std::string>& files) const {
     return true;
 }
 
+void COWFileSystem::for_each_file(const std::function<void(const FileInfo&)>& visitor) const {
+    for_each_file_from(0, [&visitor](const FileInfo& info) {
+        visitor(info);
+        return true;
+    });
+}
+
+size_t COWFileSystem::for_each_file_from(size_t start,
+                                         const std::function<bool(const FileInfo&)>& visitor) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+
+    // Marcar una sola vez los inodos con descriptores abiertos
+    std::vector<bool> open_inodes(inodes.size(), false);
+    for (const auto& fd_entry : file_descriptors) {
+        if (fd_entry.is_valid && fd_entry.inode) {
+            open_inodes[fd_entry.inode - inodes.data()] = true;
+        }
+    }
+
+    for (size_t i = start; i < inodes.size(); i++) {
+        if (!inodes[i].is_used) {
+            continue;
+        }
+        FileInfo info;
+        fill_file_info(i, open_inodes[i], info);
+        if (!visitor(info)) {
+            return i + 1;
+        }
+    }
+    return MAX_FILES;
+}
+
+void COWFileSystem::for_each_modified_file(uint64_t since,
+                                           const std::function<void(const FileInfo&)>& visitor) const {
+    for_each_modified_file_from(since, 0, [&visitor](const FileInfo& info) {
+        visitor(info);
+        return true;
+    });
+}
+
+size_t COWFileSystem::for_each_modified_file_from(uint64_t since, size_t start,
+                                                  const std::function<bool(const FileInfo&)>& visitor) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    // Inodos desde `start` con alguna entrada posterior a `since`, sin repetir
+    auto it = std::upper_bound(modified_inodes.begin(), modified_inodes.end(), since,
+        [](uint64_t gen, const std::pair<uint64_t, uint32_t>& entry) { return gen < entry.first; });
+    std::vector<uint32_t> changed;
+    changed.reserve(modified_inodes.end() - it);
+    for (; it != modified_inodes.end(); ++it) {
+        if (it->second >= start) {
+            changed.push_back(it->second);
+        }
+    }
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+
+    for (uint32_t index : changed) {
+        const Inode& inode = inodes[index];
+        if (!inode.is_used || inode.modified_generation <= since) {
+            continue;
+        }
+        bool is_open = false;
+        for (const auto& fd_entry : file_descriptors) {
+            if (fd_entry.is_valid && fd_entry.inode == &inode) {
+                is_open = true;
+                break;
+            }
+        }
+        FileInfo info;
+        fill_file_info(index, is_open, info);
+        if (!visitor(info)) {
+            return index + 1;
+        }
+    }
+    return MAX_FILES;
+}
+
+void COWFileSystem::fill_file_info(size_t index, bool is_open, FileInfo& info) const {
+    const Inode& inode = inodes[index];
+    info.filename = inode.filename;
+    info.size = inode.size;
+    info.version_count = inode.version_count;
+    info.is_open = is_open;
+    info.versions = VersionSpan(inode.version_history.data(), inode.version_history.size());
+    info.block_table = inode.block_table.data();
+    info.has_retention = inode.has_retention;
+    info.retention = inode.retention;
+    info.modified_generation = inode.modified_generation;
+    info.rewritten_generation = inode.rewritten_generation;
+}
+
+void COWFileSystem::mark_modified(Inode& inode, uint64_t generation, bool rewritten) {
+    inode.modified_generation = generation;
+    if (rewritten) {
+        inode.rewritten_generation = generation;
+    }
+    // Basta la ultima entrada de cada inodo: un incremento lo incluye si su
+    // modified_generation es posterior a la base. Compactar al doble de los
+    // inodos mantiene el registro acotado con coste amortizado constante
+    if (modified_inodes.size() >= 2 * inodes.size() + 64) {
+        size_t kept = 0;
+        for (const auto& entry : modified_inodes) {
+            if (entry.first == inodes[entry.second].modified_generation) {
+                modified_inodes[kept++] = entry;
+            }
+        }
+        modified_inodes.resize(kept);
+    }
+    modified_inodes.emplace_back(generation, static_cast<uint32_t>(&inode - inodes.data()));
+}
+
+uint64_t COWFileSystem::get_generation() const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    return change_generation;
+}
+
+uint64_t COWFileSystem::get_tracking_start() const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    return tracking_start;
+}
+
+uint64_t COWFileSystem::get_snapshots_generation() const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    return snapshots_generation;
+}
+
+void COWFileSystem::for_each_removed_file(uint64_t since,
+                                          const std::function<void(const std::string&)>& visitor) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    // La lista esta ordenada por generacion
+    auto it = std::upper_bound(removed_files.begin(), removed_files.end(), since,
+        [](uint64_t gen, const std::pair<std::string, uint64_t>& removed) { return gen < removed.second; });
+    for (; it != removed_files.end(); ++it) {
+        visitor(it->first);
+    }
+}
+
+void COWFileSystem::for_each_snapshot(const std::function<void(const Snapshot&)>& visitor) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    for (const auto& snap : snapshots) {
+        visitor(snap);
+    }
+}
+
 size_t COWFileSystem::get_file_size(fd_t fd) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
     if (fd < 0 || fd >= static_cast<fd_t>(file_descriptors.size()) || 
         !file_descriptors[fd].is_valid) {
         return 0;
     }
+    if (file_descriptors[fd].pinned_version != 0) {
+        return file_descriptors[fd].pinned_size;
+    }
     return file_descriptors[fd].inode->size;
 }
 
 FileStatus COWFileSystem::get_file_status(fd_t fd) const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
     FileStatus status = {false, false, 0, 0};
     if (fd >= 0 && fd < static_cast<fd_t>(file_descriptors.size()) && 
         file_descriptors[fd].is_valid) {
         status.is_open = true;
         status.is_modified = (file_descriptors[fd].mode == FileMode::WRITE);
-        status.current_size = file_descriptors[fd].inode->size;
-        status.current_version = file_descriptors[fd].inode->version_count;
+        const auto& fd_entry = file_descriptors[fd];
+        status.current_size = fd_entry.pinned_version != 0 ?
+            fd_entry.pinned_size : fd_entry.inode->size;
+        status.current_version = fd_entry.pinned_version != 0 ?
+            fd_entry.pinned_version : fd_entry.inode->version_count;
     }
     return status;
 }
 
 // Memory management implementation
 size_t COWFileSystem::get_total_memory_usage() const {
-    size_t total = 0;
-    for (const auto& block : blocks) {
-        if (block.is_used) {
-            total += BLOCK_SIZE;
-        }
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    return used_block_count * BLOCK_SIZE;
+}
+
+ArenaOptions COWFileSystem::get_arena_options() const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    return blocks.arena_options();
+}
+
+void COWFileSystem::set_write_parallelism(size_t threads) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    write_parallelism = threads;
+    if (scheduler) {
+        scheduler->set_helpers(write_parallelism > 1 ? write_parallelism - 1 : 0);
     }
-    return total;
+}
+
+Scheduler* COWFileSystem::write_workers() {
+    // Los hilos se crean con la primera escritura grande
+    if (write_parallelism <= 1) {
+        return nullptr;
+    }
+    return &background();
+}
+
+Scheduler& COWFileSystem::background() {
+    if (!scheduler) {
+        // Un hilo por nucleo ademas del llamador; al menos uno para el
+        // mantenimiento aunque las escrituras no usen paralelismo
+        size_t helpers = write_parallelism > 1 ? write_parallelism - 1 : 0;
+        size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        scheduler.reset(new Scheduler(std::max<size_t>(1, cores - 1), helpers, &fs_mutex));
+    }
+    return *scheduler;
+}
+
+std::vector<JobStats> COWFileSystem::get_background_jobs() const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (!scheduler) {
+        return std::vector<JobStats>();
+    }
+    return scheduler->job_stats();
+}
+
+BlockCacheStats COWFileSystem::get_cache_stats() const {
+    return blocks.cache_stats();
+}
+
+SpaceReport COWFileSystem::space_report() const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    SpaceReport report;
+    report.total_bytes = blocks.size() * BLOCK_SIZE;
+    report.used_bytes = used_block_count * BLOCK_SIZE;
+    report.free_bytes = (blocks.size() - used_block_count) * BLOCK_SIZE;
+    report.shared_bytes = shared_block_count * BLOCK_SIZE;
+    report.referenced_bytes = total_block_refs * BLOCK_SIZE;
+
+    report.version_bytes = 0;
+    report.cross_shared_bytes = 0;
+
+    std::unordered_map<size_t, uint32_t> own_refs;
+    for (size_t i = 0; i < inodes.size(); i++) {
+        const Inode& inode = inodes[i];
+        if (!inode.is_used) {
+            continue;
+        }
+        FileSpaceCache& cache = space_cache[i];
+        if (!cache.valid || cache.generation != inode.modified_generation || cache.epoch != sharing_epoch) {
+            cache.exclusive_blocks = 0;
+            cache.version_blocks = 0;
+            cache.shared_blocks = 0;
+            if (!inode.version_history.empty()) {
+                const VersionInfo& head = inode.version_history.back();
+                const size_t* map = inode.block_table.data() + head.map_offset;
+                // Un bloque compartido solo con versiones anteriores tiene
+                // todas sus referencias en la tabla del propio archivo
+                own_refs.clear();
+                for (size_t j = 0; j < head.block_count; j++) {
+                    if (map[j] != HOLE_BLOCK && blocks.ref_count[map[j]] > 1) {
+                        own_refs[map[j]] = 0;
+                    }
+                }
+                if (!own_refs.empty()) {
+                    for (size_t block_index : inode.block_table) {
+                        auto it = own_refs.find(block_index);
+                        if (it != own_refs.end()) {
+                            it->second++;
+                        }
+                    }
+                }
+                for (size_t j = 0; j < head.block_count; j++) {
+                    if (map[j] == HOLE_BLOCK) {
+                        continue;
+                    }
+                    uint32_t refs = blocks.ref_count[map[j]];
+                    if (refs <= 1) {
+                        cache.exclusive_blocks++;
+                    } else if (own_refs[map[j]] >= refs) {
+                        cache.version_blocks++;
+                    } else {
+                        cache.shared_blocks++;
+                    }
+                }
+            }
+            cache.generation = inode.modified_generation;
+            cache.epoch = sharing_epoch;
+            cache.valid = true;
+        }
+        report.version_bytes += cache.version_blocks * BLOCK_SIZE;
+        report.cross_shared_bytes += cache.shared_blocks * BLOCK_SIZE;
+        report.files.push_back(FileSpaceUsage{inode.filename, inode.size,
+                                              cache.exclusive_blocks * BLOCK_SIZE,
+                                              cache.version_blocks * BLOCK_SIZE,
+                                              cache.shared_blocks * BLOCK_SIZE});
+    }
+    return report;
 }
 
 void COWFileSystem::garbage_collect() {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
     std::vector<bool> block_used(blocks.size(), false);
     
-    // Marcar bloques en uso
+    // Marcar bloques en uso: los de los mapas de todas las versiones y los
+    // fijados por descriptores abiertos sobre versiones antiguas
     for (const auto& inode : inodes) {
         if (inode.is_used) {
-            for (const auto& version : inode.version_history) {
-                size_t current_block = version.block_index;
-                while (current_block != 0 && current_block < blocks.size()) {
-                    if (blocks[current_block].ref_count > 0) {
-                        block_used[current_block] = true;
-                    }
-                    current_block = blocks[current_block].next_block;
+            for (size_t block_index : inode.block_table) {
+                if (block_index < blocks.size() && blocks.ref_count[block_index] > 0) {
+                    block_used[block_index] = true;
                 }
             }
         }
     }
+    for (const auto& snap : snapshots) {
+        for (size_t block_index : snap.block_table) {
+            if (block_index < blocks.size()) {
+                block_used[block_index] = true;
+            }
+        }
+    }
+    for (const auto& fd_entry : file_descriptors) {
+        if (fd_entry.is_valid) {
+            for (size_t block_index : fd_entry.pinned_blocks) {
+                if (block_index < blocks.size()) {
+                    block_used[block_index] = true;
+                }
+            }
+        }
+    }
+    
+    // Las vistas de lectura solo se reflejan en los contadores de referencias
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (blocks.ref_count[i] > 0) {
+            block_used[i] = true;
+        }
+    }
     
+    // Reconstruir la lista de bloques libres desde cero, de lo contrario los
+    // bloques que ya estaban en ella se agregarian dos veces
+    while (free_blocks_list) {
+        FreeBlockInfo* temp = free_blocks_list;
+        free_blocks_list = free_blocks_list->next;
+        free_info_pool.destroy(temp);
+    }
+
     // Encontrar bloques libres contiguos
     size_t start = 0;
     while (start < blocks.size()) {
         if (!block_used[start]) {
             size_t count = 0;
             while (start + count < blocks.size() && !block_used[start + count]) {
-                blocks[start + count].is_used = false;
-                blocks[start + count].next_block = 0;
-                blocks[start + count].ref_count = 0;
-                std::memset(blocks[start + count].data, 0, BLOCK_SIZE);
+                blocks.flags[start + count] = 0;
+                blocks.ref_count[start + count] = 0;
                 count++;
             }
             
             if (count > 0) {
+                blocks.discard(start, count);
                 add_to_free_list(start, count);
             }
             
@@ -853,6 +3575,7 @@ void COWFileSystem::garbage_collect() {
         start++;
     }
     
+    recount_blocks();
     merge_free_blocks();
 }
 
@@ -863,7 +3586,11 @@ void COWFileSystem::init_file_system() {
         fd.mode = FileMode::READ;
         fd.current_position = 0;
         fd.is_valid = false;
+        fd.pinned_version = 0;
+        fd.pinned_size = 0;
+        fd.pinned_blocks.clear();
     }
+    drop_block_slots();
 
     // Initialize all inodes
     for (auto& inode : inodes) {
@@ -873,16 +3600,145 @@ void COWFileSystem::init_file_system() {
         inode.size = 0;
         inode.version_count = 0;
         inode.version_history.clear();
+        inode.version_index.clear();
+        inode.block_table.clear();
         inode.shared_blocks.clear();
+        inode.has_retention = false;
+        inode.modified_generation = 0;
+        inode.rewritten_generation = 0;
+    }
+    for (auto& entry : space_cache) {
+        entry.valid = false;
+    }
+
+    // Snapshots y seguimiento de cambios: si una carga de imagen fallo a
+    // medias, lo que ya decodifico apunta a bloques que ahora quedan libres
+    snapshots.clear();
+    removed_files.clear();
+    modified_inodes.clear();
+    change_generation = 0;
+    tracking_start = 0;
+    snapshots_generation = 0;
+
+    // Una desfragmentacion o poda en curso se refiere a los mapas de antes
+    defrag_inode = nullptr;
+    defrag_version = 0;
+    defrag_pos = 0;
+    defrag_dest = 0;
+    defrag_moves.clear();
+    defrag_repeats.clear();
+    std::fill(defrag_done.begin(), defrag_done.end(), 0);
+    prune_cursor = 0;
+
+    // Initialize all blocks. Los datos de un bloque libre no se leen nunca:
+    // se sobrescriben al asignarlo. zero() suelta las paginas en vez de
+    // escribirlas, asi un disco grande y vacio no ocupa memoria
+    blocks.ref_count.zero();
+    blocks.checksum.zero();
+    blocks.flags.zero();
+    blocks.head_owner.zero();
+    head_owner_sets.clear();
+    used_block_count = 0;
+    shared_block_count = 0;
+    total_block_refs = 0;
+    sharing_epoch++;
+}
+
+bool COWFileSystem::grow(size_t new_size) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    size_t old_blocks = total_blocks;
+    size_t new_blocks = new_size / BLOCK_SIZE;
+    if (new_blocks < old_blocks) {
+        std::cerr << "Error: grow() cannot reduce the size, use shrink()" << std::endl;
+        return false;
+    }
+    if (new_blocks == old_blocks) {
+        return true;
+    }
+    if (!set_block_count(new_blocks)) {
+        std::cerr << "Error: Cannot grow to " << new_size << " bytes";
+        if (blocks.arena_options().max_bytes > 0) {
+            std::cerr << " (ArenaOptions::max_bytes = " << blocks.arena_options().max_bytes << ")";
+        } else if (open_views > 0) {
+            std::cerr << " while " << open_views << " read views are open";
+        }
+        std::cerr << std::endl;
+        return false;
+    }
+    add_to_free_list(old_blocks, new_blocks - old_blocks);
+    std::cout << "File system grown to " << disk_size << " bytes" << std::endl;
+    return true;
+}
+
+bool COWFileSystem::shrink(size_t new_size) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    size_t new_blocks = new_size / BLOCK_SIZE;
+    if (new_blocks > total_blocks) {
+        std::cerr << "Error: shrink() cannot increase the size, use grow()" << std::endl;
+        return false;
+    }
+    if (new_blocks == total_blocks) {
+        return true;
+    }
+
+    // Los bloques en uso de la cola bajan, en orden, a los huecos por debajo
+    // del nuevo final
+    defrag_moves.clear();
+    FreeBlockInfo* hole = free_blocks_list;
+    size_t hole_pos = hole ? hole->start_block : 0;
+    size_t tail_used = 0;
+    for (size_t i = new_blocks; i < blocks.size(); i++) {
+        if (!blocks.is_used(i)) {
+            continue;
+        }
+        tail_used++;
+        while (hole && hole_pos == hole->start_block + hole->block_count) {
+            hole = hole->next;
+            hole_pos = hole ? hole->start_block : 0;
+        }
+        if (hole && hole_pos < new_blocks) {
+            defrag_moves.emplace_back(i, hole_pos++);
+        }
+    }
+    if (defrag_moves.size() < tail_used) {
+        std::cerr << "Error: Not enough free space to shrink to " << new_size << " bytes" << std::endl;
+        return false;
     }
 
-    // Initialize all blocks
-    for (auto& block : blocks) {
-        block.is_used = false;
-        block.next_block = 0;
-        block.ref_count = 0;
-        std::memset(block.data, 0, BLOCK_SIZE);
+    // relocate_blocks se salta los bloques que no puede mover; se comprueba
+    // antes para no dejar la cola movida a medias
+    ensure_block_slots();
+    size_t corrupt = 0;
+    size_t viewed = 0;
+    for (const auto& move : defrag_moves) {
+        if (blocks.has_flag(move.first, BLOCK_CORRUPT)) {
+            corrupt++;
+        } else if (block_held_by_view(move.first)) {
+            viewed++;
+        }
+    }
+    if (corrupt > 0) {
+        std::cerr << "Error: " << corrupt << " blocks above " << new_size
+                  << " bytes are corrupt, cannot shrink" << std::endl;
+        return false;
     }
+    if (viewed > 0) {
+        std::cerr << "Error: " << viewed << " blocks above " << new_size
+                  << " bytes are held by read views, cannot shrink" << std::endl;
+        return false;
+    }
+    if (relocate_blocks(defrag_moves) < tail_used) {
+        std::cerr << "Error: Could not move the blocks above " << new_size << " bytes" << std::endl;
+        return false;
+    }
+
+    truncate_free_list(new_blocks);
+    set_block_count(new_blocks);
+    // La desfragmentacion en curso puede apuntar por encima del nuevo final
+    defrag_inode = nullptr;
+    std::cout << "File system shrunk to " << disk_size << " bytes, "
+              << tail_used << " blocks moved" << std::endl;
+    return true;
 }
 
 bool COWFileSystem::merge_free_blocks() {
@@ -897,7 +3753,7 @@ bool COWFileSystem::merge_free_blocks() {
             current->block_count += current->next->block_count;
             FreeBlockInfo* temp = current->next;
             current->next = current->next->next;
-            delete temp;
+            free_info_pool.destroy(temp);
             merged = true;
         } else {
             current = current->next;
@@ -912,11 +3768,11 @@ bool COWFileSystem::split_free_block(FreeBlockInfo* block, size_t size_needed) {
     
     if (block->block_count > size_needed) {
         // Crear nuevo bloque con el espacio restante
-        FreeBlockInfo* new_block = new FreeBlockInfo{
+        FreeBlockInfo* new_block = free_info_pool.create(
             block->start_block + size_needed,
             block->block_count - size_needed,
             block->next
-        };
+        );
         
         block->block_count = size_needed;
         block->next = new_block;
@@ -926,7 +3782,7 @@ bool COWFileSystem::split_free_block(FreeBlockInfo* block, size_t size_needed) {
 }
 
 void COWFileSystem::add_to_free_list(size_t start, size_t count) {
-    FreeBlockInfo* new_block = new FreeBlockInfo{start, count, nullptr};
+    FreeBlockInfo* new_block = free_info_pool.create(start, count, nullptr);
     
     if (!free_blocks_list || start < free_blocks_list->start_block) {
         new_block->next = free_blocks_list;
@@ -963,4 +3819,84 @@ FreeBlockInfo* COWFileSystem::find_best_fit(size_t blocks_needed) {
     return best_fit;
 }
 
-} // namespace cowfs 
\ No newline at end of file
+bool COWFileSystem::range_is_free(size_t start, size_t count) const {
+    if (count == 0) {
+        return true;
+    }
+    for (FreeBlockInfo* current = free_blocks_list; current; current = current->next) {
+        if (current->start_block > start) {
+            return false;
+        }
+        if (start < current->start_block + current->block_count) {
+            return start + count <= current->start_block + current->block_count;
+        }
+    }
+    return false;
+}
+
+bool COWFileSystem::claim_free_range(size_t start, size_t count) {
+    // Saca [start, start + count) del tramo libre que lo contiene, que puede
+    // quedar partido en dos
+    FreeBlockInfo* prev = nullptr;
+    FreeBlockInfo* current = free_blocks_list;
+    while (current && current->start_block + current->block_count <= start) {
+        prev = current;
+        current = current->next;
+    }
+    if (!current || current->start_block > start ||
+        start + count > current->start_block + current->block_count) {
+        return false;
+    }
+    size_t end = start + count;
+    size_t extent_end = current->start_block + current->block_count;
+    if (end < extent_end) {
+        current->next = free_info_pool.create(end, extent_end - end, current->next);
+    }
+    if (start > current->start_block) {
+        current->block_count = start - current->start_block;
+    } else {
+        FreeBlockInfo* next = current->next;
+        if (prev) {
+            prev->next = next;
+        } else {
+            free_blocks_list = next;
+        }
+        free_info_pool.destroy(current);
+    }
+    for (size_t i = start; i < end; i++) {
+        blocks.flags[i] = BLOCK_USED;
+        blocks.ref_count[i] = 0;
+    }
+    used_block_count += count;
+    return true;
+}
+
+void COWFileSystem::truncate_free_list(size_t end) {
+    FreeBlockInfo** link = &free_blocks_list;
+    while (*link && (*link)->start_block < end) {
+        FreeBlockInfo* current = *link;
+        current->block_count = std::min(current->block_count, end - current->start_block);
+        link = &current->next;
+    }
+    while (*link) {
+        FreeBlockInfo* current = *link;
+        *link = current->next;
+        free_info_pool.destroy(current);
+    }
+}
+
+bool COWFileSystem::set_block_count(size_t count) {
+    if (count > blocks.size()) {
+        // Mover la arena dejaria colgando los punteros de las vistas abiertas
+        if (!blocks.grow(count, open_views == 0)) {
+            return false;
+        }
+    } else {
+        blocks.shrink(count);
+    }
+    total_blocks = count;
+    disk_size = count * BLOCK_SIZE;
+    return true;
+}
+
+} // namespace cowfs
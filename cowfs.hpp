@@ -2,10 +2,23 @@
 #define COWFS_HPP
 
 #include <cstdint>
+#include <algorithm>
 #include <string>
 #include <memory>
 #include <vector>
 #include <cstring>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <functional>
+#include <unordered_map>
+#include <iosfwd>
+#include <sys/uio.h>
+#include "cowfs_pool.hpp"
+#include "cowfs_region.hpp"
+#include "cowfs_cache.hpp"
+#include "cowfs_scheduler.hpp"
 
 namespace cowfs {
 
@@ -13,6 +26,12 @@ namespace cowfs {
 constexpr size_t BLOCK_SIZE = 4096;
 constexpr size_t MAX_FILENAME_LENGTH = 255;
 constexpr size_t MAX_FILES = 1024;
+constexpr size_t DEFAULT_READAHEAD_BLOCKS = 256;  // Ventana maxima de lectura anticipada (1 MiB)
+// Entrada de un mapa de bloques que marca un hueco: se lee como ceros y no
+// ocupa ningun bloque
+constexpr size_t HOLE_BLOCK = SIZE_MAX;
+// BlockStore::head_owner de un bloque que usa la version actual de varios archivos
+constexpr uint32_t MULTI_HEAD_OWNER = UINT32_MAX;
 
 // File descriptor type
 using fd_t = int32_t;
@@ -32,23 +51,205 @@ struct FileStatus {
     size_t current_version;
 };
 
-// Block structure
-struct Block {
-    uint8_t data[BLOCK_SIZE];
-    size_t next_block;
-    bool is_used;
-    size_t ref_count;       // Contador de referencias para bloques compartidos
+// Paginas grandes para la arena de bloques
+enum class HugePageMode {
+    NONE,         // Paginas normales
+    TRANSPARENT,  // madvise(MADV_HUGEPAGE); el kernel decide si las usa
+    EXPLICIT      // MAP_HUGETLB; si no hay paginas reservadas se usa TRANSPARENT
+};
+
+// Politica NUMA de la arena de bloques
+enum class NumaPolicy {
+    DEFAULT,     // La del proceso: cada pagina en el nodo que la toca primero
+    INTERLEAVE,  // Repartir las paginas entre todos los nodos en linea
+    BIND         // Todas las paginas en ArenaOptions::numa_node
+};
+
+struct ArenaOptions {
+    HugePageMode huge_pages;
+    NumaPolicy numa_policy;
+    int numa_node;  // Solo se usa con NumaPolicy::BIND
+    // 0: toda la arena en memoria. Si no, la arena se respalda con el archivo
+    // `disk_path + ".blocks"` y solo se mantienen residentes los bloques que
+    // caben en este presupuesto (ver BlockCache)
+    size_t cache_bytes;
+    // Si es > 0, se reserva de una vez espacio de direcciones para este
+    // tamano y es el limite de COWFileSystem::grow(), que nunca mueve la
+    // arena. Con 0 la reserva se calcula con ARENA_RESERVE_FACTOR y grow()
+    // la amplia cuando hace falta
+    size_t max_bytes;
+};
+
+constexpr ArenaOptions DEFAULT_ARENA_OPTIONS{HugePageMode::TRANSPARENT, NumaPolicy::DEFAULT, -1, 0, 0};
+// Sin max_bytes se reserva espacio de direcciones para ARENA_RESERVE_FACTOR
+// veces el tamano del disco, y al menos ARENA_MIN_RESERVE
+constexpr size_t ARENA_RESERVE_FACTOR = 2;
+constexpr size_t ARENA_MIN_RESERVE = size_t(64) << 20;
+
+// Estado de un bloque en BlockStore::flags
+enum BlockFlags : uint8_t {
+    BLOCK_USED = 0x01,
+    BLOCK_VERIFIED = 0x02,   // Checksum ya comprobado desde que se escribio o se cargo
+    BLOCK_CORRUPT = 0x04     // El checksum no coincide con los datos
+};
+
+// Almacen de bloques con layout SoA. Los datos de todos los bloques forman
+// una arena contigua alineada a pagina; contadores, banderas y checksums van
+// en arreglos densos, asi los recorridos de metadatos no tocan los datos.
+class BlockStore {
+public:
+    static constexpr size_t PAGE_ALIGNMENT = 4096;
+    static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    static constexpr size_t CACHE_SHARDS = 16;
+
+    BlockStore() : payload(nullptr), count(0), committed_bytes(0), options(DEFAULT_ARENA_OPTIONS), backing_fd(-1) {}
+    ~BlockStore();
+    BlockStore(const BlockStore&) = delete;
+    BlockStore& operator=(const BlockStore&) = delete;
+
+    /**
+     * @brief Reserva `block_count` bloques con los datos en cero
+     *
+     * Se reserva espacio de direcciones para `requested.max_bytes` (o, si es
+     * 0, para ARENA_RESERVE_FACTOR veces el tamano) y solo se compromete lo
+     * que hace falta para `block_count` bloques; las paginas no ocupan
+     * memoria hasta escribirlas.
+     * Si las paginas grandes o la politica NUMA no estan disponibles se sigue
+     * sin ellas; arena_options() indica lo que realmente se aplico.
+     *
+     * Con `requested.cache_bytes` > 0 la arena es un mapeo compartido de
+     * `backing_path`, que conserva su contenido si ya existia, y los accesos
+     * pasan por una BlockCache con ese presupuesto.
+     */
+    void resize(size_t block_count, const ArenaOptions& requested,
+                const std::string& backing_path = std::string());
+    // Cambian el numero de bloques. Dentro de la reserva la arena no se
+    // mueve; pasarla exige `may_move` (nadie guarda punteros de data()) salvo
+    // que las direcciones siguientes esten libres. Los bloques que se quitan
+    // con shrink() deben estar libres
+    bool grow(size_t block_count, bool may_move);
+    void shrink(size_t block_count);
+    size_t capacity() const { return arena_region.capacity() / BLOCK_SIZE; }
+    const ArenaOptions& arena_options() const { return options; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    uint8_t* data(size_t index) { return payload + index * BLOCK_SIZE; }
+    const uint8_t* data(size_t index) const { return payload + index * BLOCK_SIZE; }
+
+    // Arena completa: size() * BLOCK_SIZE bytes alineados a PAGE_ALIGNMENT
+    uint8_t* arena() { return payload; }
+    const uint8_t* arena() const { return payload; }
+
+    // Con archivo de respaldo, cada acceso a los datos de un bloque se anuncia
+    // antes con touch() para que la cache decida que bloques siguen residentes.
+    // Los punteros de data() son validos siempre: un bloque expulsado se
+    // vuelve a leer del archivo al tocarlo
+    bool backed() const { return backing_fd >= 0; }
+    void touch(size_t index, bool dirty = false) {
+        if (cache) {
+            cache->access(index, dirty);
+        }
+    }
+    void prefetch(size_t index) {
+        if (cache) {
+            cache->prefetch(index);
+        }
+    }
+    // El contenido de los bloques [start, start + n) ya no se necesita
+    void discard(size_t start, size_t n);
+    // Lee `n` bloques desde la posicion actual de `in` a partir del bloque
+    // `start`, en memoria o al archivo de respaldo
+    bool import_blocks(std::istream& in, size_t start, size_t n);
+    // Tras importar: baja al disco lo escrito en el archivo de respaldo
+    void finish_import();
+    // Escribe en el archivo de respaldo los bloques modificados
+    bool flush();
+    BlockCacheStats cache_stats() const;
+
+    bool has_flag(size_t index, uint8_t flag) const { return (flags[index] & flag) != 0; }
+    bool is_used(size_t index) const { return has_flag(index, BLOCK_USED); }
+    void set_flag(size_t index, uint8_t flag) { flags[index] |= flag; }
+    void clear_flag(size_t index, uint8_t flag) { flags[index] &= static_cast<uint8_t>(~flag); }
+
+    // Como la arena, se reservan para su capacidad y valen cero hasta escribirlos
+    ZeroArray<uint32_t> ref_count;  // Contador de referencias para bloques compartidos
+    ZeroArray<uint32_t> checksum;   // CRC32C de los datos, calculado al escribir el bloque
+    ZeroArray<uint8_t> flags;       // BlockFlags
+    // Archivo (indice de inodo + 1) cuya version actual usa el bloque; 0 si
+    // ninguna, MULTI_HEAD_OWNER si varias (ver COWFileSystem::head_owner_sets)
+    ZeroArray<uint32_t> head_owner;
+
+private:
+    void release();
+    void evict(size_t index, bool dirty);
+    bool commit_arena(size_t bytes);
+    bool reserve_more(size_t block_count, bool may_move);
+    bool move_arena(size_t limit);
+
+    ReservedRegion arena_region;
+    uint8_t* payload;
+    size_t count;
+    size_t committed_bytes;
+    ArenaOptions options;
+    int backing_fd;
+    std::unique_ptr<BlockCache> cache;
 };
 
-// Version history structure
+// Version history structure. Es trivialmente copiable para que el historial
+// sea un arreglo contiguo que se copia, trunca y compacta sin asignaciones.
 struct VersionInfo {
     size_t version_number;
-    size_t block_index;
+    size_t block_index;      // Primer bloque de la version (HOLE_BLOCK si empieza con un hueco)
+    size_t map_offset;       // Inicio del mapa de bloques en Inode::block_table
+    size_t block_count;      // Numero de bloques del mapa
     size_t size;
-    std::string timestamp;
+    int64_t timestamp;       // Segundos desde epoch (ver format_timestamp)
     size_t delta_start;      // Índice donde comienzan los cambios
     size_t delta_size;       // Tamaño de los cambios
     size_t prev_version;     // Referencia a la versión anterior
+    uint64_t generation;     // Generacion de cambios en la que se creo (ver get_generation)
+};
+
+static_assert(std::is_trivially_copyable<VersionInfo>::value,
+              "VersionInfo must stay trivially copyable");
+
+// Formatea un timestamp de VersionInfo como "YYYY-MM-DD HH:MM:SS" (hora local)
+std::string format_timestamp(int64_t timestamp);
+
+// Igual que la anterior pero sin asignar memoria; devuelve los bytes escritos
+size_t format_timestamp(int64_t timestamp, char* out, size_t capacity);
+
+// Vista de solo lectura sobre el historial de versiones de un archivo. No
+// asigna memoria y solo es valida dentro del visitor que la recibe
+// (with_versions, for_each_file), mientras el sistema tiene el lock tomado
+class VersionSpan {
+public:
+    VersionSpan() : data_(nullptr), size_(0) {}
+    VersionSpan(const VersionInfo* data, size_t size) : data_(data), size_(size) {}
+
+    const VersionInfo* begin() const { return data_; }
+    const VersionInfo* end() const { return data_ + size_; }
+    const VersionInfo& operator[](size_t i) const { return data_[i]; }
+    const VersionInfo& back() const { return data_[size_ - 1]; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+private:
+    const VersionInfo* data_;
+    size_t size_;
+};
+
+// Politica de retencion de versiones. Cada regla indica versiones a conservar;
+// una version se conserva si cumple cualquiera de ellas. Un campo en 0 desactiva
+// la regla y una politica con todos los campos en 0 conserva todo el historial.
+struct RetentionPolicy {
+    size_t keep_last;          // Conservar las ultimas N versiones
+    uint64_t max_age_seconds;  // Conservar versiones mas jovenes que T segundos
+    size_t keep_hourly;        // Conservar la version mas reciente de cada una de las ultimas N horas
+    size_t keep_daily;         // Idem por dia
+    size_t keep_weekly;        // Idem por semana
 };
 
 // Inode structure
@@ -59,7 +260,55 @@ struct Inode {
     size_t version_count;
     bool is_used;
     std::vector<VersionInfo> version_history;
+    std::vector<uint32_t> version_index;  // version_number -> posicion en el historial + 1 (0 = no existe)
+    std::vector<size_t> block_table;    // Mapas de bloques de todas las versiones, contiguos
     std::vector<size_t> shared_blocks;  // Bloques compartidos entre versiones
+    RetentionPolicy retention;          // Politica propia del archivo
+    bool has_retention;                 // Si es false se usa la politica global
+    uint64_t modified_generation;       // Ultimo cambio de cualquier tipo
+    uint64_t rewritten_generation;      // Ultimo cambio que no fue solo agregar versiones
+};
+
+// Vista de solo lectura de un archivo entregada por COWFileSystem::for_each_file
+struct FileInfo {
+    const char* filename;
+    size_t size;
+    size_t version_count;
+    bool is_open;            // Algun descriptor valido apunta al archivo
+    VersionSpan versions;
+    const size_t* block_table;  // Mapas de bloques, indexados por VersionInfo::map_offset
+    bool has_retention;
+    RetentionPolicy retention;
+    uint64_t modified_generation;
+    uint64_t rewritten_generation;
+};
+
+// Archivo capturado por un snapshot
+struct SnapshotEntry {
+    char filename[MAX_FILENAME_LENGTH];
+    size_t version_number;   // Version del archivo al crear el snapshot
+    size_t size;
+    size_t map_offset;       // Inicio del mapa de bloques en Snapshot::block_table
+    size_t block_count;
+};
+
+// Snapshot de todo el sistema de archivos. Guarda el mapa de bloques de la
+// version actual de cada archivo y mantiene una referencia sobre cada bloque,
+// por lo que los datos capturados nunca se copian ni se liberan mientras exista.
+struct Snapshot {
+    std::string name;
+    int64_t timestamp;
+    std::vector<SnapshotEntry> entries;
+    std::vector<size_t> block_table;
+
+    const SnapshotEntry* find_entry(const char* filename) const {
+        for (const auto& entry : entries) {
+            if (std::strcmp(entry.filename, filename) == 0) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
 };
 
 // Estructura para manejar bloques libres
@@ -69,10 +318,123 @@ struct FreeBlockInfo {
     FreeBlockInfo* next;
 };
 
+// Resultados de la verificacion de checksums (lecturas y scrubber)
+struct ScrubStats {
+    size_t blocks_scrubbed;   // Bloques comprobados por el scrubber
+    size_t passes_completed;  // Recorridos completos de los bloques vivos
+    size_t corrupt_blocks;    // Bloques detectados como corruptos
+};
+
+// Fragmento de un bloque dentro de una vista de lectura
+struct BlockSlice {
+    const uint8_t* data;
+    size_t size;
+};
+
+// Vista de solo lectura devuelta por COWFileSystem::read_view. Los bloques
+// quedan fijados hasta release_view(), asi que los punteros siguen siendo
+// validos aunque el archivo se modifique o se poden sus versiones.
+struct ReadView {
+    std::vector<BlockSlice> slices;
+    std::vector<size_t> blocks;  // Bloques fijados por la vista
+    size_t size;                 // Suma de los tamanos de slices
+};
+
+// Tramo de bytes [offset, offset + length) de un archivo
+struct ByteRange {
+    size_t offset;
+    size_t length;
+};
+
+// Espacio de un archivo segun space_report(), medido sobre su version actual
+struct FileSpaceUsage {
+    std::string filename;
+    size_t size;             // Tamano logico de la version actual
+    size_t exclusive_bytes;  // Bloques que solo referencia la version actual
+    size_t version_bytes;    // Bloques que solo comparte con versiones anteriores del mismo archivo
+    size_t shared_bytes;     // Bloques que tambien referencian otros archivos, snapshots o descriptores
+};
+
+struct SpaceReport {
+    size_t total_bytes;
+    size_t used_bytes;
+    size_t free_bytes;
+    size_t shared_bytes;      // Bloques con mas de una referencia
+    size_t referenced_bytes;  // Suma de todas las referencias: lo que ocuparia sin compartir bloques
+    size_t version_bytes;     // Suma de FileSpaceUsage::version_bytes
+    size_t cross_shared_bytes;  // Suma de FileSpaceUsage::shared_bytes (un bloque cuenta en cada archivo)
+    std::vector<FileSpaceUsage> files;
+};
+
+// Fragmentacion del espacio libre y de la version actual de los archivos
+struct FragmentationReport {
+    size_t free_blocks;
+    size_t free_extents;          // Tramos de la lista de bloques libres
+    size_t largest_free_extent;   // En bloques
+    size_t file_blocks;           // Bloques de los mapas de la version actual
+    size_t file_extents;          // Tramos contiguos en esos mapas
+    size_t fragmented_files;      // Archivos con mas de un tramo
+    size_t repeated_blocks;       // Entradas que repiten un bloque del mismo mapa (copy_range
+                                  // dentro de un archivo); no cuentan como tramos ni se mueven
+    double free_fragmentation;    // 1 - mayor tramo libre / bloques libres (0 = un solo tramo)
+    double file_fragmentation;    // Fraccion de saltos entre bloques consecutivos (0 = todo contiguo)
+};
+
+class COWFileSystem;
+
+/**
+ * @brief Grupo de escrituras y creaciones sobre varios archivos que se
+ * publican juntas con commit()
+ *
+ * Las operaciones solo se guardan (copiando los datos) hasta commit(). Al
+ * confirmar se validan todas, se reservan los bloques de todo el lote en una
+ * sola pasada por la lista de libres y se publican las nuevas versiones sin
+ * soltar el lock del sistema: nadie puede ver una parte del lote. Si algo
+ * falla no se aplica ninguna operacion.
+ *
+ * Igual que write(), cada escritura reemplaza el contenido del archivo; si un
+ * archivo se escribe varias veces en el lote, vale la ultima.
+ */
+class Transaction {
+public:
+    Transaction(Transaction&& other) noexcept;
+    Transaction& operator=(Transaction&& other) noexcept;
+    Transaction(const Transaction&) = delete;
+    Transaction& operator=(const Transaction&) = delete;
+
+    // Crea `filename` al confirmar, opcionalmente con contenido inicial
+    bool create(const std::string& filename, const void* buffer = nullptr, size_t size = 0);
+    bool write(fd_t fd, const void* buffer, size_t size);
+
+    // Publica todas las operaciones; la transaccion queda vacia en cualquier caso
+    bool commit();
+    void abort();
+
+    size_t size() const { return ops.size(); }
+    bool empty() const { return ops.empty(); }
+
+private:
+    friend class COWFileSystem;
+    explicit Transaction(COWFileSystem* fs) : fs(fs) {}
+    void stage(fd_t fd, const std::string& filename, const void* buffer, size_t size);
+
+    struct Op {
+        fd_t fd;               // -1 para creaciones
+        std::string filename;  // Solo para creaciones
+        size_t offset;         // Posicion de los datos en `data`
+        size_t size;
+    };
+
+    COWFileSystem* fs;
+    std::vector<Op> ops;
+    std::vector<uint8_t> data;  // Datos de todas las operaciones, uno tras otro
+};
+
 // Main COW file system class
 class COWFileSystem {
 public:
-    COWFileSystem(const std::string& disk_path, size_t disk_size);
+    COWFileSystem(const std::string& disk_path, size_t disk_size,
+                  const ArenaOptions& arena = DEFAULT_ARENA_OPTIONS);
     ~COWFileSystem();
 
     // Core file operations
@@ -82,13 +444,161 @@ public:
     ssize_t write(fd_t fd, const void* buffer, size_t size);
     int close(fd_t fd);
 
+    /**
+     * @brief Lee en varios buffers, como readv(2): cada segmento continua
+     * donde termino el anterior
+     * @return Bytes leidos en total, o -1 en caso de error
+     */
+    ssize_t readv(fd_t fd, const struct iovec* iov, int iovcnt);
+
+    /**
+     * @brief Escribe la concatenacion de los segmentos como una sola version,
+     * como writev(2)
+     * @return Bytes escritos en total, o -1 en caso de error
+     *
+     * Los datos se comparan y copian directamente desde los segmentos, sin
+     * reunirlos antes en un buffer contiguo.
+     */
+    ssize_t writev(fd_t fd, const struct iovec* iov, int iovcnt);
+
+    /**
+     * @brief Lee sin copiar: devuelve los fragmentos de bloque que cubren
+     * [offset, offset + length) en la version que ve `fd`
+     * @return Bytes cubiertos por la vista, o -1 en caso de error
+     *
+     * No mueve la posicion del descriptor. Los bloques de una version no se
+     * modifican nunca, y la vista mantiene una referencia sobre cada uno hasta
+     * release_view(). Una vista que no se libera impide reutilizar esos bloques.
+     * Si `view` ya contenia una vista, se libera antes.
+     */
+    ssize_t read_view(fd_t fd, size_t offset, size_t length, ReadView& view);
+    void release_view(ReadView& view);
+
+    /**
+     * @brief Copia un archivo compartiendo todos sus bloques (estilo reflink)
+     * @param src Archivo de origen
+     * @param dst Archivo de destino; se crea si no existe, si existe recibe una nueva version
+     * @return true si la copia fue exitosa
+     *
+     * El coste es O(metadatos) sin importar el tamano: no se leen ni copian datos.
+     */
+    bool copy_file(const std::string& src, const std::string& dst);
+
+    /**
+     * @brief Copia `length` bytes de src_fd a dst_fd, como copy_file_range(2)
+     * @return Bytes copiados, o -1 en caso de error
+     *
+     * Crea una unica version nueva en el destino. Los bloques completos con la
+     * misma alineacion en origen y destino se comparten; solo los bloques de
+     * los bordes se copian. Las posiciones de los descriptores no cambian.
+     */
+    ssize_t copy_range(fd_t src_fd, size_t src_offset, fd_t dst_fd, size_t dst_offset, size_t length);
+
+    /**
+     * @brief Pone a cero [offset, offset + length) en una nueva version,
+     * como fallocate(FALLOC_FL_PUNCH_HOLE)
+     * @return Bytes puestos a cero, o -1 en caso de error
+     *
+     * Los bloques que el rango cubre por completo pasan a ser huecos y dejan
+     * de ocupar espacio en la nueva version; en los bloques de los bordes se
+     * escriben ceros. El tamano del archivo y la posicion no cambian.
+     */
+    ssize_t punch_hole(fd_t fd, size_t offset, size_t length);
+
+    /**
+     * @brief Empieza una transaccion sobre varios archivos; ver Transaction
+     */
+    Transaction begin_transaction();
+
     // Version management
     size_t get_version_count(fd_t fd) const;
-    bool revert_to_version(fd_t fd, size_t version);
     std::vector<VersionInfo> get_version_history(fd_t fd) const;
 
+    /**
+     * @brief Recorre el historial de versiones sin copiarlo
+     * @param visitor Recibe una vista del historial con el lock del sistema
+     *        tomado; la vista no debe guardarse ni usarse despues, y el
+     *        visitor no debe modificar el archivo
+     * @return false si el descriptor es invalido
+     */
+    bool with_versions(fd_t fd, const std::function<void(const VersionSpan&)>& visitor) const;
+
+    /**
+     * @brief Busca una version por numero en O(1)
+     * @param out Recibe una copia de la version
+     * @return true si la version existe
+     */
+    bool get_version(fd_t fd, size_t version_number, VersionInfo& out) const;
+
+    /**
+     * @brief Tramos de bytes que difieren entre dos versiones del archivo
+     * @param from_version Version de partida; 0 equivale al archivo vacio
+     * @param changes Sale con los tramos ordenados y sin solapes
+     * @return false si el descriptor no es valido o alguna version no existe
+     *
+     * Compara los mapas de bloques sin leer datos: un bloque compartido por
+     * las dos versiones (o un hueco en ambas) no cambia, y uno distinto se
+     * informa entero aunque su contenido coincida. Los bytes que solo existen
+     * en la version mas larga tambien cuentan como cambiados.
+     */
+    bool diff(fd_t fd, size_t from_version, size_t to_version, std::vector<ByteRange>& changes) const;
+
     // File system operations
     bool list_files(std::vector<std::string>& files) const;
+
+    /**
+     * @brief Recorre los archivos sin abrirlos ni copiar su historial
+     * @param visitor Se invoca una vez por archivo, con el lock del sistema tomado
+     *
+     * Los punteros de FileInfo solo son validos durante la llamada al visitor,
+     * que no debe invocar operaciones que modifiquen el sistema de archivos.
+     */
+    void for_each_file(const std::function<void(const FileInfo&)>& visitor) const;
+
+    /**
+     * @brief Recorre por tandas los archivos desde el inodo `start`
+     * @param visitor Devuelve false para terminar la tanda tras ese archivo
+     * @return Inodo por el que sigue la siguiente tanda; MAX_FILES al terminar
+     *
+     * El lock solo se retiene durante la tanda; entre dos tandas otros hilos
+     * pueden modificar el sistema de archivos.
+     */
+    size_t for_each_file_from(size_t start, const std::function<bool(const FileInfo&)>& visitor) const;
+    void for_each_snapshot(const std::function<void(const Snapshot&)>& visitor) const;
+
+    // Dirty tracking for incremental metadata saves
+    /**
+     * @brief Generacion de cambios actual; aumenta con cada modificacion
+     *
+     * Los inodos y versiones guardan la generacion de su ultimo cambio, lo que
+     * permite exportar solo lo modificado desde una generacion dada.
+     */
+    uint64_t get_generation() const;
+
+    /**
+     * @brief Generacion desde la que el seguimiento de cambios es completo
+     *
+     * Al montar una imagen existente los cambios anteriores no se conocen, asi
+     * que no se pueden generar incrementos respecto a generaciones previas.
+     */
+    uint64_t get_tracking_start() const;
+
+    uint64_t get_snapshots_generation() const;
+
+    // Archivos eliminados despues de la generacion `since`
+    void for_each_removed_file(uint64_t since,
+                               const std::function<void(const std::string&)>& visitor) const;
+
+    /**
+     * @brief Como for_each_file, pero solo los archivos modificados despues de `since`
+     *
+     * Recorre el registro de inodos modificados en lugar de todos los inodos,
+     * asi que el coste depende de los cambios y no del numero de archivos.
+     */
+    void for_each_modified_file(uint64_t since, const std::function<void(const FileInfo&)>& visitor) const;
+    // Como for_each_file_from, pero solo los archivos modificados despues de `since`
+    size_t for_each_modified_file_from(uint64_t since, size_t start,
+                                       const std::function<bool(const FileInfo&)>& visitor) const;
     size_t get_file_size(fd_t fd) const;
     FileStatus get_file_status(fd_t fd) const;
 
@@ -96,6 +606,77 @@ public:
     size_t get_total_memory_usage() const;
     void garbage_collect();
 
+    /**
+     * @brief Uso del espacio global y por archivo
+     *
+     * Los totales se mantienen al asignar, liberar y compartir bloques. El
+     * desglose por archivo se guarda en cache y solo se recalcula para los
+     * archivos modificados o cuando algun bloque pasa de exclusivo a compartido
+     * o al reves, asi que consultarlo con frecuencia es barato.
+     */
+    SpaceReport space_report() const;
+
+    FragmentationReport fragmentation_report() const;
+
+    /**
+     * @brief Reubica bloques para dejar contigua la version actual de cada
+     * archivo y juntar el espacio libre
+     * @param max_blocks Maximo de bloques a mover
+     * @return Bloques movidos
+     *
+     * Se empieza por los archivos abiertos y, entre ellos, por los mas
+     * fragmentados. Todas las versiones, snapshots y descriptores que
+     * referencian un bloque movido pasan a su nueva posicion. Los bloques
+     * retenidos por una vista de lectura no se mueven.
+     */
+    size_t defragment(size_t max_blocks = SIZE_MAX);
+
+    /**
+     * @brief Desfragmenta en segundo plano sin mover mas de `blocks_per_second`
+     */
+    void start_background_defrag(size_t blocks_per_second);
+    void stop_background_defrag();
+
+    /**
+     * @brief Amplia el sistema de archivos a `new_size` bytes en caliente
+     *
+     * Los bloques nuevos pasan a la lista de libres. Dentro del espacio de
+     * direcciones reservado no se copia ni se mueve nada. Pasarlo amplia la
+     * reserva, moviendo la arena si las direcciones siguientes estan
+     * ocupadas; eso falla mientras haya vistas de read_view() abiertas. Con
+     * ArenaOptions::max_bytes la reserva es fija y es el limite.
+     */
+    bool grow(size_t new_size);
+
+    /**
+     * @brief Reduce el sistema de archivos a `new_size` bytes en caliente
+     *
+     * Los bloques en uso por encima del nuevo final se mueven antes a huecos
+     * libres, actualizando todas sus referencias (ver defragment()). Falla sin
+     * cambiar el tamano si no caben o si alguno esta retenido por una vista.
+     */
+    bool shrink(size_t new_size);
+
+    // Opciones de la arena de bloques que se pudieron aplicar
+    ArenaOptions get_arena_options() const;
+
+    /**
+     * @brief Hilos que participan en las escrituras grandes (1 = sin paralelismo)
+     *
+     * Por defecto se usan todos los nucleos. En escrituras de varios MiB la
+     * verificacion del contenido anterior, la busqueda del delta y la copia a
+     * los bloques se reparten por tramos entre esos hilos.
+     */
+    void set_write_parallelism(size_t threads);
+
+    /**
+     * @brief Aciertos, fallos y expulsiones de la cache de bloques
+     *
+     * Solo tiene contenido si la arena se respalda con archivo
+     * (ArenaOptions::cache_bytes > 0); si no, todo es cero.
+     */
+    BlockCacheStats get_cache_stats() const;
+
     /**
      * @brief Revierte un archivo a una versión anterior
      * @param fd Descriptor de archivo
@@ -104,13 +685,157 @@ public:
      */
     bool rollback_to_version(fd_t fd, size_t version_number);
 
+    /**
+     * @brief Abre una version concreta de un archivo en modo solo lectura
+     * @param filename Nombre del archivo
+     * @param version_number Numero de version a abrir
+     * @return Descriptor fijado a esa version, o -1 en caso de error
+     *
+     * El descriptor mantiene referencias a los bloques de la version, por lo que
+     * sigue siendo legible aunque la version se elimine por rollback o poda.
+     */
+    fd_t open_version(const std::string& filename, size_t version_number);
+
+    /**
+     * @brief Abre la ultima version creada en o antes de `timestamp`
+     * @param timestamp Segundos desde epoch
+     */
+    fd_t open_version_at(const std::string& filename, int64_t timestamp);
+
+    // Snapshots
+    /**
+     * @brief Captura atomicamente la version actual de todos los archivos
+     * @param name Nombre unico del snapshot
+     * @return true si se creo el snapshot
+     *
+     * No copia datos: solo los mapas de bloques, cuyos bloques quedan
+     * referenciados por el snapshot hasta delete_snapshot().
+     */
+    bool snapshot(const std::string& name);
+
+    /**
+     * @brief Devuelve el sistema de archivos al estado de un snapshot
+     *
+     * Cada archivo capturado recibe una nueva version que comparte los bloques
+     * del snapshot (su historial se conserva). Los archivos creados despues del
+     * snapshot se eliminan y sus descriptores dejan de ser validos.
+     */
+    bool restore(const std::string& name);
+
+    /**
+     * @brief Crea una copia de cada archivo del snapshot llamada prefix + nombre
+     *
+     * Las copias comparten todos sus bloques con el snapshot.
+     */
+    bool clone(const std::string& name, const std::string& prefix);
+
+    bool delete_snapshot(const std::string& name);
+    bool list_snapshots(std::vector<std::string>& names) const;
+
+    /**
+     * @brief Escribe en `out` los cambios entre dos snapshots para receive()
+     * @param from_snapshot Snapshot base; vacio para enviar `to_snapshot` completo
+     * @return false si algun snapshot no existe, un bloque esta corrupto o falla la escritura
+     *
+     * Solo viajan los datos de los bloques de `to_snapshot` que no estan en
+     * `from_snapshot`, una vez cada uno aunque varios archivos los compartan.
+     * Los mapas de bloques se envian como tramos que apuntan a esos bloques o
+     * a posiciones del snapshot base.
+     */
+    bool send(const std::string& from_snapshot, const std::string& to_snapshot, std::ostream& out);
+
+    /**
+     * @brief Aplica un flujo de send() y deja los archivos como en su snapshot destino
+     * @return false si el flujo esta danado o no encaja con este sistema de archivos
+     *
+     * Un flujo incremental exige el snapshot base recibido antes. Se crea el
+     * snapshot destino con los mismos bloques compartidos que en el origen y
+     * despues se restaura como con restore(). Si algo falla no se modifica nada.
+     */
+    bool receive(std::istream& in);
+
+    // Retention policies
+    void set_retention_policy(const RetentionPolicy& policy);
+    bool set_file_retention_policy(fd_t fd, const RetentionPolicy& policy);
+    bool clear_file_retention_policy(fd_t fd);
+
+    /**
+     * @brief Aplica las politicas de retencion a todos los archivos
+     * @return Numero de versiones eliminadas
+     *
+     * La version actual de cada archivo nunca se elimina. Los bloques de las
+     * versiones eliminadas se liberan cuando su contador de referencias llega a 0.
+     */
+    size_t prune_versions();
+
+    /**
+     * @brief Aplica las politicas de retencion en segundo plano cada `interval`
+     */
+    void start_background_pruning(std::chrono::milliseconds interval);
+    void stop_background_pruning();
+
+    // Block checksums
+    /**
+     * @brief Activa o desactiva la verificacion de checksums al leer por `fd`
+     *
+     * Esta activa por defecto. Cada bloque se verifica la primera vez que se lee
+     * despues de cargar la imagen; como los bloques no se modifican una vez
+     * escritos, las lecturas siguientes no repiten el calculo.
+     */
+    bool set_checksum_verification(fd_t fd, bool enabled);
+
+    /**
+     * @brief Fija la ventana maxima de lectura anticipada de `fd`, en bloques
+     *
+     * Cuando las lecturas de un descriptor son secuenciales se anticipan los
+     * bloques siguientes de su version con una ventana que empieza pequena y
+     * se duplica mientras el acceso siga siendo secuencial. Un salto vuelve a
+     * cerrarla. 0 desactiva la lectura anticipada.
+     */
+    bool set_readahead(fd_t fd, size_t max_blocks);
+
+    /**
+     * @brief Recalcula el checksum de todos los bloques en uso
+     * @return Numero de bloques corruptos encontrados en esta pasada
+     */
+    size_t scrub();
+
+    /**
+     * @brief Recorre en segundo plano los bloques en uso verificando sus
+     * checksums, limitado a `blocks_per_second`
+     */
+    void start_background_scrubbing(size_t blocks_per_second);
+    void stop_background_scrubbing();
+    ScrubStats get_scrub_stats() const;
+
+    /**
+     * @brief Contadores de las tareas de mantenimiento activas
+     *
+     * La poda y el scrubber corren como tareas del planificador: comparten
+     * hilos con las escrituras grandes, ceden en cuanto una operacion espera
+     * por el sistema de archivos y respetan su presupuesto de CPU y E/S.
+     */
+    std::vector<JobStats> get_background_jobs() const;
+
 private:
+    friend class Transaction;
+
     // Internal helper functions
     bool initialize_disk();
+    bool load_disk_image(std::ifstream& disk);
+    bool save_disk_image();
+    void rebuild_block_state();
     Inode* find_inode(const std::string& filename);
     fd_t allocate_file_descriptor();
+    Inode* allocate_inode(const std::string& filename);
+    void release_inode(Inode& inode);
+    void publish_version(Inode& inode, const size_t* map, size_t count, size_t size,
+                         size_t delta_start, size_t delta_size);
+    Snapshot* find_snapshot(const std::string& name);
     void free_file_descriptor(fd_t fd);
     bool allocate_block(size_t& block_index);
+    bool allocate_blocks(size_t count, std::vector<size_t>& out);
+    bool commit_transaction(Transaction& txn);
     void free_block(size_t block_index);
     bool copy_block(size_t source_block, size_t& dest_block);
 
@@ -120,16 +845,28 @@ private:
         FileMode mode;
         size_t current_position;
         bool is_valid;
+        size_t pinned_version;              // 0 = sigue la version actual
+        size_t pinned_size;
+        std::vector<size_t> pinned_blocks;  // Bloques referenciados por el descriptor
+        bool verify_checksums;
+        // Lectura anticipada
+        size_t readahead_max;     // Ventana maxima en bloques; 0 = desactivada
+        size_t readahead_window;  // Ventana actual; 0 = acceso no secuencial
+        size_t readahead_next;    // Posicion donde empezaria la siguiente lectura secuencial
+        size_t readahead_end;     // Primer bloque del mapa que aun no se ha anticipado
     };
 
     std::vector<FileDescriptor> file_descriptors;
     std::vector<Inode> inodes;
-    std::vector<Block> blocks;
+    BlockStore blocks;
+    std::vector<Snapshot> snapshots;
     std::string disk_path;
     size_t disk_size;
     size_t total_blocks;
 
-    // Lista enlazada de bloques libres
+    // Lista enlazada de bloques libres; los nodos salen de un pool para que
+    // asignar y liberar bloques no llame al asignador general
+    ObjectPool<FreeBlockInfo> free_info_pool;
     FreeBlockInfo* free_blocks_list;
     
     // Nuevos métodos privados para gestión de memoria
@@ -137,18 +874,175 @@ private:
     bool split_free_block(FreeBlockInfo* block, size_t size_needed);
     void add_to_free_list(size_t start, size_t count);
     FreeBlockInfo* find_best_fit(size_t blocks_needed);
+    bool range_is_free(size_t start, size_t count) const;
+    bool claim_free_range(size_t start, size_t count);
+    // Quita de la lista de libres todo lo que queda a partir de `end`
+    void truncate_free_list(size_t end);
+    // Cambia el tamano del almacen y de total_blocks/disk_size; la lista de
+    // libres queda a cargo del llamador
+    bool set_block_count(size_t count);
+
+    // Desfragmentacion
+    bool defrag_step(size_t budget, size_t& moved);
+    bool pick_defrag_target();
+    size_t compact_free_space(size_t budget);
+    size_t relocate_blocks(std::vector<std::pair<size_t, size_t>>& moves);
+    void build_block_slots();
+    void drop_block_slots();
+    void ensure_block_slots();
+    TaskStatus defrag_task(TaskContext& ctx, size_t batch);
 
     void init_file_system();
 
     // Nuevos métodos para manejo de versiones incrementales
-    bool find_delta(const void* old_data, const void* new_data, 
-                   size_t old_size, size_t new_size,
+    bool find_delta(const size_t* old_map, size_t old_size,
+                   const struct iovec* iov, size_t iovcnt, size_t new_size,
                    size_t& delta_start, size_t& delta_size);
-    bool write_delta_blocks(const void* buffer, size_t size, 
-                          size_t delta_start, size_t& first_block);
-    bool read_version_data(size_t version, fd_t fd, void* buffer, size_t& size);
-    void increment_block_refs(size_t block_index);
-    void decrement_block_refs(size_t block_index);
+    bool write_delta_blocks(const struct iovec* iov, size_t iovcnt, size_t size,
+                          size_t delta_start, size_t delta_size,
+                          const size_t* old_map, size_t old_count, size_t old_size,
+                          std::vector<size_t>& new_map,
+                          const size_t* reserved = nullptr,
+                          const uint8_t* holes = nullptr);
+    void increment_block_refs(const size_t* map, size_t count);
+    void decrement_block_refs(const size_t* map, size_t count);
+
+    // Contadores de espacio; recount_blocks() los recalcula desde los arreglos
+    void recount_blocks();
+    size_t used_block_count;
+    size_t shared_block_count;
+    size_t total_block_refs;
+    uint64_t sharing_epoch;   // Cambia cuando los contadores se recalculan en bloque
+    size_t open_views;        // Vistas de read_view() con punteros a la arena
+
+    // Desglose de space_report() por archivo. Una entrada se invalida cuando
+    // cambia el archivo o el contador de referencias de un bloque de su
+    // version actual; BlockStore::head_owner dice a que archivos afecta
+    struct FileSpaceCache {
+        uint64_t generation;  // Inode::modified_generation al calcularlo
+        uint64_t epoch;       // sharing_epoch al calcularlo
+        size_t exclusive_blocks;
+        size_t version_blocks;
+        size_t shared_blocks;
+        bool valid;
+    };
+    mutable std::vector<FileSpaceCache> space_cache;  // Indexado igual que inodes
+    // Inodos que usan cada bloque con head_owner == MULTI_HEAD_OWNER
+    std::unordered_map<size_t, std::vector<uint32_t>> head_owner_sets;
+    void link_head(const Inode& inode);
+    void unlink_head(const Inode& inode);
+    void rebuild_head_owners();
+    void invalidate_block_owners(size_t block_index);
+
+    // Checksums de bloques
+    void seal_block(size_t block_index);
+    bool verify_block(size_t block_index);
+    bool scrub_block(size_t block_index);
+    bool record_checksum(size_t block_index, bool matches);
+    bool verify_blocks(const size_t* map, size_t count);
+
+    // Escrituras grandes en paralelo
+    Scheduler* write_workers();
+    Scheduler& background();
+    TaskStatus prune_step(TaskContext& ctx);
+    TaskStatus scrub_step(TaskContext& ctx);
+    size_t scan_prefix(const size_t* old_map, const struct iovec* iov, size_t iovcnt,
+                       size_t from, size_t to);
+    size_t scan_suffix(const size_t* old_map, size_t old_size,
+                       const struct iovec* iov, size_t iovcnt, size_t new_size,
+                       size_t from, size_t to);
+    // Bloques que debe asignar una escritura: los que no comparte con la
+    // version anterior y no son todo ceros. Marca los huecos en hole_scratch
+    size_t count_new_blocks(const struct iovec* iov, size_t iovcnt, size_t size,
+                            size_t delta_start, size_t delta_size, size_t old_count, size_t old_size);
+    // Datos de una entrada de un mapa; un hueco apunta a un bloque de ceros
+    const uint8_t* block_bytes(size_t block_index);
+
+    // Busqueda de versiones y resolucion del mapa de bloques de un descriptor
+    const VersionInfo* find_version(const Inode& inode, size_t version_number) const;
+    void rebuild_version_index(Inode& inode);
+    void get_fd_blocks(const FileDescriptor& fd_entry, const size_t*& map,
+                       size_t& count, size_t& size) const;
+    fd_t open_pinned(Inode* inode, const VersionInfo& version);
+    void reset_readahead(FileDescriptor& fd_entry);
+    void update_readahead(FileDescriptor& fd_entry, const size_t* map, size_t map_count,
+                          size_t offset, size_t length);
+    void prefetch_blocks(const size_t* map, size_t count);
+    void release_version_blocks(Inode& inode, const VersionInfo& version);
+
+    // Retencion de versiones
+    size_t prune_inode(Inode& inode, const RetentionPolicy& policy, int64_t now);
+
+    RetentionPolicy global_retention;
+
+    // Buffer de trabajo de write(), reutilizado para no reservar memoria en
+    // cada escritura
+    std::vector<size_t> map_scratch;
+    std::vector<size_t> reserve_scratch;
+    std::vector<uint8_t> verify_scratch;
+    std::vector<uint8_t> hole_scratch;
+
+    // Seguimiento de cambios
+    uint64_t next_generation() { return ++change_generation; }
+    void mark_modified(Inode& inode, uint64_t generation, bool rewritten);
+    void fill_file_info(size_t index, bool is_open, FileInfo& info) const;
+    uint64_t change_generation;
+    uint64_t tracking_start;
+    uint64_t snapshots_generation;
+    std::vector<std::pair<std::string, uint64_t>> removed_files;  // Nombre y generacion de la eliminacion
+    // Generacion e indice de inodo de cada cambio, ordenado por generacion.
+    // Se compacta a la ultima entrada de cada inodo cuando crece demasiado
+    std::vector<std::pair<uint64_t, uint32_t>> modified_inodes;
+
+    // Todas las operaciones publicas toman este lock para poder convivir con
+    // las tareas en segundo plano. Es recursivo porque write() usa read(). Las
+    // tareas entran con try_lock() y lo sueltan en cuanto un cliente espera.
+    mutable PriorityMutex fs_mutex;
+
+    // Poda en segundo plano: recorre los inodos por tandas
+    Scheduler::JobId pruning_job;
+    size_t prune_cursor;       // Siguiente inodo de la pasada en curso
+    int64_t prune_now;         // Instante de referencia de la pasada
+    size_t prune_pass_count;   // Versiones eliminadas en la pasada
+
+    // Desfragmentacion en curso: archivo, siguiente posicion de su mapa y
+    // bloque destino de esa posicion
+    Scheduler::JobId defrag_job;
+    Inode* defrag_inode;
+    size_t defrag_version;
+    size_t defrag_pos;
+    size_t defrag_dest;
+    std::vector<uint8_t> defrag_done;   // Archivos ya tratados en esta pasada
+    std::vector<std::pair<size_t, size_t>> defrag_moves;
+    std::vector<size_t> defrag_repeats; // Posiciones del mapa en curso que repiten un bloque anterior
+
+    // Indice inverso de las referencias de los mapas (inodos, descriptores
+    // fijados y snapshots), ordenado por bloque, para que relocate_blocks no
+    // recorra todas las tablas en cada tanda. Se construye una vez por pasada
+    // y se rehace si los mapas cambian fuera de la desfragmentacion
+    struct BlockSlot {
+        size_t block;
+        uint32_t owner;  // Inodo, MAX_FILES + descriptor o 2 * MAX_FILES + snapshot
+        size_t pos;
+    };
+    size_t* block_slot(const BlockSlot& slot);  // Entrada a la que apunta, o nullptr
+    void for_each_block_slot(size_t block_index, const std::function<void(size_t*, const BlockSlot&)>& fn);
+    bool block_held_by_view(size_t block_index);
+    std::vector<BlockSlot> block_slots;
+    std::unordered_map<size_t, size_t> block_slot_alias;  // Bloque movido -> bloque con el que figura
+    bool block_slots_valid;
+    uint64_t block_slots_generation;  // change_generation al construirlo
+    uint64_t block_slots_pinned;      // pinned_changes al construirlo
+    uint64_t pinned_changes;          // Cambia al fijar o soltar los bloques de un descriptor
+
+    Scheduler::JobId scrub_job;
+    size_t scrub_cursor;       // Siguiente bloque a comprobar en segundo plano
+    ScrubStats scrub_stats;
+
+    // Hilos para escrituras grandes y tareas de mantenimiento; se crean la
+    // primera vez que hacen falta
+    size_t write_parallelism;
+    std::unique_ptr<Scheduler> scheduler;
 };
 
 } // namespace cowfs
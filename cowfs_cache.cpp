@@ -0,0 +1,236 @@
+#include "cowfs_cache.hpp"
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+namespace cowfs {
+
+BlockCache::BlockCache(size_t block_count, size_t max_block_count, size_t capacity_limit,
+                       size_t shard_count, EvictFn evict)
+    : capacity_blocks(std::max<size_t>(1, capacity_limit)),
+      shard_count(std::max<size_t>(1, std::min(shard_count, capacity_blocks))),
+      shards(new Shard[this->shard_count]),
+      evict(std::move(evict)) {
+    max_block_count = std::max(max_block_count, block_count);
+    if (max_block_count >= NIL) {
+        throw std::length_error("BlockCache: demasiados bloques");
+    }
+    if (!where.reserve(max_block_count) || !dirty.reserve(max_block_count) ||
+        !prev.reserve(max_block_count) || !next.reserve(max_block_count) ||
+        !resize(block_count)) {
+        throw std::bad_alloc();
+    }
+    // El resto de la division se reparte entre los primeros shards para que
+    // la suma sea exactamente la capacidad pedida
+    for (size_t s = 0; s < this->shard_count; s++) {
+        Shard& shard = shards[s];
+        for (List& list : shard.lists) {
+            list = List{NIL, NIL, 0};
+        }
+        shard.capacity = capacity_blocks / this->shard_count + (s < capacity_blocks % this->shard_count ? 1 : 0);
+        shard.target_t1 = 0;
+        shard.hits = shard.misses = shard.evictions = shard.writebacks = 0;
+    }
+}
+
+bool BlockCache::access(size_t block, bool is_dirty) {
+    Shard& shard = shard_of(block);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return admit(shard, block, is_dirty, true);
+}
+
+void BlockCache::prefetch(size_t block) {
+    Shard& shard = shard_of(block);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    admit(shard, block, false, false);
+}
+
+void BlockCache::forget(size_t block) {
+    Shard& shard = shard_of(block);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (where[block] != NONE) {
+        unlink(shard, static_cast<uint32_t>(block));
+    }
+    dirty[block] = 0;
+}
+
+void BlockCache::mark_clean() {
+    // Solo pueden estar sucios los residentes: se recorren T1 y T2 en vez
+    // de todo el arreglo, que en un disco grande casi no tiene paginas
+    for (size_t s = 0; s < shard_count; s++) {
+        std::lock_guard<std::mutex> lock(shards[s].mutex);
+        for (ListId id : {T1, T2}) {
+            for (uint32_t block = shards[s].lists[id].head; block != NIL; block = next[block]) {
+                dirty[block] = 0;
+            }
+        }
+    }
+}
+
+bool BlockCache::resize(size_t block_count) {
+    if (block_count > where.capacity()) {
+        return false;
+    }
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(shard_count);
+    for (size_t s = 0; s < shard_count; s++) {
+        locks.emplace_back(shards[s].mutex);
+    }
+    for (size_t block = block_count; block < where.size(); block++) {
+        if (where[block] != NONE) {
+            unlink(shard_of(block), static_cast<uint32_t>(block));
+        }
+    }
+    // Al crecer, los bloques nuevos quedan en NONE y limpios porque valen cero
+    return where.resize(block_count) && dirty.resize(block_count) &&
+           prev.resize(block_count) && next.resize(block_count);
+}
+
+bool BlockCache::reserve_more(size_t max_block_count) {
+    if (max_block_count >= NIL) {
+        return false;
+    }
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(shard_count);
+    for (size_t s = 0; s < shard_count; s++) {
+        locks.emplace_back(shards[s].mutex);
+    }
+    return where.reserve_more(max_block_count) && dirty.reserve_more(max_block_count) &&
+           prev.reserve_more(max_block_count) && next.reserve_more(max_block_count);
+}
+
+BlockCacheStats BlockCache::stats() const {
+    BlockCacheStats total{0, 0, 0, 0, 0, capacity_blocks};
+    for (size_t s = 0; s < shard_count; s++) {
+        Shard& shard = shards[s];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        total.hits += shard.hits;
+        total.misses += shard.misses;
+        total.evictions += shard.evictions;
+        total.writebacks += shard.writebacks;
+        total.resident_blocks += shard.lists[T1].size + shard.lists[T2].size;
+    }
+    return total;
+}
+
+// Algoritmo ARC (Megiddo y Modha, 2003). T1 guarda los bloques vistos una
+// vez y T2 los vistos mas de una; B1 y B2 recuerdan los expulsados de cada
+// una para ajustar target_t1 segun cual de las dos habria acertado. Un
+// recorrido secuencial solo pasa por T1 y no desplaza a los bloques de T2.
+bool BlockCache::admit(Shard& shard, size_t block, bool is_dirty, bool count) {
+    uint32_t b = static_cast<uint32_t>(block);
+    uint8_t state = where[block];
+    if (state == T1 || state == T2) {
+        if (count) {
+            unlink(shard, b);
+            push_mru(shard, T2, b);
+            shard.hits++;
+        }
+        if (is_dirty) {
+            dirty[block] = 1;
+        }
+        return true;
+    }
+
+    List* lists = shard.lists;
+    size_t c = shard.capacity;
+    if (state == B1) {
+        size_t delta = std::max<size_t>(1, lists[B2].size / lists[B1].size);
+        shard.target_t1 = std::min(c, shard.target_t1 + delta);
+        replace(shard, false);
+        unlink(shard, b);
+        push_mru(shard, T2, b);
+    } else if (state == B2) {
+        size_t delta = std::max<size_t>(1, lists[B1].size / lists[B2].size);
+        shard.target_t1 = shard.target_t1 > delta ? shard.target_t1 - delta : 0;
+        replace(shard, true);
+        unlink(shard, b);
+        push_mru(shard, T2, b);
+    } else {
+        size_t l1 = lists[T1].size + lists[B1].size;
+        size_t total = l1 + lists[T2].size + lists[B2].size;
+        if (l1 >= c) {
+            if (lists[T1].size < c) {
+                unlink(shard, lists[B1].tail);
+                replace(shard, false);
+            } else {
+                evict_lru(shard, T1, NONE);
+            }
+        } else if (total >= c) {
+            if (total >= 2 * c) {
+                unlink(shard, lists[B2].tail);
+            }
+            replace(shard, false);
+        }
+        push_mru(shard, T1, b);
+    }
+
+    if (count) {
+        shard.misses++;
+    }
+    dirty[block] = is_dirty ? 1 : 0;
+    return false;
+}
+
+void BlockCache::replace(Shard& shard, bool in_b2) {
+    List* lists = shard.lists;
+    // Tras forget() puede haber sitio libre aunque las listas fantasma esten llenas
+    if (lists[T1].size + lists[T2].size < shard.capacity) {
+        return;
+    }
+    size_t t1 = lists[T1].size;
+    if (t1 > 0 && ((in_b2 && t1 == shard.target_t1) || t1 > shard.target_t1 || lists[T2].size == 0)) {
+        evict_lru(shard, T1, B1);
+    } else {
+        evict_lru(shard, T2, B2);
+    }
+}
+
+void BlockCache::evict_lru(Shard& shard, ListId from, ListId to) {
+    uint32_t victim = shard.lists[from].tail;
+    unlink(shard, victim);
+    bool was_dirty = dirty[victim] != 0;
+    evict(victim, was_dirty);
+    dirty[victim] = 0;
+    shard.evictions++;
+    if (was_dirty) {
+        shard.writebacks++;
+    }
+    if (to != NONE) {
+        push_mru(shard, to, victim);
+    }
+}
+
+void BlockCache::unlink(Shard& shard, uint32_t block) {
+    List& list = shard.lists[where[block]];
+    if (prev[block] != NIL) {
+        next[prev[block]] = next[block];
+    } else {
+        list.head = next[block];
+    }
+    if (next[block] != NIL) {
+        prev[next[block]] = prev[block];
+    } else {
+        list.tail = prev[block];
+    }
+    prev[block] = NIL;
+    next[block] = NIL;
+    list.size--;
+    where[block] = NONE;
+}
+
+void BlockCache::push_mru(Shard& shard, ListId id, uint32_t block) {
+    List& list = shard.lists[id];
+    prev[block] = NIL;
+    next[block] = list.head;
+    if (list.head != NIL) {
+        prev[list.head] = block;
+    } else {
+        list.tail = block;
+    }
+    list.head = block;
+    list.size++;
+    where[block] = id;
+}
+
+} // namespace cowfs
@@ -0,0 +1,110 @@
+#ifndef COWFS_CACHE_HPP
+#define COWFS_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "cowfs_region.hpp"
+
+namespace cowfs {
+
+// Estadisticas de BlockCache, sumadas sobre todos los shards
+struct BlockCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;      // Expulsiones que tuvieron que escribir el bloque
+    size_t resident_blocks;
+    size_t capacity_blocks;
+};
+
+/**
+ * @brief Politica de residencia ARC para bloques identificados por su indice
+ * fisico
+ *
+ * No guarda datos: decide que bloques pueden estar en memoria y avisa con
+ * `evict` cuando uno debe salir. Como la clave es el bloque fisico, un bloque
+ * compartido por muchas versiones, archivos o snapshots ocupa una sola
+ * entrada.
+ *
+ * Los bloques se reparten entre shards por indice (bloque % shards), cada uno
+ * con su lock y su propio ARC de capacidad / shards. Las listas son
+ * intrusivas sobre arreglos indexados por bloque, asi que registrar un acceso
+ * no asigna memoria.
+ */
+class BlockCache {
+public:
+    // Se llama con el lock del shard tomado; `dirty` indica que el bloque se
+    // modifico desde que entro en la cache
+    using EvictFn = std::function<void(size_t block, bool dirty)>;
+
+    // Los arreglos por bloque se reservan para `max_block_count` y solo
+    // ocupan memoria las paginas de los bloques que han pasado por la cache
+    BlockCache(size_t block_count, size_t max_block_count, size_t capacity_blocks,
+               size_t shard_count, EvictFn evict);
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    // Registra un acceso; devuelve true si el bloque ya estaba residente
+    bool access(size_t block, bool dirty);
+    // Admite un bloque pedido por adelantado sin contarlo como acceso
+    void prefetch(size_t block);
+    // Saca un bloque liberado sin escribirlo
+    void forget(size_t block);
+    // Todos los bloques residentes pasan a limpios (despues de escribirlos)
+    void mark_clean();
+    // Cambia el numero de bloques, hasta max_block_count. Los que se quitan
+    // salen de las listas sin llamar a evict: ya deben estar libres
+    bool resize(size_t block_count);
+    // Amplia max_block_count
+    bool reserve_more(size_t max_block_count);
+
+    BlockCacheStats stats() const;
+    size_t capacity() const { return capacity_blocks; }
+
+private:
+    enum ListId : uint8_t { NONE = 0, T1, T2, B1, B2, LIST_COUNT };
+
+    struct List {
+        uint32_t head;  // MRU
+        uint32_t tail;  // LRU
+        size_t size;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        List lists[LIST_COUNT];
+        size_t capacity;
+        size_t target_t1;  // Parametro p de ARC: tamano objetivo de T1
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t writebacks;
+    };
+
+    Shard& shard_of(size_t block) { return shards[block % shard_count]; }
+    bool admit(Shard& shard, size_t block, bool dirty, bool count);
+    void replace(Shard& shard, bool in_b2);
+    void evict_lru(Shard& shard, ListId from, ListId to);
+    void unlink(Shard& shard, uint32_t block);
+    void push_mru(Shard& shard, ListId list, uint32_t block);
+
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    size_t capacity_blocks;
+    size_t shard_count;
+    std::unique_ptr<Shard[]> shards;
+    ZeroArray<uint8_t> where;   // ListId de cada bloque; 0 = NONE
+    ZeroArray<uint8_t> dirty;
+    // Enlaces de las listas; solo valen mientras el bloque esta en una
+    ZeroArray<uint32_t> prev;
+    ZeroArray<uint32_t> next;
+    EvictFn evict;
+};
+
+} // namespace cowfs
+
+#endif // COWFS_CACHE_HPP
@@ -0,0 +1,120 @@
+#include "cowfs_checksum.hpp"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define COWFS_CRC32C_X86 1
+#endif
+
+namespace cowfs {
+
+namespace {
+
+constexpr uint32_t CRC32C_POLY = 0x82F63B78;  // Polinomio reflejado
+
+// Tablas para procesar 8 bytes por iteracion (slicing-by-8)
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+const Crc32cTables& tables() {
+    static const Crc32cTables instance;
+    return instance;
+}
+
+#ifdef COWFS_CRC32C_X86
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint32_t crc = 0xFFFFFFFF;
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    while (size >= 4) {
+        uint32_t word;
+        std::memcpy(&word, bytes, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        bytes += 4;
+        size -= 4;
+    }
+    while (size > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+        size--;
+    }
+    return ~crc;
+}
+#endif
+
+using Crc32cFunction = uint32_t (*)(const void*, size_t);
+
+// Se elige la implementacion una sola vez, en la primera llamada
+Crc32cFunction select_implementation() {
+#ifdef COWFS_CRC32C_X86
+    if (crc32c_hardware_available()) {
+        return crc32c_sse42;
+    }
+#endif
+    return crc32c_software;
+}
+
+} // namespace
+
+bool crc32c_hardware_available() {
+#ifdef COWFS_CRC32C_X86
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
+}
+
+uint32_t crc32c_software(const void* data, size_t size) {
+    const Crc32cTables& t = tables();
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint32_t crc = 0xFFFFFFFF;
+    while (size >= 8) {
+        // Los 4 primeros bytes se combinan con el CRC (orden little-endian)
+        uint32_t low = crc ^ (static_cast<uint32_t>(bytes[0]) | static_cast<uint32_t>(bytes[1]) << 8 |
+                              static_cast<uint32_t>(bytes[2]) << 16 | static_cast<uint32_t>(bytes[3]) << 24);
+        crc = t.table[7][low & 0xFF] ^ t.table[6][(low >> 8) & 0xFF] ^
+              t.table[5][(low >> 16) & 0xFF] ^ t.table[4][low >> 24] ^
+              t.table[3][bytes[4]] ^ t.table[2][bytes[5]] ^
+              t.table[1][bytes[6]] ^ t.table[0][bytes[7]];
+        bytes += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = (crc >> 8) ^ t.table[0][(crc ^ *bytes++) & 0xFF];
+        size--;
+    }
+    return ~crc;
+}
+
+uint32_t crc32c(const void* data, size_t size) {
+    static const Crc32cFunction implementation = select_implementation();
+    return implementation(data, size);
+}
+
+} // namespace cowfs
@@ -0,0 +1,24 @@
+#ifndef COWFS_CHECKSUM_HPP
+#define COWFS_CHECKSUM_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+namespace cowfs {
+
+/**
+ * @brief CRC32C (Castagnoli) de un buffer
+ *
+ * Usa la instruccion crc32 de SSE4.2 cuando el procesador la soporta y una
+ * version por tablas en caso contrario; ambas dan el mismo resultado.
+ */
+uint32_t crc32c(const void* data, size_t size);
+
+// Version por software, expuesta para poder compararla con la de hardware
+uint32_t crc32c_software(const void* data, size_t size);
+
+bool crc32c_hardware_available();
+
+} // namespace cowfs
+
+#endif // COWFS_CHECKSUM_HPP
@@ -0,0 +1,559 @@
+#include "cowfs.hpp"
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+namespace cowfs {
+
+namespace {
+
+// Disposicion en la arena de los bloques de datos de un mapa. Los huecos no
+// ocupan bloques, asi que no cortan un tramo; las repeticiones de un bloque
+// ya visto en el mismo mapa tampoco: ese bloque solo puede estar en un sitio
+struct MapLayout {
+    size_t data_blocks;
+    size_t extents;     // Tramos de bloques fisicamente contiguos
+    size_t first;       // Primer bloque de datos
+    size_t first_run;   // Bloques contiguos desde `first`
+    size_t repeated;    // Entradas que repiten un bloque anterior del mapa
+};
+
+// `repeats` son las posiciones (relativas a `base`) que se tratan como huecos
+MapLayout map_layout(const size_t* map, size_t count,
+                     const std::vector<size_t>* repeats = nullptr, size_t base = 0) {
+    MapLayout layout{0, 0, HOLE_BLOCK, 0, 0};
+    size_t prev = HOLE_BLOCK;
+    for (size_t i = 0; i < count; i++) {
+        if (map[i] == HOLE_BLOCK) {
+            continue;
+        }
+        if (repeats && std::binary_search(repeats->begin(), repeats->end(), base + i)) {
+            layout.repeated++;
+            continue;
+        }
+        if (layout.data_blocks == 0 || map[i] != prev + 1) {
+            layout.extents++;
+        }
+        if (layout.data_blocks == 0) {
+            layout.first = map[i];
+        }
+        if (layout.extents == 1) {
+            layout.first_run++;
+        }
+        layout.data_blocks++;
+        prev = map[i];
+    }
+    return layout;
+}
+
+// Posiciones de un mapa cuyo bloque ya aparecio antes en el mismo mapa,
+// ordenadas. Un bloque repetido siempre corta un tramo, asi que con un solo
+// tramo no hace falta buscarlas
+void find_repeats(const size_t* map, size_t count, std::vector<size_t>& repeats) {
+    repeats.clear();
+    std::vector<std::pair<size_t, size_t>> sorted;
+    for (size_t i = 0; i < count; i++) {
+        if (map[i] != HOLE_BLOCK) {
+            sorted.emplace_back(map[i], i);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end());
+    for (size_t k = 1; k < sorted.size(); k++) {
+        if (sorted[k].first == sorted[k - 1].first) {
+            repeats.push_back(sorted[k].second);
+        }
+    }
+    std::sort(repeats.begin(), repeats.end());
+}
+
+// Disposicion de un mapa descontando sus bloques repetidos
+MapLayout file_layout(const size_t* map, size_t count, std::vector<size_t>& repeats) {
+    MapLayout layout = map_layout(map, count);
+    repeats.clear();
+    if (layout.extents > 1) {
+        find_repeats(map, count, repeats);
+        if (!repeats.empty()) {
+            layout = map_layout(map, count, &repeats);
+        }
+    }
+    return layout;
+}
+
+} // namespace
+
+FragmentationReport COWFileSystem::fragmentation_report() const {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    FragmentationReport report{0, 0, 0, 0, 0, 0, 0, 0.0, 0.0};
+    for (FreeBlockInfo* current = free_blocks_list; current; current = current->next) {
+        report.free_blocks += current->block_count;
+        report.free_extents++;
+        report.largest_free_extent = std::max(report.largest_free_extent, current->block_count);
+    }
+    size_t files = 0;
+    std::vector<size_t> repeats;
+    for (const auto& inode : inodes) {
+        if (!inode.is_used || inode.version_history.empty()) {
+            continue;
+        }
+        const VersionInfo& head = inode.version_history.back();
+        MapLayout layout = file_layout(inode.block_table.data() + head.map_offset, head.block_count, repeats);
+        report.repeated_blocks += layout.repeated;
+        if (layout.data_blocks == 0) {
+            continue;
+        }
+        files++;
+        report.file_blocks += layout.data_blocks;
+        report.file_extents += layout.extents;
+        if (layout.extents > 1) {
+            report.fragmented_files++;
+        }
+    }
+    if (report.free_blocks > 0) {
+        report.free_fragmentation = 1.0 - static_cast<double>(report.largest_free_extent) / report.free_blocks;
+    }
+    if (report.file_blocks > files) {
+        report.file_fragmentation = static_cast<double>(report.file_extents - files) /
+                                    static_cast<double>(report.file_blocks - files);
+    }
+    return report;
+}
+
+size_t COWFileSystem::defragment(size_t max_blocks) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    // Tandas acotadas para que cada reasignacion recorra las tablas con pocos bloques
+    static constexpr size_t DEFRAG_BATCH = 1024;
+
+    size_t total = 0;
+    size_t moved = 0;
+    while (total < max_blocks && defrag_step(std::min(DEFRAG_BATCH, max_blocks - total), moved)) {
+        total += moved;
+    }
+    std::cout << "defragment: " << total << " bloques movidos" << std::endl;
+    return total;
+}
+
+void COWFileSystem::start_background_defrag(size_t blocks_per_second) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    stop_background_defrag();
+    if (blocks_per_second == 0) {
+        return;
+    }
+    const size_t batch = std::min<size_t>(64, blocks_per_second);
+    defrag_job = background().schedule("defrag", std::chrono::milliseconds(1000),
+                                       TaskBudget{std::chrono::milliseconds(2), batch, blocks_per_second},
+                                       [this, batch](TaskContext& ctx) { return defrag_task(ctx, batch); });
+}
+
+void COWFileSystem::stop_background_defrag() {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    if (defrag_job != 0) {
+        scheduler->cancel(defrag_job);
+        defrag_job = 0;
+    }
+}
+
+TaskStatus COWFileSystem::defrag_task(TaskContext& ctx, size_t batch) {
+    std::unique_lock<PriorityMutex> lock(fs_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return TaskStatus::BLOCKED;
+    }
+    size_t moved = 0;
+    while (defrag_step(batch - std::min(batch - 1, ctx.charged()), moved)) {
+        ctx.charge(moved);
+        if (ctx.should_yield()) {
+            return TaskStatus::MORE;
+        }
+    }
+    return TaskStatus::IDLE;
+}
+
+bool COWFileSystem::pick_defrag_target() {
+    // Primero los archivos abiertos, que son los que se estan leyendo; entre
+    // ellos y luego entre el resto, el que tenga mas tramos
+    std::vector<uint8_t> open(inodes.size(), 0);
+    for (const auto& fd_entry : file_descriptors) {
+        if (fd_entry.is_valid && fd_entry.inode) {
+            open[fd_entry.inode - inodes.data()] = 1;
+        }
+    }
+    Inode* target = nullptr;
+    size_t best_extents = 1;
+    bool best_open = false;
+    // Sin archivos fragmentados, se baja el archivo contiguo mas alto que
+    // quepa en un hueco anterior, para que el espacio libre quede junto
+    Inode* lowered = nullptr;
+    size_t lowered_start = 0;
+    size_t lowered_dest = 0;
+    for (size_t i = 0; i < inodes.size(); i++) {
+        Inode& inode = inodes[i];
+        if (!inode.is_used || defrag_done[i] || inode.version_history.empty()) {
+            continue;
+        }
+        const VersionInfo& head = inode.version_history.back();
+        MapLayout layout = file_layout(inode.block_table.data() + head.map_offset, head.block_count,
+                                       defrag_repeats);
+        if (layout.extents > 1) {
+            bool is_open = open[i] != 0;
+            if ((is_open && !best_open) || (is_open == best_open && layout.extents > best_extents)) {
+                target = &inode;
+                best_extents = layout.extents;
+                best_open = is_open;
+            }
+        } else if (layout.extents == 1 && !target && layout.first > lowered_start) {
+            for (FreeBlockInfo* hole = free_blocks_list; hole && hole->start_block < layout.first; hole = hole->next) {
+                if (hole->block_count >= layout.data_blocks) {
+                    lowered = &inode;
+                    lowered_start = layout.first;
+                    lowered_dest = hole->start_block;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Solo se mueve la primera aparicion de cada bloque; las demas la siguen
+    // porque relocate_blocks actualiza todas las referencias
+    defrag_pos = 0;
+    if (!target) {
+        defrag_inode = lowered;
+        if (lowered) {
+            const VersionInfo& head = lowered->version_history.back();
+            file_layout(lowered->block_table.data() + head.map_offset, head.block_count, defrag_repeats);
+            defrag_version = head.version_number;
+            defrag_dest = lowered_dest;
+        }
+        return lowered != nullptr;
+    }
+
+    defrag_inode = target;
+    const VersionInfo& head = target->version_history.back();
+    MapLayout layout = file_layout(target->block_table.data() + head.map_offset, head.block_count,
+                                   defrag_repeats);
+    defrag_version = head.version_number;
+    // Si detras del primer tramo hay sitio para el resto, el archivo crece
+    // en su lugar y el primer tramo no se mueve
+    if (range_is_free(layout.first + layout.first_run, layout.data_blocks - layout.first_run)) {
+        defrag_dest = layout.first;
+        return true;
+    }
+    FreeBlockInfo* fit = find_best_fit(layout.data_blocks);
+    defrag_dest = fit ? fit->start_block : blocks.size();
+    return true;
+}
+
+bool COWFileSystem::defrag_step(size_t budget, size_t& moved) {
+    moved = 0;
+    while (true) {
+        if (!defrag_inode || !defrag_inode->is_used || defrag_inode->version_history.empty() ||
+            defrag_inode->version_history.back().version_number != defrag_version) {
+            if (!pick_defrag_target()) {
+                // Fin de la pasada: la siguiente vuelve a considerar todos los
+                // archivos y reconstruye el indice inverso
+                std::fill(defrag_done.begin(), defrag_done.end(), 0);
+                drop_block_slots();
+                return false;
+            }
+        }
+        Inode& inode = *defrag_inode;
+        const VersionInfo& head = inode.version_history.back();
+        size_t count = head.block_count;
+        const size_t* map = inode.block_table.data() + head.map_offset;
+
+        // Saltar lo que ya esta en su sitio; los huecos y las repeticiones no se mueven
+        auto skipped = [&](size_t pos) {
+            return map[pos] == HOLE_BLOCK ||
+                   std::binary_search(defrag_repeats.begin(), defrag_repeats.end(), pos);
+        };
+        while (defrag_pos < count && (skipped(defrag_pos) || map[defrag_pos] == defrag_dest)) {
+            if (!skipped(defrag_pos)) {
+                defrag_dest++;
+            }
+            defrag_pos++;
+        }
+        if (defrag_pos == count) {
+            defrag_done[defrag_inode - inodes.data()] = 1;
+            defrag_inode = nullptr;
+            continue;
+        }
+
+        size_t remaining = map_layout(map + defrag_pos, count - defrag_pos, &defrag_repeats, defrag_pos).data_blocks;
+        size_t chunk = std::min(budget, remaining);
+        if (!range_is_free(defrag_dest, chunk)) {
+            // El destino se ocupo desde la ultima tanda (o no habia ninguno):
+            // buscar un tramo para lo que falta o juntar el espacio libre
+            FreeBlockInfo* fit = find_best_fit(remaining);
+            if (fit) {
+                defrag_dest = fit->start_block;
+                continue;
+            }
+            moved = compact_free_space(budget);
+            if (moved == 0) {
+                defrag_done[defrag_inode - inodes.data()] = 1;
+                defrag_inode = nullptr;
+                continue;
+            }
+            return true;
+        }
+
+        defrag_moves.clear();
+        size_t pos = defrag_pos;
+        while (defrag_moves.size() < chunk) {
+            if (!skipped(pos)) {
+                defrag_moves.emplace_back(map[pos], defrag_dest + defrag_moves.size());
+            }
+            pos++;
+        }
+        moved = relocate_blocks(defrag_moves);
+        if (moved < chunk) {
+            // Algun bloque esta retenido por una vista: el archivo queda como esta
+            defrag_done[defrag_inode - inodes.data()] = 1;
+            defrag_inode = nullptr;
+        } else {
+            defrag_pos = pos;
+            defrag_dest += chunk;
+        }
+        return true;
+    }
+}
+
+size_t COWFileSystem::compact_free_space(size_t budget) {
+    // Los bloques en uso mas altos bajan a los huecos mas bajos, de forma que
+    // el espacio libre se junta al final de la arena
+    defrag_moves.clear();
+    FreeBlockInfo* hole = free_blocks_list;
+    size_t hole_pos = hole ? hole->start_block : 0;
+    size_t top = blocks.size();
+    while (hole && defrag_moves.size() < budget) {
+        if (hole_pos == hole->start_block + hole->block_count) {
+            hole = hole->next;
+            hole_pos = hole ? hole->start_block : 0;
+            continue;
+        }
+        while (top > 0 && !(blocks.is_used(top - 1) && blocks.ref_count[top - 1] > 0)) {
+            top--;
+        }
+        if (top == 0 || top - 1 <= hole_pos) {
+            break;
+        }
+        top--;
+        defrag_moves.emplace_back(top, hole_pos++);
+    }
+    return relocate_blocks(defrag_moves);
+}
+
+void COWFileSystem::build_block_slots() {
+    block_slots.clear();
+    block_slot_alias.clear();
+    auto add = [&](const std::vector<size_t>& map, size_t owner) {
+        for (size_t pos = 0; pos < map.size(); pos++) {
+            if (map[pos] != HOLE_BLOCK) {
+                block_slots.push_back(BlockSlot{map[pos], static_cast<uint32_t>(owner), pos});
+            }
+        }
+    };
+    for (size_t i = 0; i < inodes.size(); i++) {
+        if (inodes[i].is_used) {
+            add(inodes[i].block_table, i);
+        }
+    }
+    for (size_t i = 0; i < file_descriptors.size(); i++) {
+        if (file_descriptors[i].is_valid) {
+            add(file_descriptors[i].pinned_blocks, MAX_FILES + i);
+        }
+    }
+    for (size_t i = 0; i < snapshots.size(); i++) {
+        add(snapshots[i].block_table, 2 * MAX_FILES + i);
+    }
+    std::sort(block_slots.begin(), block_slots.end(),
+              [](const BlockSlot& a, const BlockSlot& b) { return a.block < b.block; });
+    block_slots_valid = true;
+    block_slots_generation = change_generation;
+    block_slots_pinned = pinned_changes;
+}
+
+void COWFileSystem::drop_block_slots() {
+    std::vector<BlockSlot>().swap(block_slots);
+    block_slot_alias.clear();
+    block_slots_valid = false;
+}
+
+size_t* COWFileSystem::block_slot(const BlockSlot& slot) {
+    std::vector<size_t>* map = nullptr;
+    if (slot.owner < MAX_FILES) {
+        map = inodes[slot.owner].is_used ? &inodes[slot.owner].block_table : nullptr;
+    } else if (slot.owner < 2 * MAX_FILES) {
+        FileDescriptor& fd_entry = file_descriptors[slot.owner - MAX_FILES];
+        map = fd_entry.is_valid ? &fd_entry.pinned_blocks : nullptr;
+    } else if (slot.owner - 2 * MAX_FILES < snapshots.size()) {
+        map = &snapshots[slot.owner - 2 * MAX_FILES].block_table;
+    }
+    return map && slot.pos < map->size() ? map->data() + slot.pos : nullptr;
+}
+
+void COWFileSystem::ensure_block_slots() {
+    // El indice inverso sirve mientras los mapas solo cambien al reubicar
+    // bloques; si algo mas los toco desde que se construyo, se rehace
+    if (!block_slots_valid || block_slots_generation != change_generation ||
+        block_slots_pinned != pinned_changes) {
+        build_block_slots();
+    }
+}
+
+void COWFileSystem::for_each_block_slot(size_t block_index,
+                                        const std::function<void(size_t*, const BlockSlot&)>& fn) {
+    // Las entradas se comprueban al usarlas: una que ya no apunta al bloque no cuenta
+    auto alias = block_slot_alias.find(block_index);
+    size_t key = alias != block_slot_alias.end() ? alias->second : block_index;
+    auto it = std::lower_bound(block_slots.begin(), block_slots.end(), key,
+        [](const BlockSlot& slot, size_t block) { return slot.block < block; });
+    for (; it != block_slots.end() && it->block == key; ++it) {
+        size_t* entry = block_slot(*it);
+        if (entry && *entry == block_index) {
+            fn(entry, *it);
+        }
+    }
+}
+
+bool COWFileSystem::block_held_by_view(size_t block_index) {
+    // Solo se puede mover un bloque si todas sus referencias estan en los
+    // mapas de versiones, snapshots o descriptores. Las que faltan son de
+    // vistas de lectura, que guardan punteros a los datos
+    uint32_t seen = 0;
+    for_each_block_slot(block_index, [&seen](size_t*, const BlockSlot&) { seen++; });
+    return seen != blocks.ref_count[block_index];
+}
+
+size_t COWFileSystem::relocate_blocks(std::vector<std::pair<size_t, size_t>>& moves) {
+    if (moves.empty()) {
+        return 0;
+    }
+    std::sort(moves.begin(), moves.end());
+    auto find_move = [&](size_t block_index) -> std::pair<size_t, size_t>* {
+        if (block_index < moves.front().first || block_index > moves.back().first) {
+            return nullptr;
+        }
+        auto it = std::lower_bound(moves.begin(), moves.end(), std::make_pair(block_index, size_t(0)));
+        return it != moves.end() && it->first == block_index ? &*it : nullptr;
+    };
+
+    ensure_block_slots();
+    size_t kept = 0;
+    for (size_t k = 0; k < moves.size(); k++) {
+        size_t source = moves[k].first;
+        bool duplicate = k > 0 && source == moves[k - 1].first;
+        if (duplicate || !blocks.is_used(source) || blocks.has_flag(source, BLOCK_CORRUPT) ||
+            moves[k].second >= blocks.size() || block_held_by_view(source)) {
+            continue;
+        }
+        moves[kept++] = moves[k];
+    }
+    moves.resize(kept);
+    if (moves.empty()) {
+        return 0;
+    }
+
+    // Reservar los destinos por tramos contiguos
+    std::vector<size_t> targets;
+    targets.reserve(moves.size());
+    for (const auto& move : moves) {
+        targets.push_back(move.second);
+    }
+    std::sort(targets.begin(), targets.end());
+    for (size_t k = 0; k < targets.size();) {
+        size_t run = 1;
+        while (k + run < targets.size() && targets[k + run] == targets[k] + run) {
+            run++;
+        }
+        if (!claim_free_range(targets[k], run)) {
+            std::cerr << "relocate_blocks: Destino " << targets[k] << " no esta libre" << std::endl;
+            // Devolver lo ya reservado; ningun bloque se ha movido todavia
+            for (size_t j = 0; j < k; j++) {
+                blocks.flags[targets[j]] = 0;
+                used_block_count--;
+                add_to_free_list(targets[j], 1);
+            }
+            return 0;
+        }
+        k += run;
+    }
+
+    for (const auto& move : moves) {
+        size_t source = move.first;
+        size_t dest = move.second;
+        blocks.touch(source);
+        blocks.touch(dest, true);
+        std::memcpy(blocks.data(dest), blocks.data(source), BLOCK_SIZE);
+        blocks.checksum[dest] = blocks.checksum[source];
+        blocks.flags[dest] = blocks.flags[source];
+        blocks.ref_count[dest] = blocks.ref_count[source];
+        blocks.head_owner[dest] = blocks.head_owner[source];
+        blocks.head_owner[source] = 0;
+        auto owners = head_owner_sets.find(source);
+        if (owners != head_owner_sets.end()) {
+            std::vector<uint32_t> set;
+            set.swap(owners->second);
+            head_owner_sets.erase(owners);
+            head_owner_sets[dest].swap(set);
+        }
+    }
+
+    // Reasignar solo las entradas del indice y anotar que mapas cambiaron
+    std::vector<uint8_t> inode_changed(inodes.size(), 0);
+    bool snapshots_changed = false;
+    for (const auto& move : moves) {
+        size_t dest = move.second;
+        for_each_block_slot(move.first, [&](size_t* entry, const BlockSlot& slot) {
+            *entry = dest;
+            if (slot.owner < MAX_FILES) {
+                inode_changed[slot.owner] = 1;
+            } else if (slot.owner >= 2 * MAX_FILES) {
+                snapshots_changed = true;
+            }
+        });
+    }
+    auto remap = [&](size_t* map, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            if (auto* move = find_move(map[i])) {
+                map[i] = move->second;
+            }
+        }
+    };
+    for (size_t i = 0; i < inodes.size(); i++) {
+        Inode& inode = inodes[i];
+        if (!inode_changed[i] || !inode.is_used) {
+            continue;
+        }
+        for (auto& version : inode.version_history) {
+            remap(&version.block_index, 1);
+        }
+        remap(&inode.first_block, 1);
+        // El historial cambia aunque no se agreguen versiones
+        mark_modified(inode, next_generation(), true);
+    }
+    if (snapshots_changed) {
+        snapshots_generation = next_generation();
+    }
+
+    // El indice sigue valido: los bloques movidos figuran con su bloque de
+    // origen a traves de los alias
+    for (const auto& move : moves) {
+        auto alias = block_slot_alias.find(move.first);
+        size_t key = alias != block_slot_alias.end() ? alias->second : move.first;
+        if (alias != block_slot_alias.end()) {
+            block_slot_alias.erase(alias);
+        }
+        block_slot_alias[move.second] = key;
+    }
+    block_slots_generation = change_generation;
+
+    // Las referencias ya apuntan al destino; el origen se libera sin tocar
+    // los contadores de compartidos
+    for (const auto& move : moves) {
+        blocks.ref_count[move.first] = 0;
+        free_block(move.first);
+    }
+    return moves.size();
+}
+
+} // namespace cowfs
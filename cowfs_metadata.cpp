@@ -1,68 +1,868 @@
 #include "cowfs_metadata.hpp"
 #include <iostream>
-#include <fstream>
-#include <sstream>
-#include <iomanip>
+#include <charconv>
+#include <algorithm>
+#include <unordered_map>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace cowfs {
 
-std::string MetadataManager::generate_metadata_json(COWFileSystem& fs) {
-    std::stringstream json_output;
-    json_output << "{\n";
-    json_output << "  \"filesystem\": {\n";
-    json_output << "    \"total_memory_usage\": " << fs.get_total_memory_usage() << ",\n";
-    
-    std::vector<std::string> files;
-    fs.list_files(files);
-    
-    json_output << "    \"files\": [\n";
-    for (size_t i = 0; i < files.size(); ++i) {
-        const auto& filename = files[i];
-        fd_t fd = fs.open(filename, FileMode::READ);
-        if (fd >= 0) {
-            auto status = fs.get_file_status(fd);
-            json_output << "      {\n";
-            json_output << "        \"name\": \"" << filename << "\",\n";
-            json_output << "        \"size\": " << status.current_size << ",\n";
-            json_output << "        \"version_count\": " << status.current_version << ",\n";
-            json_output << "        \"is_open\": " << (status.is_open ? "true" : "false") << ",\n";
-            
-            json_output << "        \"version_history\": [\n";
-            auto version_history = fs.get_version_history(fd);
-            for (size_t j = 0; j < version_history.size(); ++j) {
-                const auto& version = version_history[j];
-                json_output << "          {\n";
-                json_output << "            \"version_number\": " << version.version_number << ",\n";
-                json_output << "            \"block_index\": " << version.block_index << ",\n";
-                json_output << "            \"size\": " << version.size << ",\n";
-                json_output << "            \"timestamp\": \"" << version.timestamp << "\"\n";
-                json_output << "          }" << (j < version_history.size() - 1 ? "," : "") << "\n";
+namespace {
+
+constexpr size_t CHUNK_SIZE = 64 * 1024;
+// Bytes codificados por cada toma del lock al exportar los archivos
+constexpr size_t EXPORT_BATCH_BYTES = 1024 * 1024;
+
+// Acumula la salida en un buffer fijo y la entrega al sink por bloques, de
+// modo que la memoria usada no depende del tamano del documento
+class ChunkedWriter {
+public:
+    explicit ChunkedWriter(const std::function<bool(const char*, size_t)>& sink)
+        : sink(sink), buffer(CHUNK_SIZE), used(0), failed(false), held(false) {}
+
+    void put(const char* data, size_t size) {
+        while (size > 0) {
+            if (used == buffer.size()) {
+                if (held) {
+                    buffer.resize(buffer.size() * 2);
+                } else if (!flush()) {
+                    return;
+                }
+            }
+            size_t chunk = std::min(size, buffer.size() - used);
+            std::memcpy(buffer.data() + used, data, chunk);
+            used += chunk;
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
+    void put(const char* text) { put(text, std::strlen(text)); }
+
+    // Entero sin signo en base 128 (7 bits por byte, bit alto = continua)
+    void put_varint(uint64_t value) {
+        char bytes[10];
+        size_t n = 0;
+        while (value >= 0x80) {
+            bytes[n++] = static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        bytes[n++] = static_cast<char>(value);
+        put(bytes, n);
+    }
+
+    // Entero con signo en zigzag, para deltas que pueden ser negativos
+    void put_zigzag(int64_t value) {
+        put_varint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+    }
+
+    void put_bytes(const char* data, size_t size) {
+        put_varint(size);
+        put(data, size);
+    }
+
+    void put_number(uint64_t value) {
+        char text[24];
+        auto result = std::to_chars(text, text + sizeof(text), value);
+        put(text, result.ptr - text);
+    }
+
+    void put_number(int64_t value) {
+        char text[24];
+        auto result = std::to_chars(text, text + sizeof(text), value);
+        put(text, result.ptr - text);
+    }
+
+    // Escribe una cadena JSON escapando comillas, barras y caracteres de control
+    void put_string(const char* text) {
+        static const char hex[] = "0123456789abcdef";
+        put("\"", 1);
+        const char* run = text;
+        for (const char* p = text; *p; ++p) {
+            unsigned char c = static_cast<unsigned char>(*p);
+            if (c != '"' && c != '\\' && c >= 0x20) {
+                continue;
+            }
+            put(run, p - run);
+            switch (c) {
+                case '"':  put("\\\"", 2); break;
+                case '\\': put("\\\\", 2); break;
+                case '\n': put("\\n", 2); break;
+                case '\r': put("\\r", 2); break;
+                case '\t': put("\\t", 2); break;
+                default: {
+                    char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                    put(escaped, sizeof(escaped));
+                }
+            }
+            run = p + 1;
+        }
+        put(run, std::strlen(run));
+        put("\"", 1);
+    }
+
+    bool flush() {
+        if (!failed && used > 0 && !sink(buffer.data(), used)) {
+            failed = true;
+        }
+        used = 0;
+        return !failed;
+    }
+
+    // Mientras se retiene, el buffer crece en vez de llamar al sink; sirve
+    // para no escribir con el lock del sistema de archivos tomado
+    void hold(bool on) { held = on; }
+    size_t pending() const { return used; }
+
+private:
+    const std::function<bool(const char*, size_t)>& sink;
+    std::vector<char> buffer;
+    size_t used;
+    bool failed;
+    bool held;
+};
+
+// Lector con comprobacion de limites para el formato binario
+class BinaryReader {
+public:
+    BinaryReader(const uint8_t* data, size_t size) : pos(data), end(data + size), failed(false) {}
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (pos == end) {
+                failed = true;
+                return 0;
+            }
+            uint8_t byte = *pos++;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        failed = true;
+        return 0;
+    }
+
+    int64_t zigzag() {
+        uint64_t value = varint();
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    uint8_t byte() {
+        if (pos == end) {
+            failed = true;
+            return 0;
+        }
+        return *pos++;
+    }
+
+    std::string bytes() {
+        uint64_t size = varint();
+        if (failed || size > static_cast<uint64_t>(end - pos)) {
+            failed = true;
+            return std::string();
+        }
+        std::string text(reinterpret_cast<const char*>(pos), size);
+        pos += size;
+        return text;
+    }
+
+    // Evita reservar memoria para conteos imposibles en datos corruptos
+    bool plausible(uint64_t count) {
+        if (count > static_cast<uint64_t>(end - pos)) {
+            failed = true;
+        }
+        return !failed;
+    }
+
+    bool ok() const { return !failed; }
+    bool at_end() const { return pos == end; }
+
+private:
+    const uint8_t* pos;
+    const uint8_t* end;
+    bool failed;
+};
+
+const char BINARY_MAGIC[4] = {'C', 'O', 'W', 'M'};
+// La version 3 admite huecos en los mapas de bloques
+constexpr uint8_t BINARY_FORMAT_VERSION = 3;
+
+// Mapa de bloques con cada indice codificado como delta del anterior; los
+// bloques consecutivos ocupan un byte. Un hueco (HOLE_BLOCK) se guarda como -1
+void put_block_map(ChunkedWriter& out, const size_t* map, size_t count, int64_t& prev_block) {
+    out.put_varint(count);
+    for (size_t i = 0; i < count; i++) {
+        int64_t value = map[i] == HOLE_BLOCK ? -1 : static_cast<int64_t>(map[i]);
+        out.put_zigzag(value - prev_block);
+        prev_block = value;
+    }
+}
+
+bool read_block_map(BinaryReader& in, std::vector<size_t>& table, size_t& count, int64_t& prev_block) {
+    count = in.varint();
+    if (!in.plausible(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        prev_block += in.zigzag();
+        if (prev_block < -1) {
+            return false;
+        }
+        table.push_back(prev_block < 0 ? HOLE_BLOCK : static_cast<size_t>(prev_block));
+    }
+    return in.ok();
+}
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool save_to_file(const COWFileSystem& fs, const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = MetadataManager::write_metadata_json(fs, fd) && write_all(fd, "\n", 1);
+    return (::close(fd) == 0) && ok;
+}
+
+// Marcadores de la lista de archivos. Un documento completo solo usa
+// FILE_FULL; los incrementos usan FILE_APPEND para archivos que solo
+// recibieron versiones nuevas
+constexpr uint64_t LIST_END = 0;
+constexpr uint64_t FILE_FULL = 1;
+constexpr uint64_t FILE_APPEND = 2;
+
+const char INCREMENT_MAGIC[4] = {'C', 'O', 'W', 'I'};
+// La version 2 admite huecos en los mapas de bloques
+constexpr uint8_t INCREMENT_FORMAT_VERSION = 2;
+
+// Archivo con las versiones [versions, versions + version_total). Los numeros
+// de version, timestamps y bloques se codifican como delta dentro del archivo
+void put_file(ChunkedWriter& out, const char* name, size_t size, size_t version_count,
+              bool has_retention, const RetentionPolicy& retention,
+              const VersionInfo* versions, size_t version_total, const size_t* block_table) {
+    out.put_bytes(name, std::strlen(name));
+    out.put_varint(size);
+    out.put_varint(version_count);
+    out.put_varint(has_retention ? 1 : 0);
+    if (has_retention) {
+        out.put_varint(retention.keep_last);
+        out.put_varint(retention.max_age_seconds);
+        out.put_varint(retention.keep_hourly);
+        out.put_varint(retention.keep_daily);
+        out.put_varint(retention.keep_weekly);
+    }
+
+    out.put_varint(version_total);
+    uint64_t prev_number = 0;
+    int64_t prev_timestamp = 0;
+    int64_t prev_block = 0;
+    for (size_t i = 0; i < version_total; i++) {
+        const VersionInfo& version = versions[i];
+        out.put_varint(version.version_number - prev_number);
+        out.put_zigzag(version.timestamp - prev_timestamp);
+        out.put_varint(version.size);
+        out.put_varint(version.delta_start);
+        out.put_varint(version.delta_size);
+        out.put_varint(version.prev_version);
+        put_block_map(out, block_table + version.map_offset, version.block_count, prev_block);
+        prev_number = version.version_number;
+        prev_timestamp = version.timestamp;
+    }
+}
+
+bool read_file(BinaryReader& in, FileMetadata& file, uint64_t generation) {
+    file.name = in.bytes();
+    file.size = in.varint();
+    file.version_count = in.varint();
+    file.has_retention = in.varint() != 0;
+    file.retention = RetentionPolicy{0, 0, 0, 0, 0};
+    if (file.has_retention) {
+        file.retention.keep_last = in.varint();
+        file.retention.max_age_seconds = in.varint();
+        file.retention.keep_hourly = in.varint();
+        file.retention.keep_daily = in.varint();
+        file.retention.keep_weekly = in.varint();
+    }
+
+    uint64_t version_total = in.varint();
+    if (!in.plausible(version_total) || file.name.empty() || file.name.size() >= MAX_FILENAME_LENGTH) {
+        return false;
+    }
+    file.versions.reserve(version_total);
+    uint64_t number = 0;
+    int64_t timestamp = 0;
+    int64_t prev_block = 0;
+    for (uint64_t i = 0; i < version_total; i++) {
+        VersionInfo version;
+        number += in.varint();
+        timestamp += in.zigzag();
+        version.version_number = number;
+        version.timestamp = timestamp;
+        version.size = in.varint();
+        version.delta_start = in.varint();
+        version.delta_size = in.varint();
+        version.prev_version = in.varint();
+        version.generation = generation;
+        version.map_offset = file.block_table.size();
+        if (!read_block_map(in, file.block_table, version.block_count, prev_block)) {
+            return false;
+        }
+        version.block_index = version.block_count > 0 ? file.block_table[version.map_offset] : 0;
+        if (number > file.version_count) {
+            return false;
+        }
+        file.versions.push_back(version);
+    }
+    return in.ok();
+}
+
+void put_snapshot(ChunkedWriter& out, const Snapshot& snap) {
+    out.put_bytes(snap.name.data(), snap.name.size());
+    out.put_zigzag(snap.timestamp);
+    out.put_varint(snap.entries.size());
+    int64_t prev_block = 0;
+    for (const SnapshotEntry& entry : snap.entries) {
+        out.put_bytes(entry.filename, std::strlen(entry.filename));
+        out.put_varint(entry.version_number);
+        out.put_varint(entry.size);
+        put_block_map(out, snap.block_table.data() + entry.map_offset, entry.block_count, prev_block);
+    }
+}
+
+bool read_snapshot(BinaryReader& in, Snapshot& snap) {
+    snap.name = in.bytes();
+    snap.timestamp = in.zigzag();
+    uint64_t entry_total = in.varint();
+    if (!in.plausible(entry_total)) {
+        return false;
+    }
+    int64_t prev_block = 0;
+    for (uint64_t i = 0; i < entry_total; i++) {
+        SnapshotEntry entry;
+        std::string name = in.bytes();
+        if (name.size() >= MAX_FILENAME_LENGTH) {
+            return false;
+        }
+        std::memset(entry.filename, 0, MAX_FILENAME_LENGTH);
+        std::memcpy(entry.filename, name.data(), name.size());
+        entry.version_number = in.varint();
+        entry.size = in.varint();
+        entry.map_offset = snap.block_table.size();
+        if (!read_block_map(in, snap.block_table, entry.block_count, prev_block)) {
+            return false;
+        }
+        snap.entries.push_back(entry);
+    }
+    return in.ok();
+}
+
+bool read_whole_file(const std::string& path, std::vector<uint8_t>& data) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    off_t file_size = ::lseek(fd, 0, SEEK_END);
+    bool ok = file_size >= 0 && ::lseek(fd, 0, SEEK_SET) == 0;
+    if (ok) {
+        data.resize(static_cast<size_t>(file_size));
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::read(fd, data.data() + done, data.size() - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            done += n;
+        }
+    }
+    ::close(fd);
+    return ok;
+}
+
+// Se escribe en un temporal y se renombra: un fallo a mitad deja intacto el
+// archivo anterior, que puede ser la base de incrementos posteriores
+bool save_binary(const std::string& filename, const std::function<bool(const MetadataManager::ChunkSink&)>& encode) {
+    std::string temp = filename + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = encode([fd](const char* data, size_t size) {
+        return write_all(fd, data, size);
+    });
+    ok = ok && ::fsync(fd) == 0;
+    ok = (::close(fd) == 0) && ok;
+    if (!ok || ::rename(temp.c_str(), filename.c_str()) != 0) {
+        ::unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+using FileWalk = std::function<size_t(size_t, const std::function<bool(const FileInfo&)>&)>;
+
+// Recorre los archivos con `walk` en tandas de unos EXPORT_BATCH_BYTES
+// codificados. El lock del sistema de archivos solo se retiene mientras se
+// codifica una tanda en memoria; el sink (disco, red) se llama con el lock
+// suelto, asi que un destino lento no frena a los clientes. Cada archivo se
+// codifica entero en una misma toma y es coherente; entre tandas pueden
+// cambiar otros archivos, lo mismo que si cambiaran justo despues de leer la
+// generacion
+bool encode_batches(ChunkedWriter& out, const FileWalk& walk,
+                    const std::function<void(const FileInfo&)>& encode) {
+    for (size_t next = 0; next < MAX_FILES; ) {
+        out.hold(true);
+        next = walk(next, [&](const FileInfo& file) {
+            encode(file);
+            return out.pending() < EXPORT_BATCH_BYTES;
+        });
+        out.hold(false);
+        if (!out.flush()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool encode_files(const COWFileSystem& fs, ChunkedWriter& out,
+                  const std::function<void(const FileInfo&)>& encode) {
+    return encode_batches(out, [&fs](size_t start, const std::function<bool(const FileInfo&)>& visitor) {
+        return fs.for_each_file_from(start, visitor);
+    }, encode);
+}
+
+// Codifica en memoria lo que produce `visit` con el lock tomado y lo entrega
+// al sink una vez suelto. Para listas que deben salir de una sola toma, como
+// los snapshots: sus mapas pueden ocupar mas que cualquier archivo
+bool encode_locked(ChunkedWriter& out, const std::function<void()>& visit) {
+    out.hold(true);
+    visit();
+    out.hold(false);
+    return out.flush();
+}
+
+} // namespace
+
+bool MetadataManager::stream_metadata_json(const COWFileSystem& fs, const ChunkSink& sink) {
+    ChunkedWriter out(sink);
+    out.put("{\n");
+    out.put("  \"filesystem\": {\n");
+    out.put("    \"total_memory_usage\": ");
+    out.put_number(static_cast<uint64_t>(fs.get_total_memory_usage()));
+    out.put(",\n");
+    out.put("    \"files\": [");
+
+    // Los archivos se recorren directamente sobre los inodos, sin abrirlos ni
+    // copiar su historial
+    bool first_file = true;
+    bool ok = encode_files(fs, out, [&](const FileInfo& file) {
+        out.put(first_file ? "\n" : ",\n");
+        first_file = false;
+        out.put("      {\n");
+        out.put("        \"name\": ");
+        out.put_string(file.filename);
+        out.put(",\n        \"size\": ");
+        out.put_number(static_cast<uint64_t>(file.size));
+        out.put(",\n        \"version_count\": ");
+        out.put_number(static_cast<uint64_t>(file.version_count));
+        out.put(",\n        \"is_open\": ");
+        out.put(file.is_open ? "true" : "false");
+        out.put(",\n");
+
+        out.put("        \"version_history\": [");
+        for (size_t j = 0; j < file.versions.size(); ++j) {
+            const VersionInfo& version = file.versions[j];
+            out.put(j == 0 ? "\n" : ",\n");
+            out.put("          {\n");
+            out.put("            \"version_number\": ");
+            out.put_number(static_cast<uint64_t>(version.version_number));
+            out.put(",\n            \"block_index\": ");
+            out.put_number(static_cast<uint64_t>(version.block_index));
+            out.put(",\n            \"size\": ");
+            out.put_number(static_cast<uint64_t>(version.size));
+            out.put(",\n            \"timestamp\": \"");
+            char timestamp[32];
+            out.put(timestamp, format_timestamp(version.timestamp, timestamp, sizeof(timestamp)));
+            out.put("\"");
+            out.put("\n          }");
+        }
+        out.put(file.versions.empty() ? "]\n" : "\n        ]\n");
+        out.put("      }");
+    });
+    out.put(first_file ? "]\n" : "\n    ]\n");
+    out.put("  }\n");
+    out.put("}");
+    return out.flush() && ok;
+}
+
+bool MetadataManager::write_metadata_json(const COWFileSystem& fs, int fd) {
+    return stream_metadata_json(fs, [fd](const char* data, size_t size) {
+        return write_all(fd, data, size);
+    });
+}
+
+bool MetadataManager::encode_metadata_binary(const COWFileSystem& fs, const ChunkSink& sink) {
+    ChunkedWriter out(sink);
+    out.put(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    out.put(reinterpret_cast<const char*>(&BINARY_FORMAT_VERSION), 1);
+    // La generacion se lee antes de recorrer los archivos: lo que cambie
+    // durante el recorrido se vuelve a incluir en el siguiente incremento
+    out.put_varint(fs.get_generation());
+    out.put_varint(fs.get_total_memory_usage());
+
+    // El numero de archivos se conoce al recorrerlos, asi que se escribe cada
+    // archivo precedido por un 1 y la lista termina con un 0
+    if (!encode_files(fs, out, [&](const FileInfo& file) {
+            out.put_varint(FILE_FULL);
+            put_file(out, file.filename, file.size, file.version_count, file.has_retention, file.retention,
+                     file.versions.begin(), file.versions.size(), file.block_table);
+        })) {
+        return false;
+    }
+    out.put_varint(LIST_END);
+
+    if (!encode_locked(out, [&]() {
+            fs.for_each_snapshot([&](const Snapshot& snap) {
+                out.put_varint(1);
+                put_snapshot(out, snap);
+            });
+        })) {
+        return false;
+    }
+    out.put_varint(LIST_END);
+    return out.flush();
+}
+
+bool MetadataManager::encode_metadata_image(const MetadataImage& image, const ChunkSink& sink) {
+    ChunkedWriter out(sink);
+    out.put(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    out.put(reinterpret_cast<const char*>(&BINARY_FORMAT_VERSION), 1);
+    out.put_varint(image.generation);
+    out.put_varint(image.total_memory_usage);
+    for (const FileMetadata& file : image.files) {
+        out.put_varint(FILE_FULL);
+        put_file(out, file.name.c_str(), file.size, file.version_count, file.has_retention, file.retention,
+                 file.versions.data(), file.versions.size(), file.block_table.data());
+    }
+    out.put_varint(LIST_END);
+    for (const Snapshot& snap : image.snapshots) {
+        out.put_varint(1);
+        put_snapshot(out, snap);
+    }
+    out.put_varint(LIST_END);
+    return out.flush();
+}
+
+bool MetadataManager::decode_metadata_binary(const uint8_t* data, size_t size, MetadataImage& image) {
+    image = MetadataImage{0, 0, {}, {}};
+    // La version 1 no guardaba la generacion; se carga como generacion 0
+    if (size < sizeof(BINARY_MAGIC) + 1 || std::memcmp(data, BINARY_MAGIC, sizeof(BINARY_MAGIC)) != 0 ||
+        data[sizeof(BINARY_MAGIC)] == 0 || data[sizeof(BINARY_MAGIC)] > BINARY_FORMAT_VERSION) {
+        return false;
+    }
+    uint8_t format = data[sizeof(BINARY_MAGIC)];
+    BinaryReader in(data + sizeof(BINARY_MAGIC) + 1, size - sizeof(BINARY_MAGIC) - 1);
+    if (format >= 2) {
+        image.generation = in.varint();
+    }
+    image.total_memory_usage = in.varint();
+
+    while (in.ok() && in.varint() == FILE_FULL) {
+        FileMetadata file;
+        if (!read_file(in, file, image.generation)) {
+            return false;
+        }
+        image.files.push_back(std::move(file));
+    }
+
+    while (in.ok() && in.varint() == 1) {
+        Snapshot snap;
+        if (!read_snapshot(in, snap)) {
+            return false;
+        }
+        image.snapshots.push_back(std::move(snap));
+    }
+    return in.ok() && in.at_end();
+}
+
+bool MetadataManager::write_metadata_binary(const COWFileSystem& fs, int fd) {
+    return encode_metadata_binary(fs, [fd](const char* data, size_t size) {
+        return write_all(fd, data, size);
+    });
+}
+
+bool MetadataManager::save_metadata_binary(const COWFileSystem& fs, const std::string& version_label) {
+    return save_binary("metadata_" + version_label + ".cowm", [&fs](const ChunkSink& sink) {
+        return encode_metadata_binary(fs, sink);
+    });
+}
+
+bool MetadataManager::load_metadata_binary(const std::string& path, MetadataImage& image) {
+    // Leer el documento completo de una vez y decodificarlo en memoria
+    std::vector<uint8_t> data;
+    return read_whole_file(path, data) && decode_metadata_binary(data.data(), data.size(), image);
+}
+
+bool MetadataManager::read_metadata_generation(const std::string& path, uint64_t& generation) {
+    // Solo hace falta la cabecera: magic, version y dos varints como maximo
+    uint8_t header[sizeof(BINARY_MAGIC) + 1 + 2 * 10];
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t n;
+    do {
+        n = ::read(fd, header, sizeof(header));
+    } while (n < 0 && errno == EINTR);
+    ::close(fd);
+    if (n < static_cast<ssize_t>(sizeof(BINARY_MAGIC) + 1)) {
+        return false;
+    }
+    BinaryReader in(header + sizeof(BINARY_MAGIC) + 1, n - sizeof(BINARY_MAGIC) - 1);
+    if (std::memcmp(header, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0) {
+        if (header[sizeof(BINARY_MAGIC)] == 1) {
+            generation = 0;
+            return true;
+        }
+        if (header[sizeof(BINARY_MAGIC)] > BINARY_FORMAT_VERSION) {
+            return false;
+        }
+        generation = in.varint();
+        return in.ok();
+    }
+    if (std::memcmp(header, INCREMENT_MAGIC, sizeof(INCREMENT_MAGIC)) == 0 &&
+        header[sizeof(INCREMENT_MAGIC)] != 0 && header[sizeof(INCREMENT_MAGIC)] <= INCREMENT_FORMAT_VERSION) {
+        in.varint();  // Generacion base
+        generation = in.varint();
+        return in.ok();
+    }
+    return false;
+}
+
+bool MetadataManager::encode_metadata_increment(const COWFileSystem& fs, uint64_t base_generation,
+                                                const ChunkSink& sink) {
+    ChunkedWriter out(sink);
+    out.put(INCREMENT_MAGIC, sizeof(INCREMENT_MAGIC));
+    out.put(reinterpret_cast<const char*>(&INCREMENT_FORMAT_VERSION), 1);
+    out.put_varint(base_generation);
+    out.put_varint(fs.get_generation());
+    out.put_varint(fs.get_total_memory_usage());
+
+    // Archivos eliminados; se aplican antes que los archivos modificados para
+    // que un archivo borrado y vuelto a crear quede con su contenido nuevo
+    if (!encode_locked(out, [&]() {
+            fs.for_each_removed_file(base_generation, [&](const std::string& name) {
+                out.put_varint(1);
+                out.put_bytes(name.data(), name.size());
+            });
+        })) {
+        return false;
+    }
+    out.put_varint(LIST_END);
+
+    // Solo se visitan los inodos del registro de cambios posteriores a la base
+    auto walk = [&fs, base_generation](size_t start, const std::function<bool(const FileInfo&)>& visitor) {
+        return fs.for_each_modified_file_from(base_generation, start, visitor);
+    };
+    if (!encode_batches(out, walk, [&](const FileInfo& file) {
+            if (file.rewritten_generation > base_generation) {
+                // Historial podado, revertido o archivo nuevo: se guarda completo
+                out.put_varint(FILE_FULL);
+                put_file(out, file.filename, file.size, file.version_count, file.has_retention, file.retention,
+                         file.versions.begin(), file.versions.size(), file.block_table);
+                return;
+            }
+            // Solo se agregaron versiones; las generaciones crecen con el historial
+            const VersionInfo* first = std::partition_point(file.versions.begin(), file.versions.end(),
+                [base_generation](const VersionInfo& version) { return version.generation <= base_generation; });
+            out.put_varint(FILE_APPEND);
+            put_file(out, file.filename, file.size, file.version_count, file.has_retention, file.retention,
+                     first, file.versions.end() - first, file.block_table);
+        })) {
+        return false;
+    }
+    out.put_varint(LIST_END);
+
+    // Si cambio algun snapshot se guarda la lista completa
+    if (fs.get_snapshots_generation() > base_generation) {
+        out.put_varint(1);
+        if (!encode_locked(out, [&]() {
+                fs.for_each_snapshot([&](const Snapshot& snap) {
+                    out.put_varint(1);
+                    put_snapshot(out, snap);
+                });
+            })) {
+            return false;
+        }
+        out.put_varint(LIST_END);
+    } else {
+        out.put_varint(0);
+    }
+    return out.flush();
+}
+
+bool MetadataManager::save_metadata_incremental(const COWFileSystem& fs, const std::string& version_label,
+                                                const std::string& base_label) {
+    uint64_t base_generation = 0;
+    std::string base = "metadata_" + base_label;
+    if (!read_metadata_generation(base + ".cowm", base_generation) &&
+        !read_metadata_generation(base + ".cowi", base_generation)) {
+        std::cerr << "save_metadata_incremental: Base metadata not found: " << base_label << std::endl;
+        return false;
+    }
+    if (base_generation < fs.get_tracking_start() || base_generation > fs.get_generation()) {
+        std::cerr << "save_metadata_incremental: Base " << base_label
+                  << " does not belong to the current filesystem state" << std::endl;
+        return false;
+    }
+    return save_binary("metadata_" + version_label + ".cowi", [&](const ChunkSink& sink) {
+        return encode_metadata_increment(fs, base_generation, sink);
+    });
+}
+
+bool MetadataManager::apply_metadata_increment(const uint8_t* data, size_t size, MetadataImage& image) {
+    if (size < sizeof(INCREMENT_MAGIC) + 1 || std::memcmp(data, INCREMENT_MAGIC, sizeof(INCREMENT_MAGIC)) != 0 ||
+        data[sizeof(INCREMENT_MAGIC)] == 0 || data[sizeof(INCREMENT_MAGIC)] > INCREMENT_FORMAT_VERSION) {
+        return false;
+    }
+    BinaryReader in(data + sizeof(INCREMENT_MAGIC) + 1, size - sizeof(INCREMENT_MAGIC) - 1);
+    uint64_t base_generation = in.varint();
+    uint64_t generation = in.varint();
+    uint64_t total_memory_usage = in.varint();
+    if (!in.ok() || base_generation != image.generation || generation < base_generation) {
+        return false;
+    }
+
+    std::unordered_map<std::string, size_t> index;
+    for (size_t i = 0; i < image.files.size(); i++) {
+        index[image.files[i].name] = i;
+    }
+
+    // Un nombre puede aparecer aunque ya no exista en la imagen: los cambios
+    // posteriores a la generacion registrada se pueden repetir en el siguiente
+    // incremento, por eso aplicar es idempotente
+    while (in.ok() && in.varint() == 1) {
+        std::string name = in.bytes();
+        auto it = index.find(name);
+        if (it == index.end()) {
+            continue;
+        }
+        size_t pos = it->second;
+        index.erase(it);
+        if (pos != image.files.size() - 1) {
+            image.files[pos] = std::move(image.files.back());
+            index[image.files[pos].name] = pos;
+        }
+        image.files.pop_back();
+    }
+
+    uint64_t marker;
+    while (in.ok() && (marker = in.varint()) != LIST_END) {
+        FileMetadata file;
+        if ((marker != FILE_FULL && marker != FILE_APPEND) || !read_file(in, file, generation)) {
+            return false;
+        }
+        auto it = index.find(file.name);
+        if (marker == FILE_FULL) {
+            if (it == index.end()) {
+                index[file.name] = image.files.size();
+                image.files.push_back(std::move(file));
+            } else {
+                image.files[it->second] = std::move(file);
+            }
+            continue;
+        }
+
+        if (it == index.end()) {
+            return false;
+        }
+        FileMetadata& target = image.files[it->second];
+        size_t last = target.versions.empty() ? 0 : target.versions.back().version_number;
+        for (VersionInfo version : file.versions) {
+            if (version.version_number <= last) {
+                continue;  // Ya incluida en un incremento anterior
             }
-            json_output << "        ]\n";
-            
-            json_output << "      }" << (i < files.size() - 1 ? "," : "") << "\n";
-            fs.close(fd);
+            const size_t* map = file.block_table.data() + version.map_offset;
+            version.map_offset = target.block_table.size();
+            target.block_table.insert(target.block_table.end(), map, map + version.block_count);
+            target.versions.push_back(version);
         }
+        target.size = file.size;
+        target.version_count = file.version_count;
+        target.has_retention = file.has_retention;
+        target.retention = file.retention;
+    }
+
+    if (in.ok() && in.varint() == 1) {
+        image.snapshots.clear();
+        while (in.ok() && in.varint() == 1) {
+            Snapshot snap;
+            if (!read_snapshot(in, snap)) {
+                return false;
+            }
+            image.snapshots.push_back(std::move(snap));
+        }
+    }
+    if (!in.ok() || !in.at_end()) {
+        return false;
     }
-    json_output << "    ]\n";
-    json_output << "  }\n";
-    json_output << "}";
-    
-    return json_output.str();
+    image.generation = generation;
+    image.total_memory_usage = total_memory_usage;
+    return true;
 }
 
-bool MetadataManager::save_and_print_metadata(COWFileSystem& fs, const std::string& version_label) {
-    std::string json_str = generate_metadata_json(fs);
-    
+bool MetadataManager::load_metadata_chain(const std::vector<std::string>& paths, MetadataImage& image) {
+    if (paths.empty() || !load_metadata_binary(paths[0], image)) {
+        return false;
+    }
+    std::vector<uint8_t> data;
+    for (size_t i = 1; i < paths.size(); i++) {
+        if (!read_whole_file(paths[i], data) || !apply_metadata_increment(data.data(), data.size(), image)) {
+            std::cerr << "load_metadata_chain: Cannot apply " << paths[i] << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MetadataManager::compact_metadata(const std::vector<std::string>& paths, const std::string& version_label) {
+    MetadataImage image;
+    if (!load_metadata_chain(paths, image)) {
+        return false;
+    }
+    return save_binary("metadata_" + version_label + ".cowm", [&image](const ChunkSink& sink) {
+        return encode_metadata_image(image, sink);
+    });
+}
+
+bool MetadataManager::save_and_print_metadata(const COWFileSystem& fs, const std::string& version_label) {
     // Print to console
-    std::cout << "\nFile System Metadata (JSON format):\n" << json_str << std::endl;
+    print_metadata(fs);
 
     // Save to file
     std::string filename = "metadata_" + version_label + ".json";
-    std::ofstream outfile(filename);
-    if (outfile.is_open()) {
-        outfile << json_str << std::endl;
-        outfile.close();
+    if (save_to_file(fs, filename)) {
         std::cout << "Metadata saved to " << filename << std::endl;
         return true;
     } else {
@@ -71,21 +871,18 @@ bool MetadataManager::save_and_print_metadata(COWFileSystem& fs, const std::stri
     }
 }
 
-void MetadataManager::print_metadata(COWFileSystem& fs) {
-    std::string json_str = generate_metadata_json(fs);
-    std::cout << "\nFile System Metadata (JSON format):\n" << json_str << std::endl;
+void MetadataManager::print_metadata(const COWFileSystem& fs) {
+    std::cout << "\nFile System Metadata (JSON format):\n";
+    stream_metadata_json(fs, [](const char* data, size_t size) {
+        std::cout.write(data, size);
+        return static_cast<bool>(std::cout);
+    });
+    std::cout << std::endl;
 }
 
-bool MetadataManager::save_metadata(COWFileSystem& fs, const std::string& version_label) {
-    std::string json_str = generate_metadata_json(fs);
+bool MetadataManager::save_metadata(const COWFileSystem& fs, const std::string& version_label) {
     std::string filename = "metadata_" + version_label + ".json";
-    std::ofstream outfile(filename);
-    if (outfile.is_open()) {
-        outfile << json_str << std::endl;
-        outfile.close();
-        return true;
-    }
-    return false;
+    return save_to_file(fs, filename);
 }
 
-} // namespace cowfs 
\ No newline at end of file
+} // namespace cowfs
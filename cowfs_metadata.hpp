@@ -3,25 +3,81 @@
 
 #include "cowfs.hpp"
 #include <string>
+#include <functional>
 
 namespace cowfs {
 
+// Metadatos de un archivo leidos del formato binario
+struct FileMetadata {
+    std::string name;
+    size_t size;
+    size_t version_count;
+    bool has_retention;
+    RetentionPolicy retention;
+    std::vector<VersionInfo> versions;
+    std::vector<size_t> block_table;
+};
+
+// Contenido completo de un documento de metadatos binario
+struct MetadataImage {
+    uint64_t generation;          // Generacion de cambios del sistema al guardarlo
+    uint64_t total_memory_usage;
+    std::vector<FileMetadata> files;
+    std::vector<Snapshot> snapshots;
+};
+
 class MetadataManager {
 public:
     // Save metadata to a JSON file and print to console
-    static bool save_and_print_metadata(COWFileSystem& fs, const std::string& version_label);
+    static bool save_and_print_metadata(const COWFileSystem& fs, const std::string& version_label);
     
     // Only print metadata to console
-    static void print_metadata(COWFileSystem& fs);
+    static void print_metadata(const COWFileSystem& fs);
     
     // Only save metadata to file
-    static bool save_metadata(COWFileSystem& fs, const std::string& version_label);
+    static bool save_metadata(const COWFileSystem& fs, const std::string& version_label);
+
+    // Stream metadata as JSON to an open file descriptor using bounded memory
+    static bool write_metadata_json(const COWFileSystem& fs, int fd);
+
+    // Output sink for streamed chunks; returns false on write failure
+    using ChunkSink = std::function<bool(const char* data, size_t size)>;
+
+    // Compact binary format: varint fields, delta-encoded version numbers,
+    // timestamps and block indices. Saved as metadata_<label>.cowm
+    static bool save_metadata_binary(const COWFileSystem& fs, const std::string& version_label);
+    static bool write_metadata_binary(const COWFileSystem& fs, int fd);
+    static bool encode_metadata_binary(const COWFileSystem& fs, const ChunkSink& sink);
+
+    // Load a binary metadata document; returns false if it is malformed
+    static bool load_metadata_binary(const std::string& path, MetadataImage& image);
+    static bool decode_metadata_binary(const uint8_t* data, size_t size, MetadataImage& image);
+    static bool encode_metadata_image(const MetadataImage& image, const ChunkSink& sink);
+
+    // Generation recorded in a full (.cowm) or incremental (.cowi) document
+    static bool read_metadata_generation(const std::string& path, uint64_t& generation);
+
+    // Incremental save: only files, versions and snapshots changed since the
+    // document metadata_<base_label>.cowm/.cowi. Saved as metadata_<label>.cowi
+    static bool save_metadata_incremental(const COWFileSystem& fs, const std::string& version_label,
+                                          const std::string& base_label);
+    static bool encode_metadata_increment(const COWFileSystem& fs, uint64_t base_generation,
+                                          const ChunkSink& sink);
+
+    // Apply an increment on top of the image it was based on
+    static bool apply_metadata_increment(const uint8_t* data, size_t size, MetadataImage& image);
+
+    // Load a full document followed by its increments, in order
+    static bool load_metadata_chain(const std::vector<std::string>& paths, MetadataImage& image);
+
+    // Merge a chain into a single full document metadata_<label>.cowm
+    static bool compact_metadata(const std::vector<std::string>& paths, const std::string& version_label);
 
 private:
-    // Helper function to generate JSON string
-    static std::string generate_metadata_json(COWFileSystem& fs);
+    // Helper function to stream the JSON document in fixed-size chunks
+    static bool stream_metadata_json(const COWFileSystem& fs, const ChunkSink& sink);
 };
 
 } // namespace cowfs
 
-#endif // COWFS_METADATA_HPP 
\ No newline at end of file
+#endif // COWFS_METADATA_HPP 
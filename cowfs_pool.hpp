@@ -0,0 +1,72 @@
+#ifndef COWFS_POOL_HPP
+#define COWFS_POOL_HPP
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace cowfs {
+
+/**
+ * @brief Pool de objetos de tamano fijo reservados por slabs
+ *
+ * Los objetos liberados se encadenan en una lista libre y se reutilizan, de
+ * modo que una vez que el pool alcanzo su tamano de trabajo crear y destruir
+ * objetos no llama al asignador general. Los slabs solo se liberan al
+ * destruir el pool.
+ */
+template <typename T, size_t SlabSize = 256>
+class ObjectPool {
+public:
+    ObjectPool() : free_list(nullptr) {}
+    ~ObjectPool() {
+        for (Slot* slab : slabs) {
+            delete[] slab;
+        }
+    }
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        if (!free_list) {
+            grow();
+        }
+        Slot* slot = free_list;
+        free_list = slot->next;
+        return new (slot->storage) T{std::forward<Args>(args)...};
+    }
+
+    void destroy(T* object) {
+        object->~T();
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        slot->next = free_list;
+        free_list = slot;
+    }
+
+    // Objetos que caben en los slabs ya reservados
+    size_t capacity() const { return slabs.size() * SlabSize; }
+
+private:
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    void grow() {
+        Slot* slab = new Slot[SlabSize];
+        slabs.push_back(slab);
+        for (size_t i = 0; i < SlabSize; i++) {
+            slab[i].next = (i + 1 < SlabSize) ? &slab[i + 1] : free_list;
+        }
+        free_list = slab;
+    }
+
+    Slot* free_list;
+    std::vector<Slot*> slabs;
+};
+
+} // namespace cowfs
+
+#endif // COWFS_POOL_HPP
@@ -0,0 +1,199 @@
+#ifndef COWFS_REGION_HPP
+#define COWFS_REGION_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <sys/mman.h>
+#include "cowfs_zero.hpp"
+
+namespace cowfs {
+
+/**
+ * @brief Rango de direcciones reservado de una vez y comprometido por partes
+ *
+ * La reserva no ocupa memoria: es PROT_NONE. protect() hace accesible un
+ * tramo, cuyas paginas valen cero hasta que se escriben, y decommit() lo
+ * devuelve a reserva soltando su memoria. Las direcciones no cambian mientras
+ * se crece dentro de la reserva, asi que los punteros a la region siguen
+ * validos; extend() la amplia en el sitio solo si las direcciones siguientes
+ * estan libres.
+ */
+class ReservedRegion {
+public:
+    ReservedRegion() : base(nullptr), reserved(0) {}
+    ~ReservedRegion() { release(); }
+    ReservedRegion(const ReservedRegion&) = delete;
+    ReservedRegion& operator=(const ReservedRegion&) = delete;
+
+    // `alignment` es potencia de dos y multiplo de pagina
+    bool reserve(size_t bytes, size_t alignment) {
+        release();
+        if (bytes == 0) {
+            return true;
+        }
+        // Se pide de mas para poder alinear el inicio y se devuelve el
+        // sobrante. MAP_NORESERVE: la reserva no cuenta contra el limite de memoria
+        size_t padded = bytes + alignment;
+        void* raw = mmap(nullptr, padded, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (raw == MAP_FAILED) {
+            return false;
+        }
+        uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned = (start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        if (aligned > start) {
+            munmap(raw, aligned - start);
+        }
+        size_t tail = (start + padded) - (aligned + bytes);
+        if (tail > 0) {
+            munmap(reinterpret_cast<void*>(aligned + bytes), tail);
+        }
+        base = reinterpret_cast<uint8_t*>(aligned);
+        reserved = bytes;
+        return true;
+    }
+
+    // Amplia la reserva hasta `bytes` sin mover el inicio. Devuelve false, y
+    // la deja como estaba, si otro mapeo ocupa las direcciones siguientes
+    bool extend(size_t bytes) {
+        if (bytes <= reserved) {
+            return true;
+        }
+        if (!base) {
+            return false;
+        }
+        uint8_t* tail = base + reserved;
+        size_t extra = bytes - reserved;
+        // Sin MAP_FIXED la direccion es solo una sugerencia: si no se respeta,
+        // esta ocupada
+        void* raw = mmap(tail, extra, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (raw == MAP_FAILED) {
+            return false;
+        }
+        if (raw != tail) {
+            munmap(raw, extra);
+            return false;
+        }
+        reserved = bytes;
+        return true;
+    }
+
+    void swap(ReservedRegion& other) {
+        std::swap(base, other.base);
+        std::swap(reserved, other.reserved);
+    }
+
+    void release() {
+        if (base) {
+            munmap(base, reserved);
+        }
+        base = nullptr;
+        reserved = 0;
+    }
+
+    bool protect(size_t offset, size_t bytes) {
+        return bytes == 0 || mprotect(base + offset, bytes, PROT_READ | PROT_WRITE) == 0;
+    }
+
+    // Un mapeo nuevo encima del tramo suelta sus paginas (o el archivo que
+    // hubiera mapeado) y lo deja otra vez como reserva
+    void decommit(size_t offset, size_t bytes) {
+        if (bytes > 0) {
+            mmap(base + offset, bytes, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        }
+    }
+
+    uint8_t* data() const { return base; }
+    size_t capacity() const { return reserved; }
+
+private:
+    uint8_t* base;
+    size_t reserved;
+};
+
+// Arreglo denso sobre una ReservedRegion: crece sin mover los elementos y
+// los nuevos valen cero sin escribirlos, asi un arreglo enorme solo ocupa
+// las paginas que se han tocado
+template <typename T>
+class ZeroArray {
+    static_assert(std::is_trivially_copyable<T>::value, "ZeroArray holds plain values");
+    static constexpr size_t PAGE = 4096;
+
+public:
+    ZeroArray() : count(0), committed(0) {}
+
+    bool reserve(size_t max_count) {
+        count = 0;
+        committed = 0;
+        return region.reserve(round_up(max_count * sizeof(T)), PAGE);
+    }
+    bool resize(size_t n) {
+        size_t needed = round_up(n * sizeof(T));
+        if (needed > region.capacity()) {
+            return false;
+        }
+        if (n < count) {
+            // La cola de la ultima pagina sigue comprometida y debe volver a cero
+            size_t kept = std::min(needed, count * sizeof(T));
+            std::memset(region.data() + n * sizeof(T), 0, kept - n * sizeof(T));
+        }
+        if (needed > committed && !region.protect(committed, needed - committed)) {
+            return false;
+        }
+        if (needed < committed) {
+            region.decommit(needed, committed - needed);
+        }
+        committed = needed;
+        count = n;
+        return true;
+    }
+    // Amplia la reserva a `max_count` elementos. Si no cabe en el sitio, los
+    // elementos pasan a una reserva nueva y data() cambia; las paginas que
+    // valen cero no se copian, asi que siguen sin ocupar memoria
+    bool reserve_more(size_t max_count) {
+        size_t bytes = round_up(max_count * sizeof(T));
+        if (bytes <= region.capacity() || region.extend(bytes)) {
+            return true;
+        }
+        ReservedRegion moved;
+        if (!moved.reserve(bytes, PAGE) || !moved.protect(0, committed)) {
+            return false;
+        }
+        for (size_t offset = 0; offset < committed; offset += PAGE) {
+            if (!is_all_zero(region.data() + offset, PAGE)) {
+                std::memcpy(moved.data() + offset, region.data() + offset, PAGE);
+            }
+        }
+        region.swap(moved);
+        return true;
+    }
+    // Pone todo a cero soltando la memoria
+    void zero() {
+        region.decommit(0, committed);
+        region.protect(0, committed);
+    }
+
+    T& operator[](size_t i) { return data()[i]; }
+    const T& operator[](size_t i) const { return data()[i]; }
+    T* data() { return reinterpret_cast<T*>(region.data()); }
+    const T* data() const { return reinterpret_cast<const T*>(region.data()); }
+    T* begin() { return data(); }
+    T* end() { return data() + count; }
+    size_t size() const { return count; }
+    size_t capacity() const { return region.capacity() / sizeof(T); }
+
+private:
+    static size_t round_up(size_t bytes) { return (bytes + PAGE - 1) / PAGE * PAGE; }
+
+    ReservedRegion region;
+    size_t count;
+    size_t committed;
+};
+
+} // namespace cowfs
+
+#endif // COWFS_REGION_HPP
@@ -0,0 +1,290 @@
+#include "cowfs_scheduler.hpp"
+#include <algorithm>
+
+namespace cowfs {
+
+namespace {
+
+// Espera antes de reintentar una tarea que cedio ante el primer plano o que
+// encontro el lock ocupado
+constexpr std::chrono::milliseconds YIELD_BACKOFF(1);
+
+uint64_t pack(size_t begin, size_t end) {
+    return (static_cast<uint64_t>(begin) << 32) | static_cast<uint64_t>(end);
+}
+
+size_t range_begin(uint64_t range) { return static_cast<size_t>(range >> 32); }
+size_t range_end(uint64_t range) { return static_cast<size_t>(range & 0xffffffffu); }
+
+} // namespace
+
+TaskContext::TaskContext(const Scheduler& scheduler, const TaskBudget& budget,
+                         std::chrono::steady_clock::time_point start)
+    : scheduler(scheduler), budget(budget), start(start), used(0), preempted(false) {}
+
+bool TaskContext::should_yield() {
+    if (scheduler.foreground_pending()) {
+        preempted = true;
+        return true;
+    }
+    if (budget.io_batch > 0 && used >= budget.io_batch) {
+        return true;
+    }
+    return std::chrono::steady_clock::now() - start >= budget.cpu_slice;
+}
+
+Scheduler::Scheduler(size_t thread_count, size_t helper_count, const PriorityMutex* foreground)
+    : foreground(foreground), helpers(helper_count), stopping(false),
+      job_fn(nullptr), job_ctx(nullptr), job_participants(0), job_id(0), active_workers(0),
+      slot_capacity(0), completed(0), foreground_active(false), next_job_id(1) {
+    std::lock_guard<std::mutex> lock(mutex);
+    spawn(std::max<size_t>(1, std::max(thread_count, helper_count)));
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_cv.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+size_t Scheduler::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return threads.size();
+}
+
+void Scheduler::set_helpers(size_t helper_count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (helper_count > threads.size()) {
+        spawn(helper_count - threads.size());
+    }
+    helpers.store(helper_count, std::memory_order_relaxed);
+}
+
+void Scheduler::spawn(size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        threads.emplace_back(&Scheduler::worker_loop, this, threads.size());
+    }
+}
+
+bool Scheduler::foreground_pending() const {
+    return foreground_active.load(std::memory_order_relaxed) ||
+           (foreground && foreground->contended());
+}
+
+void Scheduler::run(size_t count, TaskFn fn, void* ctx) {
+    std::lock_guard<std::mutex> submit(submit_mutex);
+    {
+        // Un hilo que llego tarde al trabajo anterior todavia puede estar en
+        // drain(); no se tocan los tramos hasta que salga
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this] { return active_workers == 0; });
+        size_t participants = std::min(count, std::min(helpers.load(std::memory_order_relaxed),
+                                                       threads.size()) + 1);
+        if (participants > slot_capacity) {
+            slots.reset(new std::atomic<uint64_t>[participants]);
+            slot_capacity = participants;
+        }
+        for (size_t p = 0; p < participants; p++) {
+            slots[p].store(pack(count * p / participants, count * (p + 1) / participants),
+                           std::memory_order_relaxed);
+        }
+        job_fn = fn;
+        job_ctx = ctx;
+        job_participants = participants;
+        completed.store(0, std::memory_order_relaxed);
+        foreground_active.store(true, std::memory_order_relaxed);
+        job_id++;
+    }
+    work_cv.notify_all();
+
+    drain(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this, count] {
+        return completed.load(std::memory_order_acquire) == count && active_workers == 0;
+    });
+    foreground_active.store(false, std::memory_order_relaxed);
+    lock.unlock();
+    work_cv.notify_all();
+}
+
+bool Scheduler::pop(size_t slot, size_t& index) {
+    uint64_t range = slots[slot].load(std::memory_order_acquire);
+    while (range_begin(range) < range_end(range)) {
+        if (slots[slot].compare_exchange_weak(range, pack(range_begin(range) + 1, range_end(range)),
+                                              std::memory_order_acq_rel)) {
+            index = range_begin(range);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Scheduler::steal(size_t slot) {
+    // Se roba la mitad final del tramo ajeno: el duenio sigue por el
+    // principio sin competir con el ladron por los mismos indices
+    for (size_t k = 1; k < job_participants; k++) {
+        size_t victim = (slot + k) % job_participants;
+        uint64_t range = slots[victim].load(std::memory_order_acquire);
+        while (range_begin(range) < range_end(range)) {
+            size_t begin = range_begin(range);
+            size_t end = range_end(range);
+            size_t split = end - (end - begin + 1) / 2;
+            if (slots[victim].compare_exchange_weak(range, pack(begin, split),
+                                                    std::memory_order_acq_rel)) {
+                slots[slot].store(pack(split, end), std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void Scheduler::drain(size_t slot) {
+    do {
+        size_t index;
+        while (pop(slot, index)) {
+            job_fn(job_ctx, index);
+            completed.fetch_add(1, std::memory_order_release);
+        }
+    } while (steal(slot));
+}
+
+Scheduler::JobId Scheduler::schedule(const std::string& name, std::chrono::milliseconds period,
+                                     const TaskBudget& budget, JobFn fn) {
+    std::unique_ptr<Job> job(new Job{0, period, budget, std::move(fn), Clock::now() + period,
+                                     false, false,
+                                     JobStats{name, 0, 0, 0, 0, std::chrono::microseconds(0)}});
+    JobId id;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        id = next_job_id++;
+        job->id = id;
+        jobs.push_back(std::move(job));
+    }
+    work_cv.notify_all();
+    return id;
+}
+
+bool Scheduler::cancel(JobId id) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = std::find_if(jobs.begin(), jobs.end(),
+                           [id](const std::unique_ptr<Job>& job) { return job->id == id; });
+    if (it == jobs.end()) {
+        return false;
+    }
+    Job* job = it->get();
+    job->cancelled = true;
+    done_cv.wait(lock, [job] { return !job->running; });
+    jobs.erase(std::find_if(jobs.begin(), jobs.end(),
+                            [job](const std::unique_ptr<Job>& entry) { return entry.get() == job; }));
+    return true;
+}
+
+std::vector<JobStats> Scheduler::job_stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<JobStats> result;
+    result.reserve(jobs.size());
+    for (const auto& job : jobs) {
+        result.push_back(job->stats);
+    }
+    return result;
+}
+
+Scheduler::Job* Scheduler::next_due(Clock::time_point now, Clock::time_point& wake) {
+    // Hay pocas tareas; un recorrido lineal basta
+    Job* due = nullptr;
+    wake = Clock::time_point::max();
+    for (const auto& job : jobs) {
+        if (job->running || job->cancelled) {
+            continue;
+        }
+        if (job->next_run <= now && (!due || job->next_run < due->next_run)) {
+            due = job.get();
+        } else if (job->next_run > now) {
+            wake = std::min(wake, job->next_run);
+        }
+    }
+    return due;
+}
+
+void Scheduler::run_job(Job& job) {
+    Clock::time_point start = Clock::now();
+    TaskContext ctx(*this, job.budget, start);
+    TaskStatus status = job.fn(ctx);
+    Clock::time_point end = Clock::now();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    job.stats.runs++;
+    job.stats.units += ctx.used;
+    job.stats.busy += std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    switch (status) {
+    case TaskStatus::IDLE:
+        job.next_run = end + job.period;
+        break;
+    case TaskStatus::MORE:
+        // El ritmo de E/S se cumple en promedio: la siguiente ejecucion espera
+        // lo que cuesten las unidades consumidas en esta
+        job.next_run = start;
+        if (job.budget.io_per_second > 0) {
+            job.next_run += std::chrono::microseconds(ctx.used * 1000000 / job.budget.io_per_second);
+        }
+        if (ctx.preempted) {
+            job.stats.preemptions++;
+            job.next_run = std::max(job.next_run, end + YIELD_BACKOFF);
+        }
+        break;
+    case TaskStatus::BLOCKED:
+        job.stats.blocked++;
+        job.next_run = end + YIELD_BACKOFF;
+        break;
+    }
+    job.running = false;
+}
+
+void Scheduler::worker_loop(size_t index) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        // El primer plano va antes que cualquier tarea de mantenimiento
+        if (job_id != seen) {
+            seen = job_id;
+            if (index + 1 < job_participants) {
+                active_workers++;
+                lock.unlock();
+                drain(index + 1);
+                lock.lock();
+                active_workers--;
+                done_cv.notify_all();
+            }
+            continue;
+        }
+
+        Clock::time_point wake = Clock::time_point::max();
+        Job* job = foreground_active.load(std::memory_order_relaxed)
+                       ? nullptr : next_due(Clock::now(), wake);
+        if (job) {
+            job->running = true;
+            lock.unlock();
+            run_job(*job);
+            lock.lock();
+            done_cv.notify_all();
+            continue;
+        }
+
+        // Con un parallel_for en curso se espera a que acabe (run() avisa)
+        if (foreground_active.load(std::memory_order_relaxed) ||
+            wake == Clock::time_point::max()) {
+            work_cv.wait(lock);
+        } else {
+            work_cv.wait_until(lock, wake);
+        }
+    }
+}
+
+} // namespace cowfs
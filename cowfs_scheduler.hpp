@@ -0,0 +1,217 @@
+#ifndef COWFS_SCHEDULER_HPP
+#define COWFS_SCHEDULER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace cowfs {
+
+/**
+ * @brief Mutex recursivo que sabe si hay operaciones en primer plano esperando
+ *
+ * lock() es el camino normal de las operaciones de los clientes y anuncia la
+ * espera mientras dura. Las tareas de mantenimiento entran con try_lock() y
+ * consultan contended() para soltarlo en cuanto llega un cliente.
+ */
+class PriorityMutex {
+public:
+    PriorityMutex() : waiting(0) {}
+    PriorityMutex(const PriorityMutex&) = delete;
+    PriorityMutex& operator=(const PriorityMutex&) = delete;
+
+    void lock() {
+        waiting.fetch_add(1, std::memory_order_relaxed);
+        mutex.lock();
+        waiting.fetch_sub(1, std::memory_order_relaxed);
+    }
+    bool try_lock() { return mutex.try_lock(); }
+    void unlock() { mutex.unlock(); }
+    bool contended() const { return waiting.load(std::memory_order_relaxed) > 0; }
+
+private:
+    std::recursive_mutex mutex;
+    std::atomic<size_t> waiting;
+};
+
+// Resultado de una ejecucion de una tarea de mantenimiento
+enum class TaskStatus {
+    IDLE,     // No queda trabajo: volver a ejecutar tras el periodo
+    MORE,     // Queda trabajo: volver en cuanto lo permita el presupuesto
+    BLOCKED   // No pudo empezar (recurso ocupado): reintentar en breve
+};
+
+// Presupuesto de cada ejecucion de una tarea de mantenimiento
+struct TaskBudget {
+    std::chrono::microseconds cpu_slice;  // Tiempo maximo por ejecucion
+    size_t io_batch;                      // Unidades (bloques) por ejecucion; 0 = sin limite
+    size_t io_per_second;                 // Ritmo medio maximo; 0 = sin limite
+};
+
+// Contadores de una tarea de mantenimiento
+struct JobStats {
+    std::string name;
+    uint64_t runs;
+    uint64_t preemptions;   // Ejecuciones cortadas por trabajo en primer plano
+    uint64_t blocked;       // Ejecuciones que no pudieron empezar
+    uint64_t units;         // Unidades de E/S consumidas
+    std::chrono::microseconds busy;
+};
+
+class Scheduler;
+
+/**
+ * @brief Lo que ve una tarea de mantenimiento durante una ejecucion
+ *
+ * La tarea avanza en pasos pequenos, cobra con charge() las unidades de E/S
+ * de cada paso y pregunta should_yield() entre pasos.
+ */
+class TaskContext {
+public:
+    // true si se agoto el presupuesto o hay trabajo en primer plano esperando
+    bool should_yield();
+    void charge(size_t units = 1) { used += units; }
+    size_t charged() const { return used; }
+
+private:
+    friend class Scheduler;
+    TaskContext(const Scheduler& scheduler, const TaskBudget& budget,
+                std::chrono::steady_clock::time_point start);
+
+    const Scheduler& scheduler;
+    const TaskBudget& budget;
+    std::chrono::steady_clock::time_point start;
+    size_t used;
+    bool preempted;
+};
+
+/**
+ * @brief Hilos compartidos por el trabajo en primer plano y el mantenimiento
+ *
+ * Hay dos clases de prioridad:
+ *
+ * - Primer plano: parallel_for() reparte body(i) para i en [0, count) entre el
+ *   llamador y hasta `helpers` hilos, y vuelve cuando terminan todos. Cada
+ *   participante empieza con un tramo contiguo de indices y, al vaciarlo,
+ *   roba la mitad final del tramo de otro. Un hilo ocupado en mantenimiento
+ *   no retrasa el trabajo: su tramo se lo roban los demas. Solo corre un
+ *   parallel_for a la vez y no asigna memoria.
+ * - Mantenimiento: tareas periodicas registradas con schedule(). Un hilo
+ *   libre ejecuta la que toque, siempre despues de atender el primer plano y
+ *   dentro del presupuesto de la tarea. Una tarea nunca corre en dos hilos a
+ *   la vez.
+ */
+class Scheduler {
+public:
+    using JobId = uint64_t;
+    using JobFn = std::function<TaskStatus(TaskContext&)>;
+
+    // `foreground`, si se indica, es el lock de los clientes: las tareas ceden
+    // en cuanto alguien espera por el
+    Scheduler(size_t threads, size_t helpers, const PriorityMutex* foreground = nullptr);
+    ~Scheduler();
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    size_t size() const;
+    // Hilos que ayudan en parallel_for(); crea los que falten
+    void set_helpers(size_t helpers);
+
+    template <typename F>
+    void parallel_for(size_t count, F&& body) {
+        if (count == 0) {
+            return;
+        }
+        if (helpers.load(std::memory_order_relaxed) == 0 || count == 1 || count >= UINT32_MAX) {
+            for (size_t i = 0; i < count; i++) {
+                body(i);
+            }
+            return;
+        }
+        using Body = typename std::remove_reference<F>::type;
+        run(count, &invoke<Body>, const_cast<void*>(static_cast<const void*>(&body)));
+    }
+
+    /**
+     * @brief Registra una tarea de mantenimiento
+     * @param period Espera entre pasadas completas; la primera empieza tras un periodo
+     * @return Identificador para cancel(); nunca es 0
+     */
+    JobId schedule(const std::string& name, std::chrono::milliseconds period,
+                   const TaskBudget& budget, JobFn fn);
+
+    // Quita la tarea, esperando a que termine si se esta ejecutando. No se
+    // puede llamar desde la propia tarea.
+    bool cancel(JobId id);
+
+    std::vector<JobStats> job_stats() const;
+
+    // true mientras hay un parallel_for en curso o un cliente esperando
+    bool foreground_pending() const;
+
+private:
+    using TaskFn = void (*)(void*, size_t);
+    using Clock = std::chrono::steady_clock;
+
+    struct Job {
+        JobId id;
+        std::chrono::milliseconds period;
+        TaskBudget budget;
+        JobFn fn;
+        Clock::time_point next_run;
+        bool running;
+        bool cancelled;
+        JobStats stats;
+    };
+
+    template <typename Body>
+    static void invoke(void* body, size_t index) {
+        (*static_cast<Body*>(body))(index);
+    }
+
+    void run(size_t count, TaskFn fn, void* ctx);
+    void drain(size_t slot);
+    bool pop(size_t slot, size_t& index);
+    bool steal(size_t slot);
+    Job* next_due(Clock::time_point now, Clock::time_point& wake);
+    void run_job(Job& job);
+    void worker_loop(size_t index);
+    void spawn(size_t count);
+
+    const PriorityMutex* foreground;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> helpers;
+    std::mutex submit_mutex;        // Un parallel_for a la vez
+    mutable std::mutex mutex;       // Protege el trabajo actual y las tareas
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    bool stopping;
+
+    // parallel_for en curso. Cada tramo [inicio, fin) va empaquetado en un
+    // entero de 64 bits para robarlo con un solo compare-exchange
+    TaskFn job_fn;
+    void* job_ctx;
+    size_t job_participants;
+    uint64_t job_id;
+    size_t active_workers;          // Hilos dentro de drain()
+    std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    size_t slot_capacity;
+    std::atomic<size_t> completed;
+    std::atomic<bool> foreground_active;
+
+    std::vector<std::unique_ptr<Job>> jobs;
+    JobId next_job_id;
+};
+
+} // namespace cowfs
+
+#endif // COWFS_SCHEDULER_HPP
@@ -0,0 +1,386 @@
+#include "cowfs.hpp"
+#include "cowfs_checksum.hpp"
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+
+namespace cowfs {
+
+// Flujo de send()/receive(). Todos los enteros son de ancho fijo y
+// little-endian, asi que el formato no depende del compilador ni de la
+// arquitectura:
+//   cabecera: magic[8] u32 version u32 block_size i64 from_timestamp
+//             i64 to_timestamp u64 from_blocks u64 new_blocks u64 file_count
+//             u32 from_name_length u32 to_name_length, los dos nombres y el
+//             CRC32C u32 de todo lo anterior
+//   new_blocks x [u32 checksum][BLOCK_SIZE bytes]
+//   u64 longitud de la seccion de archivos, la seccion y su CRC32C u32
+//   archivo:  u16 name_length, nombre, u64 version_number u64 size
+//             u64 block_count u64 run_count, run_count x [u64 source u64 length]
+// Un tramo son `length` entradas consecutivas de un mapa a partir de `source`
+namespace {
+
+const char SEND_MAGIC[8] = {'C', 'O', 'W', 'F', 'S', 'S', 'N', 'D'};
+constexpr uint32_t SEND_FORMAT_VERSION = 2;
+constexpr uint32_t SEND_MAX_NAME_LENGTH = 4096;
+constexpr size_t SEND_HEADER_SIZE = 64;
+// El origen de un tramo es un hueco, una posicion en los mapas del snapshot
+// base o, si no, el indice de un bloque enviado en el flujo
+constexpr uint64_t SEND_HOLE = UINT64_MAX;
+constexpr uint64_t SEND_FROM_BASE = uint64_t(1) << 62;
+
+void put_le(std::string& out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+// Lector little-endian con comprobacion de limites
+class LeReader {
+public:
+    LeReader(const char* data, size_t size) : pos(data), end(data + size), failed(false) {}
+
+    uint64_t get(size_t bytes) {
+        if (static_cast<size_t>(end - pos) < bytes) {
+            failed = true;
+            return 0;
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes; i++) {
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(pos[i])) << (8 * i);
+        }
+        pos += bytes;
+        return value;
+    }
+
+    const char* take(size_t bytes) {
+        if (static_cast<size_t>(end - pos) < bytes) {
+            failed = true;
+            return nullptr;
+        }
+        const char* data = pos;
+        pos += bytes;
+        return data;
+    }
+
+    bool ok() const { return !failed; }
+    bool at_end() const { return pos == end; }
+
+private:
+    const char* pos;
+    const char* end;
+    bool failed;
+};
+
+// Escribe `data` seguido de su CRC32C
+bool write_section(std::ostream& out, const std::string& data) {
+    std::string crc;
+    put_le(crc, crc32c(data.data(), data.size()), 4);
+    out.write(data.data(), data.size());
+    out.write(crc.data(), crc.size());
+    return static_cast<bool>(out);
+}
+
+// Agrega a `data` `size` bytes del flujo y comprueba el CRC32C que los sigue,
+// calculado sobre todo `data`. Se lee por partes: una longitud danada no
+// reserva mas memoria que los datos que de verdad trae el flujo
+bool read_section(std::istream& in, size_t size, std::string& data) {
+    const size_t target = data.size() + size;
+    char chunk[64 * 1024];
+    while (data.size() < target) {
+        size_t n = std::min(sizeof(chunk), target - data.size());
+        if (!in.read(chunk, n)) {
+            return false;
+        }
+        data.append(chunk, n);
+    }
+    char crc[4];
+    if (!in.read(crc, sizeof(crc))) {
+        return false;
+    }
+    return LeReader(crc, sizeof(crc)).get(4) == crc32c(data.data(), data.size());
+}
+
+} // namespace
+
+bool COWFileSystem::send(const std::string& from_snapshot, const std::string& to_snapshot,
+                         std::ostream& out) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    const Snapshot* from = from_snapshot.empty() ? nullptr : find_snapshot(from_snapshot);
+    const Snapshot* to = find_snapshot(to_snapshot);
+    if ((!from_snapshot.empty() && !from) || !to) {
+        std::cerr << "send: Snapshot not found: " << (to ? from_snapshot : to_snapshot) << std::endl;
+        return false;
+    }
+    if (from_snapshot.size() > SEND_MAX_NAME_LENGTH || to_snapshot.size() > SEND_MAX_NAME_LENGTH) {
+        std::cerr << "send: Snapshot name too long" << std::endl;
+        return false;
+    }
+
+    // Un bloque del base se nombra por su primera posicion en los mapas del
+    // base, que el receptor tiene en el mismo orden. Los demas bloques del
+    // destino se envian una sola vez, en orden de aparicion
+    std::unordered_map<size_t, uint64_t> sources;
+    if (from) {
+        for (size_t i = 0; i < from->block_table.size(); i++) {
+            if (from->block_table[i] != HOLE_BLOCK) {
+                sources.emplace(from->block_table[i], SEND_FROM_BASE | i);
+            }
+        }
+    }
+    std::vector<size_t> new_blocks;
+    for (size_t block : to->block_table) {
+        if (block != HOLE_BLOCK && sources.emplace(block, new_blocks.size()).second) {
+            new_blocks.push_back(block);
+        }
+    }
+    if (!verify_blocks(new_blocks.data(), new_blocks.size())) {
+        std::cerr << "send: Snapshot '" << to_snapshot << "' has corrupt blocks" << std::endl;
+        return false;
+    }
+
+    std::string header;
+    header.append(SEND_MAGIC, sizeof(SEND_MAGIC));
+    put_le(header, SEND_FORMAT_VERSION, 4);
+    put_le(header, BLOCK_SIZE, 4);
+    put_le(header, static_cast<uint64_t>(from ? from->timestamp : 0), 8);
+    put_le(header, static_cast<uint64_t>(to->timestamp), 8);
+    put_le(header, from ? from->block_table.size() : 0, 8);
+    put_le(header, new_blocks.size(), 8);
+    put_le(header, to->entries.size(), 8);
+    put_le(header, from_snapshot.size(), 4);
+    put_le(header, to_snapshot.size(), 4);
+    header += from_snapshot;
+    header += to_snapshot;
+    if (!write_section(out, header)) {
+        std::cerr << "send: Error writing the stream" << std::endl;
+        return false;
+    }
+    size_t sent = header.size() + 4;
+
+    for (size_t block : new_blocks) {
+        std::string checksum;
+        put_le(checksum, blocks.checksum[block], 4);
+        out.write(checksum.data(), checksum.size());
+        out.write(reinterpret_cast<const char*>(block_bytes(block)), BLOCK_SIZE);
+        if (!out) {
+            std::cerr << "send: Error writing the stream" << std::endl;
+            return false;
+        }
+    }
+    sent += new_blocks.size() * (4 + BLOCK_SIZE);
+
+    // Los mapas de bloques se envian como tramos
+    std::string files;
+    std::vector<std::pair<uint64_t, uint64_t>> runs;
+    for (const auto& entry : to->entries) {
+        const size_t* map = to->block_table.data() + entry.map_offset;
+        runs.clear();
+        for (size_t i = 0; i < entry.block_count; i++) {
+            uint64_t source = map[i] == HOLE_BLOCK ? SEND_HOLE : sources.find(map[i])->second;
+            if (!runs.empty()) {
+                auto& last = runs.back();
+                if (source == (last.first == SEND_HOLE ? SEND_HOLE : last.first + last.second)) {
+                    last.second++;
+                    continue;
+                }
+            }
+            runs.emplace_back(source, 1);
+        }
+
+        size_t name_length = strnlen(entry.filename, MAX_FILENAME_LENGTH);
+        put_le(files, name_length, 2);
+        files.append(entry.filename, name_length);
+        put_le(files, entry.version_number, 8);
+        put_le(files, entry.size, 8);
+        put_le(files, entry.block_count, 8);
+        put_le(files, runs.size(), 8);
+        for (const auto& run : runs) {
+            put_le(files, run.first, 8);
+            put_le(files, run.second, 8);
+        }
+    }
+    std::string length;
+    put_le(length, files.size(), 8);
+    out.write(length.data(), length.size());
+    if (!write_section(out, files) || !out.flush()) {
+        std::cerr << "send: Error writing the stream" << std::endl;
+        return false;
+    }
+    sent += length.size() + files.size() + 4;
+
+    std::cout << "send: '" << (from ? from_snapshot : "(full)") << "' -> '" << to_snapshot << "': "
+              << new_blocks.size() << " new blocks, " << to->entries.size() << " files, "
+              << sent << " bytes" << std::endl;
+    return true;
+}
+
+bool COWFileSystem::receive(std::istream& in) {
+    std::lock_guard<PriorityMutex> lock(fs_mutex);
+    char fixed[SEND_HEADER_SIZE];
+    if (!in.read(fixed, sizeof(fixed))) {
+        std::cerr << "receive: Truncated stream" << std::endl;
+        return false;
+    }
+    LeReader fields(fixed, sizeof(fixed));
+    fields.take(sizeof(SEND_MAGIC));
+    uint64_t format_version = fields.get(4);
+    uint64_t block_size = fields.get(4);
+    int64_t from_timestamp = static_cast<int64_t>(fields.get(8));
+    int64_t to_timestamp = static_cast<int64_t>(fields.get(8));
+    uint64_t from_blocks = fields.get(8);
+    uint64_t new_blocks = fields.get(8);
+    uint64_t file_count = fields.get(8);
+    uint64_t from_name_length = fields.get(4);
+    uint64_t to_name_length = fields.get(4);
+    if (std::memcmp(fixed, SEND_MAGIC, sizeof(SEND_MAGIC)) != 0 || format_version != SEND_FORMAT_VERSION ||
+        block_size != BLOCK_SIZE || from_name_length > SEND_MAX_NAME_LENGTH ||
+        to_name_length > SEND_MAX_NAME_LENGTH) {
+        std::cerr << "receive: Invalid stream header" << std::endl;
+        return false;
+    }
+    std::string header(fixed, sizeof(fixed));
+    if (!read_section(in, from_name_length + to_name_length, header)) {
+        std::cerr << "receive: Corrupt or truncated stream header" << std::endl;
+        return false;
+    }
+    std::string from_name = header.substr(SEND_HEADER_SIZE, from_name_length);
+    std::string to_name = header.substr(SEND_HEADER_SIZE + from_name_length);
+    if (to_name.empty() || find_snapshot(to_name)) {
+        std::cerr << "receive: Invalid or duplicated snapshot name: " << to_name << std::endl;
+        return false;
+    }
+
+    // Un flujo incremental solo encaja sobre el mismo snapshot base del emisor
+    const Snapshot* from = from_name.empty() ? nullptr : find_snapshot(from_name);
+    if (from_name.empty() ? from_blocks != 0
+                          : !from || from->timestamp != from_timestamp ||
+                                from->block_table.size() != from_blocks) {
+        std::cerr << "receive: Base snapshot '" << from_name << "' is missing or does not match" << std::endl;
+        return false;
+    }
+    if (file_count > inodes.size()) {
+        std::cerr << "receive: Not enough free inodes" << std::endl;
+        return false;
+    }
+
+    // Los bloques nuevos se reservan de una vez; hasta publicar el snapshot
+    // tienen 0 referencias y se liberan si algo falla
+    std::vector<size_t> local;
+    if (new_blocks > blocks.size() || !allocate_blocks(new_blocks, local)) {
+        std::cerr << "receive: No space for " << new_blocks << " blocks" << std::endl;
+        return false;
+    }
+    auto fail = [&](const char* reason) {
+        std::cerr << "receive: " << reason << std::endl;
+        for (size_t block : local) {
+            free_block(block);
+        }
+        return false;
+    };
+
+    for (size_t block : local) {
+        char checksum[4];
+        blocks.touch(block, true);
+        if (!in.read(checksum, sizeof(checksum)) ||
+            !in.read(reinterpret_cast<char*>(blocks.data(block)), BLOCK_SIZE)) {
+            return fail("Truncated stream");
+        }
+        seal_block(block);
+        if (blocks.checksum[block] != LeReader(checksum, sizeof(checksum)).get(4)) {
+            return fail("Checksum mismatch in a stream block");
+        }
+    }
+
+    char length[8];
+    std::string files;
+    if (!in.read(length, sizeof(length)) ||
+        !read_section(in, LeReader(length, sizeof(length)).get(8), files)) {
+        return fail("Corrupt or truncated file section");
+    }
+
+    // Ningun archivo puede ser mayor que lo que direcciona la imagen: asi el
+    // tamano y los tramos de un flujo manipulado no desbordan ni piden un
+    // mapa desproporcionado para los bytes que trae
+    const uint64_t max_size = static_cast<uint64_t>(blocks.size()) * BLOCK_SIZE;
+
+    Snapshot snap;
+    snap.name = to_name;
+    snap.timestamp = to_timestamp;
+    std::vector<bool> referenced(local.size(), false);
+    LeReader reader(files.data(), files.size());
+    for (uint64_t f = 0; f < file_count; f++) {
+        size_t name_length = reader.get(2);
+        const char* name = reader.take(name_length);
+        uint64_t version_number = reader.get(8);
+        uint64_t size = reader.get(8);
+        uint64_t block_count = reader.get(8);
+        uint64_t run_count = reader.get(8);
+        if (!reader.ok() || name_length == 0 || name_length >= MAX_FILENAME_LENGTH ||
+            std::memchr(name, '\0', name_length) || size > max_size ||
+            block_count > (size + BLOCK_SIZE - 1) / BLOCK_SIZE) {
+            return fail("Invalid file entry");
+        }
+        SnapshotEntry entry;
+        std::memset(entry.filename, 0, MAX_FILENAME_LENGTH);
+        std::memcpy(entry.filename, name, name_length);
+        if (snap.find_entry(entry.filename)) {
+            return fail("Invalid file entry");
+        }
+        entry.version_number = version_number;
+        entry.size = size;
+        entry.map_offset = snap.block_table.size();
+        entry.block_count = block_count;
+
+        for (uint64_t r = 0; r < run_count; r++) {
+            uint64_t source = reader.get(8);
+            uint64_t run_length = reader.get(8);
+            if (!reader.ok() || run_length > entry.block_count - (snap.block_table.size() - entry.map_offset)) {
+                return fail("Invalid block map");
+            }
+            for (uint64_t k = 0; k < run_length; k++) {
+                size_t block = HOLE_BLOCK;
+                if (source == SEND_HOLE) {
+                    block = HOLE_BLOCK;
+                } else if (source & SEND_FROM_BASE) {
+                    uint64_t position = (source & ~SEND_FROM_BASE) + k;
+                    if (!from || position >= from->block_table.size() ||
+                        from->block_table[position] == HOLE_BLOCK) {
+                        return fail("Invalid block map");
+                    }
+                    block = from->block_table[position];
+                } else {
+                    uint64_t index = source + k;
+                    if (index >= local.size()) {
+                        return fail("Invalid block map");
+                    }
+                    block = local[index];
+                    referenced[index] = true;
+                }
+                snap.block_table.push_back(block);
+            }
+        }
+        if (snap.block_table.size() - entry.map_offset != entry.block_count) {
+            return fail("Invalid block map");
+        }
+        snap.entries.push_back(entry);
+    }
+    if (!reader.at_end()) {
+        return fail("Trailing data in file section");
+    }
+    if (std::find(referenced.begin(), referenced.end(), false) != referenced.end()) {
+        return fail("Stream blocks without references");
+    }
+
+    increment_block_refs(snap.block_table.data(), snap.block_table.size());
+    snapshots.push_back(std::move(snap));
+    snapshots_generation = next_generation();
+    std::cout << "receive: Snapshot '" << to_name << "' received with " << local.size()
+              << " new blocks and " << file_count << " files" << std::endl;
+
+    // Hay inodos para todos los archivos del snapshot, asi que restore() no falla
+    return restore(to_name);
+}
+
+} // namespace cowfs
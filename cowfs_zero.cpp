@@ -0,0 +1,70 @@
+#include "cowfs_zero.hpp"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COWFS_ZERO_AVX2 1
+#endif
+
+namespace cowfs {
+
+namespace {
+
+bool is_all_zero_words(const uint8_t* bytes, size_t size) {
+    // Se acumulan 64 bytes con OR antes de comprobar
+    while (size >= 64) {
+        uint64_t words[8];
+        std::memcpy(words, bytes, sizeof(words));
+        if ((words[0] | words[1] | words[2] | words[3] | words[4] | words[5] | words[6] | words[7]) != 0) {
+            return false;
+        }
+        bytes += 64;
+        size -= 64;
+    }
+    while (size > 0) {
+        if (*bytes++ != 0) {
+            return false;
+        }
+        size--;
+    }
+    return true;
+}
+
+#ifdef COWFS_ZERO_AVX2
+__attribute__((target("avx2")))
+bool is_all_zero_avx2(const uint8_t* bytes, size_t size) {
+    while (size >= 128) {
+        const __m256i* p = reinterpret_cast<const __m256i*>(bytes);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+                                      _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+        if (!_mm256_testz_si256(any, any)) {
+            return false;
+        }
+        bytes += 128;
+        size -= 128;
+    }
+    return is_all_zero_words(bytes, size);
+}
+#endif
+
+using ZeroCheckFunction = bool (*)(const uint8_t*, size_t);
+
+// Se elige la implementacion una sola vez, en la primera llamada
+ZeroCheckFunction select_zero_check() {
+#ifdef COWFS_ZERO_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return is_all_zero_avx2;
+    }
+#endif
+    return is_all_zero_words;
+}
+
+} // namespace
+
+bool is_all_zero(const void* data, size_t size) {
+    static const ZeroCheckFunction implementation = select_zero_check();
+    return implementation(static_cast<const uint8_t*>(data), size);
+}
+
+} // namespace cowfs
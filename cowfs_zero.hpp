@@ -0,0 +1,19 @@
+#ifndef COWFS_ZERO_HPP
+#define COWFS_ZERO_HPP
+
+#include <cstddef>
+
+namespace cowfs {
+
+/**
+ * @brief true si los `size` bytes de `data` son todos cero
+ *
+ * Usa AVX2 cuando el procesador lo soporta y palabras de 64 bits en caso
+ * contrario. Se detiene en el primer grupo con algun bit a uno, asi que
+ * descartar datos normales cuesta poco.
+ */
+bool is_all_zero(const void* data, size_t size);
+
+} // namespace cowfs
+
+#endif // COWFS_ZERO_HPP
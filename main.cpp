@@ -5,6 +5,9 @@
 #include <cstring>
 #include <iomanip>
 #include <fstream>
+#include <cstdio>
+#include <sstream>
+#include <algorithm>
 #include "cowfs_metadata.hpp"
 
 // Funcion para mostrar el encabezado de una seccion
@@ -23,9 +26,6 @@ void mostrarVersionesDetalladas(cowfs::COWFileSystem& fs, const std::string& nom
         return;
     }
     
-    // Obtenemos el historial de versiones
-    auto versiones = fs.get_version_history(fd);
-    
     std::cout << "\nMETADATOS DE VERSIONES DEL ARCHIVO '" << nombre_archivo << "':" << std::endl;
     std::cout << std::string(70, '-') << std::endl;
     std::cout << std::left << std::setw(10) << "Version" 
@@ -36,16 +36,21 @@ void mostrarVersionesDetalladas(cowfs::COWFileSystem& fs, const std::string& nom
               << "Version previa" << std::endl;
     std::cout << std::string(90, '-') << std::endl;
     
-    for (const auto& v : versiones) {
-        std::cout << std::left << std::setw(10) << v.version_number 
-                  << std::setw(20) << v.timestamp 
-                  << std::setw(15) << v.size 
-                  << std::setw(15) << v.delta_start
-                  << std::setw(15) << v.delta_size
-                  << v.prev_version << std::endl;
-    }
+    // Recorremos el historial de versiones (vista sin copia)
+    size_t total_versiones = 0;
+    fs.with_versions(fd, [&](const cowfs::VersionSpan& versiones) {
+        for (const auto& v : versiones) {
+            std::cout << std::left << std::setw(10) << v.version_number 
+                      << std::setw(20) << cowfs::format_timestamp(v.timestamp) 
+                      << std::setw(15) << v.size 
+                      << std::setw(15) << v.delta_start
+                      << std::setw(15) << v.delta_size
+                      << v.prev_version << std::endl;
+        }
+        total_versiones = versiones.size();
+    });
     std::cout << std::string(70, '-') << std::endl;
-    std::cout << "Numero total de versiones: " << versiones.size() << std::endl;
+    std::cout << "Numero total de versiones: " << total_versiones << std::endl;
     
     // Cerramos el archivo ya que no lo necesitamos mas
     fs.close(fd);
@@ -217,12 +222,128 @@ bool hacerRollback(cowfs::COWFileSystem& fs, const std::string& nombre_archivo,
     return resultado;
 }
 
+// Lee el contenido completo de un archivo; vacio si no existe
+std::string leerArchivo(cowfs::COWFileSystem& fs, const std::string& nombre_archivo) {
+    cowfs::fd_t fd = fs.open(nombre_archivo, cowfs::FileMode::READ);
+    if (fd < 0) {
+        return std::string();
+    }
+    std::string contenido(fs.get_file_size(fd), '\0');
+    ssize_t leidos = fs.read(fd, &contenido[0], contenido.size());
+    fs.close(fd);
+    contenido.resize(leidos > 0 ? static_cast<size_t>(leidos) : 0);
+    return contenido;
+}
+
+// Comprueba que dos imagenes tienen los mismos archivos con el mismo contenido
+bool mismoContenido(cowfs::COWFileSystem& a, cowfs::COWFileSystem& b) {
+    std::vector<std::string> archivos_a, archivos_b;
+    a.list_files(archivos_a);
+    b.list_files(archivos_b);
+    std::sort(archivos_a.begin(), archivos_a.end());
+    std::sort(archivos_b.begin(), archivos_b.end());
+    if (archivos_a != archivos_b) {
+        return false;
+    }
+    for (const auto& archivo : archivos_a) {
+        if (leerArchivo(a, archivo) != leerArchivo(b, archivo)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Envia snapshots de una imagen a otra y comprueba el resultado. Devuelve
+// false si alguna comprobacion falla
+bool demostrarEnvioSnapshots() {
+    std::remove("cowfs_origen.dat");
+    std::remove("cowfs_destino.dat");
+    cowfs::COWFileSystem origen("cowfs_origen.dat", 4 * 1024 * 1024);
+    cowfs::COWFileSystem destino("cowfs_destino.dat", 4 * 1024 * 1024);
+    auto fallo = [](const char* motivo) {
+        std::cerr << "FALLO EN EL ENVIO DE SNAPSHOTS: " << motivo << std::endl;
+        return false;
+    };
+
+    // Un archivo de 64 bloques distintos, una copia que comparte sus bloques
+    // y un archivo pequeno
+    std::string datos;
+    for (size_t i = 0; i < 64 * cowfs::BLOCK_SIZE; i++) {
+        datos.push_back(static_cast<char>('a' + (i / cowfs::BLOCK_SIZE + i * 7) % 26));
+    }
+    cowfs::fd_t fd = origen.create("datos.bin");
+    origen.write(fd, datos.data(), datos.size());
+    origen.close(fd);
+    origen.copy_file("datos.bin", "copia.bin");
+    fd = origen.create("notas.txt");
+    origen.write(fd, "primera nota", 12);
+    origen.close(fd);
+    origen.snapshot("base");
+
+    std::stringstream completo;
+    if (!origen.send("", "base", completo) || !destino.receive(completo)) {
+        return fallo("no se pudo enviar el flujo completo");
+    }
+    std::cout << "Flujo completo recibido: " << completo.str().size() << " bytes" << std::endl;
+
+    // Cambiar un bloque y agregar un archivo; el incremental solo lleva eso
+    datos[10 * cowfs::BLOCK_SIZE] = '#';
+    fd = origen.open("datos.bin", cowfs::FileMode::WRITE);
+    origen.write(fd, datos.data(), datos.size());
+    origen.close(fd);
+    fd = origen.create("nuevo.txt");
+    origen.write(fd, "archivo nuevo", 13);
+    origen.close(fd);
+    origen.snapshot("siguiente");
+
+    std::stringstream incremental;
+    if (!origen.send("base", "siguiente", incremental)) {
+        return fallo("no se pudo generar el flujo incremental");
+    }
+    std::string flujo = incremental.str();
+    std::cout << "Flujo incremental: " << flujo.size() << " bytes" << std::endl;
+
+    // Un flujo danado se rechaza sin tocar la imagen destino
+    size_t usados = destino.space_report().used_bytes;
+    std::string danado = flujo;
+    danado[danado.size() / 2] ^= 1;
+    std::istringstream entrada_danada(danado);
+    if (destino.receive(entrada_danada) || destino.space_report().used_bytes != usados) {
+        return fallo("se acepto un flujo danado");
+    }
+    std::cout << "Flujo danado rechazado" << std::endl;
+
+    std::istringstream entrada(flujo);
+    if (!destino.receive(entrada)) {
+        return fallo("no se pudo recibir el flujo incremental");
+    }
+    if (!mismoContenido(origen, destino)) {
+        return fallo("el contenido de las imagenes difiere");
+    }
+    std::cout << "Contenido identico en las dos imagenes" << std::endl;
+
+    // Los bloques compartidos en el origen tambien se comparten en el destino
+    cowfs::SpaceReport espacio_origen = origen.space_report();
+    cowfs::SpaceReport espacio_destino = destino.space_report();
+    std::cout << "Bytes usados: origen " << espacio_origen.used_bytes << ", destino "
+              << espacio_destino.used_bytes << std::endl;
+    if (espacio_destino.used_bytes != espacio_origen.used_bytes ||
+        espacio_destino.shared_bytes != espacio_origen.shared_bytes) {
+        return fallo("el destino no conserva la comparticion de bloques");
+    }
+    std::cout << "La comparticion de bloques se conserva" << std::endl;
+    return true;
+}
+
 int main() {
     try {
         mostrarSeccion("EJEMPLO DE SISTEMA DE ARCHIVOS CON COPY-ON-WRITE (COW)");
         
         // Crear un sistema de archivos de 10MB
         const size_t TAMANO_DISCO = 10 * 1024 * 1024; // 10MB
+        // La demostracion parte siempre de un disco vacio; la imagen de una
+        // ejecucion anterior se cargaria con sus archivos ya creados
+        std::remove("cowfs_disk.dat");
         cowfs::COWFileSystem fs("cowfs_disk.dat", TAMANO_DISCO);
         
         std::cout << "Sistema de archivos COW inicializado correctamente" << std::endl;
@@ -350,6 +471,17 @@ int main() {
         mostrarContenido(fs, nombre_archivo);
         mostrarVersionesDetalladas(fs, nombre_archivo);
 
+        //======================================================================
+        // DEMOSTRACIÓN 3: ENVÍO DE SNAPSHOTS ENTRE IMÁGENES
+        //======================================================================
+        mostrarSeccion("DEMOSTRACION 3: ENVIO DE SNAPSHOTS ENTRE IMAGENES");
+
+        std::cout << "Se envia un snapshot completo de una imagen a otra, despues un" << std::endl;
+        std::cout << "incremental, y se comprueba que las dos imagenes quedan iguales." << std::endl;
+        if (!demostrarEnvioSnapshots()) {
+            return 1;
+        }
+
         // Guardar metadatos después de las operaciones
         std::cout << "\nGuardando metadatos del sistema..." << std::endl;
         if (cowfs::MetadataManager::save_and_print_metadata(fs, "version_final")) {